@@ -27,6 +27,7 @@
 #include "config.h"
 #include "poll.h"
 #include "netasync.h"
+#include "bufpool.h"
 #include "key.h"
 #include "addrbook.h"
 #include "serialize.h"
@@ -1100,6 +1101,7 @@ bitc_exit(void)
    btc->blockStore = NULL;
    bitc_req_exit();
    netasync_exit();
+   bufpool_exit();
    bitc_poll_exit();
 
    config_free(btc->txLabelsCfg);
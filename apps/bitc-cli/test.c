@@ -1,4 +1,8 @@
+#include <errno.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #ifdef __APPLE__
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 #endif
@@ -12,9 +16,15 @@
 #include "bitc.h"
 #include "serialize.h"
 #include "block-store.h"
+#include "peergroup.h"
+#include "config.h"
+#include "file.h"
 #include "crypt.h"
 #include "hashtable.h"
 #include "poolworker.h"
+#include "slab.h"
+#include "poll.h"
+#include "bufpool.h"
 #include "test.h"
 
 #define LGPFX "TEST:"
@@ -191,6 +201,427 @@ bitc_crypt_test(void)
 }
 
 
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_reorg_test_mk --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_reorg_test_mk(const uint256    *prev,
+                   uint32            timestamp,
+                   uint32            nonce,
+                   btc_block_header *hdr,
+                   uint256          *hash)
+{
+   memset(hdr, 0, sizeof *hdr);
+   hdr->version   = 2;
+   hdr->timestamp = timestamp;
+   hdr->bits      = 0x1d00ffff;
+   hdr->nonce     = nonce;
+   memcpy(&hdr->prevBlock, prev, sizeof *prev);
+
+   hash256_calc(hdr, sizeof *hdr, hash);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_reorg_test_add --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_reorg_test_add(struct blockstore *bs,
+                    const uint256     *prev,
+                    uint32             timestamp,
+                    uint32             nonce,
+                    uint256           *hash)
+{
+   btc_block_header hdr;
+   bool orphan;
+   bool s;
+
+   bitc_reorg_test_mk(prev, timestamp, nonce, &hdr, hash);
+   s = blockstore_add_header(bs, &hdr, hash, &orphan);
+   ASSERT(s);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_reorg_test_check --
+ *
+ *      Verifies that the best chain is made of 'a' up to 'fork', then of
+ *      'b' up to 'height'.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_reorg_test_check(struct blockstore *bs,
+                      const uint256     *a,
+                      const uint256     *b,
+                      int                fork,
+                      int                height)
+{
+   btc_block_header hdr;
+   uint256 hash;
+   int h;
+
+   ASSERT(blockstore_get_height(bs) == height);
+
+   for (h = 0; h <= height; h++) {
+      const uint256 *expected = h <= fork ? a + h : b + h - fork - 1;
+      bool s;
+
+      s = blockstore_get_block_at_height(bs, h, &hash, &hdr);
+      ASSERT(s);
+      ASSERT(uint256_issame(&hash, expected));
+      if (h > 0) {
+         ASSERT(blockstore_is_next(bs, h <= fork + 1 ? a + h - 1 : b + h - fork - 2,
+                                   expected));
+      }
+   }
+   blockstore_get_best_hash(bs, &hash);
+   ASSERT(uint256_issame(&hash, height <= fork ? a + height : b + height - fork - 1));
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_reorg_test_queue --
+ *
+ *      Queues a chunk of the 'num' blocks past the cursor, the way the
+ *      filtered block download lays them out with a single wallet filter.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_reorg_test_queue(struct peergroup  *pg,
+                      struct blockstore *bs,
+                      int                num)
+{
+   struct blksync_chunk *chunk;
+   uint256 *hashes;
+   int n;
+
+   blockstore_get_next_hashes(bs, &pg->blkCursor, num, &hashes, &n);
+   ASSERT(n == num);
+
+   pg->blkChunks = safe_realloc(pg->blkChunks, (pg->numBlkChunks + 1) *
+                                               sizeof *pg->blkChunks);
+   chunk = pg->blkChunks + pg->numBlkChunks;
+   pg->numBlkChunks++;
+
+   memset(chunk, 0, sizeof *chunk);
+   chunk->hashes = hashes;
+   chunk->blks   = safe_calloc(n, sizeof *chunk->blks);
+   chunk->num    = n;
+   chunk->height = blockstore_get_block_height(bs, hashes);
+
+   memcpy(&pg->blkCursor, hashes + n - 1, sizeof *hashes);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_reorg_test_branch --
+ *
+ *      Sends 'num' headers forking at 'fork' the way a peer would.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_reorg_test_branch(struct blockstore *bs,
+                       int                fork,
+                       int                num,
+                       uint32             timestamp)
+{
+   btc_block_header *hdrs;
+   btc_block_header hdr;
+   uint256 *hashes;
+   uint256 prev;
+   bool s;
+   int res;
+   int i;
+
+   hdrs = safe_malloc(num * sizeof *hdrs);
+   hashes = safe_malloc(num * sizeof *hashes);
+
+   s = blockstore_get_block_at_height(bs, fork, &prev, &hdr);
+   ASSERT(s);
+   for (i = 0; i < num; i++) {
+      bitc_reorg_test_mk(i == 0 ? &prev : hashes + i - 1,
+                         timestamp + (fork + i + 1) * 600, i, hdrs + i,
+                         hashes + i);
+   }
+   res = peergroup_handle_headers(NULL, 0, hdrs, hashes, num);
+   ASSERT(res == 0);
+   ASSERT(blockstore_get_height(bs) == fork + num);
+
+   free(hashes);
+   free(hdrs);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_reorg_test_blksync --
+ *
+ *      Switches the best chain while filtered blocks are being fetched in
+ *      chunks of REORG_TEST_CHUNK blocks: first to a branch forking in the
+ *      middle of the queued chunks, then to one forking below the last
+ *      block applied. The chunks past the fork point must be dropped and
+ *      the cursor go back there.
+ *
+ *---------------------------------------------------------------------
+ */
+
+#define REORG_TEST_CHUNK    100
+
+static void
+bitc_reorg_test_blksync(struct blockstore *bs,
+                        uint32             timestamp)
+{
+   struct peergroup *peerGroup = btc->peerGroup;
+   struct blockstore *blockStore = btc->blockStore;
+   struct wallet *wallet = btc->wallet;
+   enum bitc_state state = btc->state;
+   btc_block_header hdr;
+   struct peergroup *pg;
+   uint256 hash;
+   int height;
+   int i;
+
+   pg = safe_calloc(1, sizeof *pg);
+   btc->peerGroup  = pg;
+   btc->blockStore = bs;
+   btc->wallet     = NULL;
+   btc->state      = BITC_STATE_UPDATE_TXDB;
+
+   height = blockstore_get_height(bs);
+   blockstore_get_block_at_height(bs, height - 3 * REORG_TEST_CHUNK,
+                                  &pg->lastBlk, &hdr);
+   memcpy(&pg->blkCursor, &pg->lastBlk, sizeof pg->lastBlk);
+   for (i = 0; i < 3; i++) {
+      bitc_reorg_test_queue(pg, bs, REORG_TEST_CHUNK);
+   }
+
+   bitc_reorg_test_branch(bs, height - 3 * REORG_TEST_CHUNK / 2,
+                          2 * REORG_TEST_CHUNK, timestamp + 3);
+   ASSERT(pg->numBlkChunks == 1);
+   blockstore_get_block_at_height(bs, height - 2 * REORG_TEST_CHUNK, &hash, &hdr);
+   ASSERT(uint256_issame(&pg->blkCursor, &hash));
+   ASSERT(blockstore_has_header(bs, &pg->lastBlk));
+
+   height = blockstore_get_height(bs);
+   bitc_reorg_test_queue(pg, bs, REORG_TEST_CHUNK);
+   bitc_reorg_test_branch(bs, height - 5 * REORG_TEST_CHUNK,
+                          6 * REORG_TEST_CHUNK, timestamp + 4);
+   ASSERT(pg->numBlkChunks == 0);
+   blockstore_get_block_at_height(bs, height - 5 * REORG_TEST_CHUNK, &hash, &hdr);
+   ASSERT(uint256_issame(&pg->blkCursor, &hash));
+   ASSERT(uint256_issame(&pg->lastBlk, &hash));
+
+   printf("reorg while fetching blocks: ok.\n");
+
+   free(pg->blkChunks);
+   free(pg);
+   btc->peerGroup  = peerGroup;
+   btc->blockStore = blockStore;
+   btc->wallet     = wallet;
+   btc->state      = state;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_reorg_test --
+ *
+ *      Builds a chain on top of the testnet genesis block, then a branch
+ *      forking REORG_TEST_DEPTH blocks below its tip that overtakes it.
+ *      Extending the first chain then switches back to it. Finally, a third
+ *      branch shows up in reverse order, REORG_TEST_ORPHANS headers at a
+ *      time: it only connects once its first headers arrive. The headers are
+ *      then reloaded from disk, which replays all the reorgs. Last, with
+ *      orphans expiring right away, a header shows up whose parent is an
+ *      orphan that gets evicted meanwhile: it only connects once the parent
+ *      is sent again. Last, the best chain switches while filtered blocks
+ *      are being fetched, cf. bitc_reorg_test_blksync().
+ *
+ *---------------------------------------------------------------------
+ */
+
+#define REORG_TEST_FORK     2000
+#define REORG_TEST_DEPTH    10000
+#define REORG_TEST_ORPHANS  100
+
+static void
+bitc_reorg_test(void)
+{
+   int heightA = REORG_TEST_FORK + REORG_TEST_DEPTH;
+   bool testnet = btc->testnet;
+   struct blockstore *bs;
+   struct config *config;
+   btc_block_header genesis;
+   btc_block_header *hdrs;
+   char path[PATH_MAX];
+   char idxPath[PATH_MAX];
+   uint256 *a;
+   uint256 *b;
+   uint256 *c;
+   uint256 d[3];
+   uint256 hash;
+   mtime_t ts;
+   int forkC;
+   int numC;
+   char *dir;
+   char *latStr;
+   bool orphan;
+   bool s;
+   int res;
+   int i;
+
+   /*
+    * The genesis block of testnet3: its hash is the testnet checkpoint.
+    */
+   btc->testnet = 1;
+   memset(&genesis, 0, sizeof genesis);
+   genesis.version   = 1;
+   genesis.timestamp = 1296688602;
+   genesis.bits      = 0x1d00ffff;
+   genesis.nonce     = 414098458;
+   uint256_from_str("4a5e1e4baab89f3a32518a88c31bc87f618f76673e2cc77ab2127b7afdeda33b",
+                    &genesis.merkleRoot);
+
+   dir = bitc_get_directory();
+   snprintf(path, sizeof path, "%s/reorg-test.dat", dir);
+   snprintf(idxPath, sizeof idxPath, "%s/reorg-test.idx", dir);
+   free(dir);
+   file_unlink(path);
+   file_unlink(idxPath);
+
+   config = config_create();
+   config_setstring(config, path, "headers.filename");
+
+   res = blockstore_init(config, &bs);
+   ASSERT(res == 0);
+
+   a = safe_malloc((heightA + 3) * sizeof *a);
+   b = safe_malloc((REORG_TEST_DEPTH + 1) * sizeof *b);
+
+   hash256_calc(&genesis, sizeof genesis, a);
+   s = blockstore_add_header(bs, &genesis, a, &orphan);
+   ASSERT(s);
+
+   for (i = 1; i <= heightA; i++) {
+      bitc_reorg_test_add(bs, a + i - 1, genesis.timestamp + i * 600, i, a + i);
+   }
+   bitc_reorg_test_check(bs, a, NULL, heightA, heightA);
+   blockstore_write_headers(bs);
+
+   ts = time_get();
+   for (i = 0; i <= REORG_TEST_DEPTH; i++) {
+      bitc_reorg_test_add(bs, i == 0 ? a + REORG_TEST_FORK : b + i - 1,
+                          genesis.timestamp + (REORG_TEST_FORK + i + 1) * 600 + 1,
+                          i, b + i);
+   }
+   ts = time_get() - ts;
+
+   bitc_reorg_test_check(bs, a, b, REORG_TEST_FORK, heightA + 1);
+   blockstore_write_headers(bs);
+
+   latStr = print_latency(ts);
+   printf("%u-block reorg: branch added in %s.\n", REORG_TEST_DEPTH, latStr);
+   free(latStr);
+
+   for (i = heightA + 1; i <= heightA + 2; i++) {
+      bitc_reorg_test_add(bs, a + i - 1, genesis.timestamp + i * 600, i, a + i);
+   }
+   bitc_reorg_test_check(bs, a, NULL, heightA + 2, heightA + 2);
+   blockstore_write_headers(bs);
+
+   forkC = heightA - REORG_TEST_ORPHANS;
+   numC = 6 * REORG_TEST_ORPHANS;
+   hdrs = safe_malloc(numC * sizeof *hdrs);
+   c = safe_malloc(numC * sizeof *c);
+
+   for (i = 0; i < numC; i++) {
+      bitc_reorg_test_mk(i == 0 ? a + forkC : c + i - 1,
+                         genesis.timestamp + (forkC + i + 1) * 600 + 2, i,
+                         hdrs + i, c + i);
+   }
+   for (i = numC - REORG_TEST_ORPHANS; i >= 0; i -= REORG_TEST_ORPHANS) {
+      int numAdded;
+      int numOrphans;
+
+      res = blockstore_add_headers(bs, hdrs + i, c + i, REORG_TEST_ORPHANS,
+                                   &numAdded, &numOrphans);
+      ASSERT(res == 0);
+      ASSERT(numAdded == REORG_TEST_ORPHANS);
+      if (i > 0) {
+         ASSERT(numOrphans == REORG_TEST_ORPHANS);
+         ASSERT(blockstore_get_height(bs) == heightA + 2);
+      }
+   }
+   bitc_reorg_test_check(bs, a, c, forkC, forkC + numC);
+   blockstore_exit(bs);
+
+   res = blockstore_init(config, &bs);
+   ASSERT(res == 0);
+   bitc_reorg_test_check(bs, a, c, forkC, forkC + numC);
+   blockstore_exit(bs);
+
+   config_setint64(config, 0, "headers.orphanExpiry");
+   res = blockstore_init(config, &bs);
+   ASSERT(res == 0);
+
+   for (i = 0; i < ARRAYSIZE(d); i++) {
+      bitc_reorg_test_mk(i == 0 ? c + numC - 1 : d + i - 1,
+                         genesis.timestamp + (forkC + numC + i + 1) * 600 + 2,
+                         i, hdrs + i, d + i);
+   }
+   s = blockstore_add_header(bs, hdrs + 1, d + 1, &orphan);
+   ASSERT(s && orphan);
+   s = blockstore_add_header(bs, hdrs + 2, d + 2, &orphan);
+   ASSERT(s && orphan);
+   ASSERT(!blockstore_is_orphan(bs, d + 1));
+   s = blockstore_add_header(bs, hdrs + 0, d + 0, &orphan);
+   ASSERT(s && !orphan);
+   ASSERT(blockstore_get_height(bs) == forkC + numC + 1);
+   s = blockstore_add_header(bs, hdrs + 1, d + 1, &orphan);
+   ASSERT(s);
+   ASSERT(blockstore_get_height(bs) == forkC + numC + 3);
+   blockstore_get_best_hash(bs, &hash);
+   ASSERT(uint256_issame(&hash, d + 2));
+   bitc_reorg_test_blksync(bs, genesis.timestamp);
+   blockstore_exit(bs);
+
+   printf("%u-block reorg: ok.\n", REORG_TEST_DEPTH);
+
+   free(hdrs);
+   free(a);
+   free(b);
+   free(c);
+   config_free(config);
+   file_unlink(path);
+   file_unlink(idxPath);
+   btc->testnet = testnet;
+}
+
+
 /*
  *---------------------------------------------------------------------
  *
@@ -206,6 +637,454 @@ bitc_hashtable_test(void)
 }
 
 
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_slab_test_get_rss --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static uint64
+bitc_slab_test_get_rss(void)
+{
+#ifdef linux
+   unsigned long size = 0;
+   unsigned long rss = 0;
+   FILE *f;
+
+   f = fopen("/proc/self/statm", "r");
+   if (f == NULL) {
+      return 0;
+   }
+   if (fscanf(f, "%lu %lu", &size, &rss) != 2) {
+      rss = 0;
+   }
+   fclose(f);
+   return (uint64)rss * sysconf(_SC_PAGESIZE);
+#else
+   return 0;
+#endif
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_slab_test_one --
+ *
+ *      Builds a synthetic chain of 'n' block index entries the way the
+ *      blockstore does: one object per header and one hashtable node keyed
+ *      by its hash. With 'useSlab', both come from slabs.
+ *
+ *---------------------------------------------------------------------
+ */
+
+struct bitc_slab_test_entry {
+   struct bitc_slab_test_entry *prev;
+   struct bitc_slab_test_entry *next;
+   btc_block_header             header;
+   uint256                      hash;
+   int                          height;
+};
+
+static void
+bitc_slab_test_one(uint32 n,
+                   bool   useSlab)
+{
+   struct bitc_slab_test_entry *prev = NULL;
+   struct hashtable *ht;
+   struct slab *slab = NULL;
+   uint64 rss0;
+   uint64 rss1;
+   mtime_t tsInsert;
+   mtime_t tsFree;
+   uint32 i;
+
+   rss0 = bitc_slab_test_get_rss();
+   tsInsert = time_get();
+
+   if (useSlab) {
+      ht = hashtable_create_fixed("test", sizeof(uint256));
+      slab = slab_create("test", sizeof *prev);
+   } else {
+      ht = hashtable_create();
+   }
+
+   for (i = 0; i < n && btc->stop == 0; i++) {
+      struct bitc_slab_test_entry *e;
+      bool s;
+
+      e = useSlab ? slab_alloc(slab) : safe_malloc(sizeof *e);
+      memset(&e->header, 0, sizeof e->header);
+      memset(&e->hash, 0, sizeof e->hash);
+      memcpy(e->hash.data, &i, sizeof i);
+      e->header.nonce = i;
+      e->height = i;
+      e->prev = prev;
+      e->next = NULL;
+      if (prev) {
+         memcpy(&e->header.prevBlock, &prev->hash, sizeof prev->hash);
+         prev->next = e;
+      }
+      s = hashtable_insert(ht, &e->hash, sizeof e->hash, e);
+      ASSERT(s);
+      prev = e;
+   }
+
+   tsInsert = time_get() - tsInsert;
+   rss1 = bitc_slab_test_get_rss();
+   tsFree = time_get();
+
+   if (useSlab) {
+      hashtable_clear(ht);
+      slab_destroy(slab);
+   } else {
+      hashtable_clear_with_free(ht);
+   }
+   hashtable_destroy(ht);
+
+   tsFree = time_get() - tsFree;
+
+   printf("%-12s %u entries: insert %.1f msec -- %llu entries/sec, "
+          "rss +%llu MB, teardown %.1f msec\n",
+          useSlab ? "slab:" : "safe_malloc:", i, tsInsert / 1000.0,
+          tsInsert > 0 ? i * 1000ULL * 1000 / tsInsert : 0,
+          rss1 > rss0 ? (rss1 - rss0) / 1024 / 1024 : 0, tsFree / 1000.0);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_slab_test --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_slab_test(void)
+{
+   uint32 n = 4 * 1000 * 1000;
+
+   bitc_slab_test_one(n, TRUE);
+   bitc_slab_test_one(n, FALSE);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_poll_test_read_cb --
+ *
+ *      A few tokens hop around a ring of socketpairs. Every socket has a
+ *      permanent read callback and each hop arms a one-shot write callback
+ *      on the socket it sends on, like netasync_send does, while most
+ *      sockets stay idle.
+ *
+ *---------------------------------------------------------------------
+ */
+
+#define POLL_TEST_NUM_SOCKS   400
+#define POLL_TEST_NUM_TOKENS  4
+#define POLL_TEST_NUM_HOPS    200000
+
+struct bitc_poll_test;
+
+struct bitc_poll_test_sock {
+   struct bitc_poll_test *test;
+   int                    fds[2];
+   bool                   writePending;
+};
+
+struct bitc_poll_test {
+   struct poll_loop          *poll;
+   struct bitc_poll_test_sock socks[POLL_TEST_NUM_SOCKS];
+   uint32                     numHops;
+   volatile int               exit;
+};
+
+static void
+bitc_poll_test_idle_cb(void *clientData)
+{
+   NOT_REACHED();
+}
+
+static void
+bitc_poll_test_write_cb(void *clientData)
+{
+   struct bitc_poll_test_sock *sock = clientData;
+
+   sock->writePending = 0;
+}
+
+static void
+bitc_poll_test_read_cb(void *clientData)
+{
+   struct bitc_poll_test_sock *sock = clientData;
+   struct bitc_poll_test *test = sock->test;
+   struct bitc_poll_test_sock *next;
+   ssize_t res;
+   uint8 c;
+
+   res = read(sock->fds[0], &c, 1);
+   ASSERT(res == 1);
+
+   test->numHops++;
+   if (test->numHops >= POLL_TEST_NUM_HOPS || btc->stop) {
+      test->exit = 1;
+   }
+
+   next = test->socks + (sock - test->socks + 37) % POLL_TEST_NUM_SOCKS;
+   res = write(next->fds[1], &c, 1);
+   ASSERT(res == 1);
+
+   if (next->writePending == 0) {
+      next->writePending = 1;
+      poll_callback_device(test->poll, next->fds[1], 0, 1, 0,
+                           bitc_poll_test_write_cb, next);
+   }
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_poll_test_one --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_poll_test_one(enum poll_backend backend,
+                   const char *name)
+{
+   struct bitc_poll_test *test;
+   mtime_t ts;
+   int n = 0;
+   int i;
+
+   test = safe_calloc(1, sizeof *test);
+   test->poll = poll_create_backend(backend);
+
+   for (n = 0; n < POLL_TEST_NUM_SOCKS; n++) {
+      struct bitc_poll_test_sock *sock = test->socks + n;
+
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock->fds) != 0) {
+         printf("%-8s socketpair failed after %d: %s\n",
+                name, n, strerror(errno));
+         goto exit;
+      }
+      sock->test = test;
+      poll_callback_device(test->poll, sock->fds[0], 1, 0, 1,
+                           bitc_poll_test_read_cb, sock);
+      poll_callback_device(test->poll, sock->fds[1], 1, 0, 1,
+                           bitc_poll_test_idle_cb, sock);
+   }
+
+   for (i = 0; i < POLL_TEST_NUM_TOKENS; i++) {
+      struct bitc_poll_test_sock *sock;
+      ssize_t res;
+      uint8 c = i;
+
+      sock = test->socks + i * POLL_TEST_NUM_SOCKS / POLL_TEST_NUM_TOKENS;
+      res = write(sock->fds[1], &c, 1);
+      ASSERT(res == 1);
+   }
+
+   ts = time_get();
+   poll_runloop(test->poll, &test->exit);
+   ts = time_get() - ts;
+
+   printf("%-8s %u socketpairs, %u tokens: %u hops in %.1f msec -- %.2f usec/hop\n",
+          name, POLL_TEST_NUM_SOCKS, POLL_TEST_NUM_TOKENS, test->numHops,
+          ts / 1000.0, test->numHops ? (double)ts / test->numHops : 0.0);
+
+exit:
+   for (i = 0; i < n; i++) {
+      struct bitc_poll_test_sock *sock = test->socks + i;
+
+      poll_callback_device_remove(test->poll, sock->fds[0], 1, 0, 1,
+                                  bitc_poll_test_read_cb, sock);
+      poll_callback_device_remove(test->poll, sock->fds[1], 1, 0, 1,
+                                  bitc_poll_test_idle_cb, sock);
+      if (sock->writePending) {
+         poll_callback_device_remove(test->poll, sock->fds[1], 0, 1, 0,
+                                     bitc_poll_test_write_cb, sock);
+      }
+      close(sock->fds[0]);
+      close(sock->fds[1]);
+   }
+   poll_destroy(test->poll);
+   free(test);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_poll_test_timers --
+ *
+ *      One timeout per connection, each pushed back several times as
+ *      traffic comes in, then cancelled.
+ *
+ *---------------------------------------------------------------------
+ */
+
+#define POLL_TEST_NUM_TIMERS  10000
+#define POLL_TEST_NUM_REARMS  8
+
+static void
+bitc_poll_test_timer_cb(void *clientData)
+{
+   NOT_REACHED();
+}
+
+static void
+bitc_poll_test_timers(void)
+{
+   struct poll_loop *poll;
+   uint32 *ids;
+   mtime_t ts;
+   uint32 numOps = 0;
+   uint32 i;
+   uint32 j;
+
+   poll = poll_create();
+   ids = safe_calloc(POLL_TEST_NUM_TIMERS, sizeof *ids);
+
+   ts = time_get();
+   for (j = 0; j <= POLL_TEST_NUM_REARMS; j++) {
+      for (i = 0; i < POLL_TEST_NUM_TIMERS; i++) {
+         mtime_t delay = 60 * 1000 * 1000 + (i * 7919 % 1000) * 1000;
+         bool s;
+
+         if (j > 0) {
+            s = poll_callback_time_remove(poll, 0, bitc_poll_test_timer_cb,
+                                          ids + i);
+            ASSERT(s);
+            numOps++;
+         }
+         if (j < POLL_TEST_NUM_REARMS) {
+            poll_callback_time(poll, delay, 0, bitc_poll_test_timer_cb,
+                               ids + i);
+            numOps++;
+         }
+      }
+   }
+   ts = time_get() - ts;
+
+   printf("timers:  %u timeouts, %u arm/cancel in %.1f msec -- %.2f usec/op\n",
+          POLL_TEST_NUM_TIMERS, numOps, ts / 1000.0,
+          numOps ? (double)ts / numOps : 0.0);
+
+   poll_destroy(poll);
+   free(ids);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_poll_test --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_poll_test(void)
+{
+   bitc_poll_test_one(POLL_BACKEND_SELECT, "select:");
+   bitc_poll_test_one(POLL_BACKEND_POLL,   "poll:");
+   bitc_poll_test_one(POLL_BACKEND_EPOLL,  "epoll:");
+   bitc_poll_test_timers();
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_bufpool_test_one --
+ *
+ *      Crafts and frees messages the way a sync does: mostly small inv,
+ *      getdata and ping messages, a few of them queued at a time, with the
+ *      occasional large one.
+ *
+ *---------------------------------------------------------------------
+ */
+
+#define BUFPOOL_TEST_NUM_MSGS   (4 * 1000 * 1000)
+#define BUFPOOL_TEST_QUEUE      16
+
+static void
+bitc_bufpool_test_one(bool usePool)
+{
+   void *queue[BUFPOOL_TEST_QUEUE] = { NULL };
+   struct bufpool_stats stats0;
+   struct bufpool_stats stats1;
+   mtime_t ts;
+   uint32 i;
+
+   bufpool_get_stats(&stats0);
+   ts = time_get();
+
+   for (i = 0; i < BUFPOOL_TEST_NUM_MSGS && btc->stop == 0; i++) {
+      uint32 slot = (i * 7) % BUFPOOL_TEST_QUEUE;
+      size_t len;
+
+      if ((i % 1000) == 0) {
+         len = 100 * 1024;
+      } else {
+         len = 24 + 9 + (i % 50) * sizeof(btc_msg_inv);
+      }
+      if (usePool) {
+         bufpool_free(queue[slot]);
+         queue[slot] = bufpool_alloc(len);
+      } else {
+         free(queue[slot]);
+         queue[slot] = safe_malloc(len);
+      }
+      memset(queue[slot], 0, 24);
+   }
+   for (i = 0; i < BUFPOOL_TEST_QUEUE; i++) {
+      if (usePool) {
+         bufpool_free(queue[i]);
+      } else {
+         free(queue[i]);
+      }
+   }
+
+   ts = time_get() - ts;
+   bufpool_get_stats(&stats1);
+
+   printf("%-12s %u msgs in %.1f msec -- %.1f nsec/msg",
+          usePool ? "bufpool:" : "safe_malloc:", BUFPOOL_TEST_NUM_MSGS,
+          ts / 1000.0, ts * 1000.0 / BUFPOOL_TEST_NUM_MSGS);
+   if (usePool) {
+      printf(", %llu hits, %llu misses",
+             stats1.numHits - stats0.numHits,
+             stats1.numMisses - stats0.numMisses);
+   }
+   printf("\n");
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bitc_bufpool_test --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bitc_bufpool_test(void)
+{
+   bitc_bufpool_test_one(TRUE);
+   bitc_bufpool_test_one(FALSE);
+}
+
+
 /*
  *---------------------------------------------------------------------
  *
@@ -218,8 +1097,12 @@ int
 bitc_test(const char *str)
 {
    bool pool;
+   bool poll;
+   bool bufpool;
    bool crypt;
    bool hash;
+   bool reorg;
+   bool slab;
    bool tx;
 
    bitc_testing = 1;
@@ -228,12 +1111,18 @@ bitc_test(const char *str)
    tx    = str && strcmp(str, "tx") == 0;
    crypt = str && strcmp(str, "crypt") == 0;
    pool  = str && strcmp(str, "pool") == 0;
+   slab  = str && strcmp(str, "slab") == 0;
+   poll  = str && strcmp(str, "poll") == 0;
+   bufpool = str && strcmp(str, "bufpool") == 0;
+   reorg = str && strcmp(str, "reorg") == 0;
 
-   if (crypt == 0 && tx == 0 && hash == 0 && pool == 0) {
+   if (crypt == 0 && tx == 0 && hash == 0 && pool == 0 && slab == 0 &&
+       reorg == 0 && poll == 0 && bufpool == 0) {
       crypt = 1;
       tx = 1;
       pool = 1;
       hash = 1;
+      reorg = 1;
    }
 
    if (hash) {
@@ -248,6 +1137,18 @@ bitc_test(const char *str)
    if (pool) {
       bitc_pool_test();
    }
+   if (slab) {
+      bitc_slab_test();
+   }
+   if (poll) {
+      bitc_poll_test();
+   }
+   if (bufpool) {
+      bitc_bufpool_test();
+   }
+   if (reorg) {
+      bitc_reorg_test();
+   }
 
    return 0;
 }
@@ -12,6 +12,19 @@
 
 #define LGPFX "ADDR:"
 
+/*
+ * peers.dat starts with a header, followed by an array of addrbook_entry.
+ * Files written before we kept track of how each peer performed have no
+ * header and are a plain array of btc_msg_address.
+ */
+#define ADDRBOOK_MAGIC          0x6b6f6f6272646461ULL  /* "addrbook" */
+#define ADDRBOOK_VERSION        1
+
+/*
+ * Each time a peer stalled on us costs it this many msec.
+ */
+#define ADDRBOOK_STALL_COST     10000
+
 
 struct addrbook {
    struct file_descriptor *desc;
@@ -21,9 +34,28 @@ struct addrbook {
 };
 
 
+struct addrbook_hdr {
+   uint64 magic;
+   uint32 version;
+   uint32 unused;
+};
+
+
+struct addrbook_entry {
+   btc_msg_address  addr;
+   struct peer_perf perf;
+};
+
+
 struct savebook {
-   btc_msg_address *addrs;
-   int              idx;
+   struct addrbook_entry *entries;
+   int                    idx;
+};
+
+
+struct bestbook {
+   struct peer_addr *paddr;
+   uint32            cost;
 };
 
 
@@ -78,6 +110,9 @@ addrbook_replace_entry(struct addrbook *book,
    s = hashtable_lookup(book->hash_addr, paddr->addr.ip,
                         sizeof paddr->addr.ip, (void*)&paddr0);
    ASSERT(s);
+   if (paddr->perf.numSessions == 0) {
+      memcpy(&paddr->perf, &paddr0->perf, sizeof paddr->perf);
+   }
    addrbook_remove_entry(book, paddr0);
    free(paddr0);
    s = addrbook_add_entry(book, paddr);
@@ -143,6 +178,107 @@ addrbook_get_rand_addr(const struct addrbook *book)
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_perf_cost --
+ *
+ *      Roughly how many msec it takes this peer to get us 1MB, plus a
+ *      penalty for each time it stalled. Lower is better, and peers we
+ *      don't know cost the most.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+uint32
+addrbook_perf_cost(const struct peer_perf *perf)
+{
+   uint64 cost;
+
+   if (perf->rate == 0) {
+      return 0xffffffff;
+   }
+
+   cost = perf->rtt + 1000ULL * 1024 * 1024 / perf->rate
+        + (uint64)perf->numStalls * ADDRBOOK_STALL_COST;
+
+   return MIN(cost, 0xfffffffe);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_get_best_addr_cb --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+addrbook_get_best_addr_cb(const void *key,
+                          size_t      keyLen,
+                          void       *cbData,
+                          void       *keyData)
+{
+   struct bestbook *best = (struct bestbook *)cbData;
+   struct peer_addr *paddr = (struct peer_addr *)keyData;
+   uint32 cost;
+
+   if (paddr->triedalready || paddr->connected ||
+       (paddr->addr.services & BTC_SERVICE_NODE_NETWORK) == 0) {
+      return;
+   }
+   cost = addrbook_perf_cost(&paddr->perf);
+   if (cost < best->cost) {
+      best->paddr = paddr;
+      best->cost  = cost;
+   }
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_get_best_addr --
+ *
+ *      Returns the address of the peer that did best in previous sessions,
+ *      among the ones we haven't tried yet.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+struct peer_addr *
+addrbook_get_best_addr(const struct addrbook *book)
+{
+   struct bestbook best;
+
+   best.paddr = NULL;
+   best.cost  = 0xffffffff;
+
+   hashtable_for_each(book->hash_addr, addrbook_get_best_addr_cb, &best);
+
+   return best.paddr;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * addrbook_set_perf --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+void
+addrbook_set_perf(struct addrbook        *book,
+                  struct peer_addr       *paddr,
+                  const struct peer_perf *perf)
+{
+   memcpy(&paddr->perf, perf, sizeof *perf);
+   book->unsaved++;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -177,7 +313,9 @@ int
 addrbook_open(struct config *config,
               struct addrbook **bookOut)
 {
+   struct addrbook_hdr hdr;
    struct addrbook *book;
+   size_t entrySize;
    uint64 offset;
    int64 size;
    int res;
@@ -215,36 +353,59 @@ addrbook_open(struct config *config,
       return errno;
    }
 
+   offset = 0;
+   entrySize = sizeof(btc_msg_address);
+
+   if (size >= sizeof hdr) {
+      size_t numRead;
+
+      res = file_pread(book->desc, 0, &hdr, sizeof hdr, &numRead);
+      if (res != 0) {
+         goto exit;
+      }
+      if (hdr.magic == ADDRBOOK_MAGIC) {
+         if (hdr.version != ADDRBOOK_VERSION) {
+            Warning(LGPFX" unknown addrbook version %u.\n", hdr.version);
+            size = 0;
+         }
+         offset = sizeof hdr;
+         entrySize = sizeof(struct addrbook_entry);
+      }
+   }
+
    if (size > 0) {
       char *s = print_size(size);
       char *name = file_getname(book->filename);
 
       Warning(LGPFX" reading file %s -- %s -- %llu addrs.\n",
-              name, s, size / sizeof(btc_msg_address));
+              name, s, (size - offset) / entrySize);
       free(name);
       free(s);
    }
 
-   offset = 0;
    while (offset < size) {
-      btc_msg_address buf[10000];
+      uint8 buf[10000 * sizeof(struct addrbook_entry)];
       size_t numRead;
       size_t numBytes;
       int numAddrs;
       int i;
 
-      numBytes = MIN(size - offset, sizeof buf);
+      numBytes = MIN(size - offset, sizeof buf / entrySize * entrySize);
 
       res = file_pread(book->desc, offset, buf, numBytes, &numRead);
       if (res != 0) {
          break;
       }
-      numAddrs = numRead / sizeof(btc_msg_address);
+      numAddrs = numRead / entrySize;
       for (i = 0; i < numAddrs; i++) {
          struct peer_addr *a = safe_calloc(1, sizeof *a);
          bool s;
 
-         memcpy(&a->addr, buf + i, sizeof(btc_msg_address));
+         memcpy(&a->addr, buf + i * entrySize, sizeof(btc_msg_address));
+         if (entrySize == sizeof(struct addrbook_entry)) {
+            struct addrbook_entry *e = (struct addrbook_entry *)(buf + i * entrySize);
+            memcpy(&a->perf, &e->perf, sizeof a->perf);
+         }
          s = addrbook_add_entry_int(book, a);
          ASSERT(s);
       }
@@ -281,6 +442,30 @@ addrbook_zap(struct config *config)
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * addrbook_save_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+addrbook_save_cb(const void *key,
+                 size_t      keyLen,
+                 void       *cbData,
+                 void       *keyData)
+{
+   struct savebook *save = (struct savebook *)cbData;
+   struct peer_addr *paddr = (struct peer_addr *)keyData;
+   struct addrbook_entry *e = save->entries + save->idx;
+
+   memcpy(&e->addr, &paddr->addr, sizeof e->addr);
+   memcpy(&e->perf, &paddr->perf, sizeof e->perf);
+   save->idx++;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -292,7 +477,8 @@ addrbook_zap(struct config *config)
 static int
 addrbook_save(struct addrbook *book)
 {
-   btc_msg_address *addrs = NULL;
+   struct addrbook_hdr hdr;
+   struct savebook save;
    size_t numWritten;
    size_t len;
    uint32 count;
@@ -301,9 +487,11 @@ addrbook_save(struct addrbook *book)
    count = addrbook_get_count(book);
    ASSERT(count > 0);
 
-   hashtable_linearize(book->hash_addr, sizeof(btc_msg_address), (void *)&addrs);
-   ASSERT(addrs);
-   len = count * sizeof *addrs;
+   save.entries = safe_calloc(count, sizeof *save.entries);
+   save.idx = 0;
+   hashtable_for_each(book->hash_addr, addrbook_save_cb, &save);
+   ASSERT(save.idx == count);
+   len = count * sizeof *save.entries;
 
    res = file_truncate(book->desc, 0);
    if (res != 0) {
@@ -313,7 +501,14 @@ addrbook_save(struct addrbook *book)
 
    Log(LGPFX" saving %u addr.\n", count);
 
-   res = file_pwrite(book->desc, 0, addrs, len, &numWritten);
+   memset(&hdr, 0, sizeof hdr);
+   hdr.magic   = ADDRBOOK_MAGIC;
+   hdr.version = ADDRBOOK_VERSION;
+
+   res = file_pwrite(book->desc, 0, &hdr, sizeof hdr, &numWritten);
+   if (res == 0 && numWritten == sizeof hdr) {
+      res = file_pwrite(book->desc, sizeof hdr, save.entries, len, &numWritten);
+   }
    if (res || numWritten != len) {
       Warning(LGPFX" Failed to write addrbook: %s\n",
               strerror(res));
@@ -321,7 +516,7 @@ addrbook_save(struct addrbook *book)
       book->unsaved = 0;
    }
 
-   free(addrs);
+   free(save.entries);
    return res;
 }
 
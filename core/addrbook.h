@@ -6,11 +6,22 @@
 
 struct addrbook;
 
+/*
+ * How a peer performed over the sessions we had with it.
+ */
+struct peer_perf {
+   uint32 rtt;            /* msec, 0 if unknown */
+   uint32 rate;           /* bytes per sec, 0 if unknown */
+   uint16 numStalls;
+   uint16 numSessions;
+};
+
 struct peer_addr {
-   btc_msg_address addr;
-   uint32          connected:1;
-   uint32          triedalready:1;
-   uint32          unused:30;
+   btc_msg_address  addr;
+   struct peer_perf perf;
+   uint32           connected:1;
+   uint32           triedalready:1;
+   uint32           unused:30;
 };
 
 
@@ -22,5 +33,9 @@ void addrbook_zap(struct config *config);
 struct peer_addr* addrbook_get_rand_addr(const struct addrbook *book);
 void addrbook_remove_entry(struct addrbook *book, const struct peer_addr *paddr);
 void addrbook_replace_entry(struct addrbook *book, struct peer_addr *paddr);
+struct peer_addr *addrbook_get_best_addr(const struct addrbook *book);
+void addrbook_set_perf(struct addrbook *book, struct peer_addr *paddr,
+                       const struct peer_perf *perf);
+uint32 addrbook_perf_cost(const struct peer_perf *perf);
 
 #endif /* __ADDRBOOK_H__ */
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -8,13 +9,43 @@
 #include "config.h"
 #include "file.h"
 #include "util.h"
+#include "atomic.h"
 #include "hashtable.h"
+#include "slab.h"
+#include "circlist.h"
+#include "poolworker.h"
 #include "bitc_ui.h"
 #include "peergroup.h"
 #include "bitc.h"
 
 #define LGPFX "BLCK:"
 
+/*
+ * When loading headers.dat, headers are read in chunks. The hashing of each
+ * chunk is split in jobs of BLOCKSET_HASH_JOB_SIZE headers dispatched to the
+ * pool of worker threads, while the main thread links the previous chunk.
+ */
+#define BLOCKSET_CHUNK_SIZE     10000
+#define BLOCKSET_HASH_JOB_SIZE  1000
+
+/*
+ * headers.idx caches the hash and the height of each header of headers.dat so
+ * that a restart does not have to hash the whole file again. Its header ties
+ * it to the length and to the last header of headers.dat: when they don't
+ * match, the index is rebuilt from scratch while loading headers.dat.
+ */
+#define BLOCKSET_IDX_MAGIC      0x58444948      /* 'HIDX' */
+#define BLOCKSET_IDX_VERSION    1
+#define BLOCKSET_IDX_CHECK_FREQ 1024
+
+/*
+ * Headers whose parent we don't have yet are kept around for a while, in case
+ * the missing blocks show up, e.g. when several peers serve us headers. The
+ * expiry can be changed with 'headers.orphanExpiry', in seconds.
+ */
+#define BLOCKSTORE_MAX_ORPHANS    50000
+#define BLOCKSTORE_ORPHAN_EXPIRY  (10 * 60 * 1000 * 1000ULL)  /* 10 min */
+
 
 struct block_cpt_entry_str {
    uint32       height;
@@ -39,12 +70,79 @@ static const struct block_cpt_entry_str cpt_main[] = {
 static struct block_cpt_entry block_cpt_testnet[ARRAYSIZE(cpt_testnet)];
 static struct block_cpt_entry block_cpt_main[ARRAYSIZE(cpt_main)];
 
+/*
+ * The hash of the header is computed once when the entry is created and cached
+ * here: all the lookups, locators and getdata batches hand it out as is.
+ *
+ * 'header' points in the mapping of headers.dat for the headers loaded at
+ * startup when headers.mmap is set, or right after the entry otherwise.
+ *
+ * 'prev' is the parent of the entry, whether it's on the best chain or not,
+ * while 'next' is only meaningful on the best chain. 'height' is the height on
+ * the best chain or -1, and 'chainHeight' the height of the entry in its own
+ * branch: -1 until the branch connects to the genesis block. 'skip' points to
+ * an ancestor further down, cf. blockstore_get_ancestor().
+ */
 struct blockentry {
-   struct blockentry   *prev;
-   struct blockentry   *next;
-   btc_block_header     header;
-   int                  height;
-   bool                 written;
+   struct blockentry       *prev;
+   struct blockentry       *next;
+   struct blockentry       *skip;
+   const btc_block_header  *header;
+   uint256                  hash;
+   int                      height;
+   int                      chainHeight;
+   bool                     written;
+};
+
+
+/*
+ * Dense, height-indexed view of the best chain. 'maxTimestamp' is the highest
+ * block timestamp seen from genesis up to this height: block timestamps are
+ * not monotonic but this running maximum is, which lets us binary search on
+ * it.
+ */
+struct bestchain_slot {
+   struct blockentry   *be;
+   uint32               maxTimestamp;
+};
+
+
+/*
+ * An entry not connected to the genesis block, waiting on its parent.
+ * Orphans with the same parent are chained through 'sibling', and they're all
+ * on 'orphanList' by order of arrival.
+ */
+struct blockorphan {
+   struct blockentry      *be;
+   struct blockorphan     *sibling;
+   mtime_t                 ts;
+   struct circlist_item    item;
+};
+
+
+/*
+ * What most callers want to know about the best chain, cf. blockstore_tip_read().
+ */
+struct blockstore_tip {
+   uint256                 hash;
+   int                     height;
+   uint32                  timestamp;
+};
+
+
+struct blockset_idx_header {
+   uint32                  magic;
+   uint32                  version;
+   uint64                  filesize;
+   uint256                 tail;
+   uint8                   checksum[4];
+   uint8                   pad[4];
+};
+
+
+struct blockset_idx_entry {
+   uint256                 hash;
+   int32                   height;
 };
 
 
@@ -52,21 +150,79 @@ struct blockset {
    char                   *filename;
    struct file_descriptor *desc;
    int64                   filesize;
+
+   const btc_block_header *map;
+   size_t                  mapLen;
+
+   char                   *idxFilename;
+   struct file_descriptor *idxDesc;
+   bool                    idxValid;
+};
+
+
+struct blockset_hash_job {
+   struct blockset_chunk  *chunk;
+   int                     start;
+   int                     num;
+};
+
+
+struct blockset_chunk {
+   btc_block_header       *buf;
+   const btc_block_header *hdrs;
+   uint256                *hashes;
+   struct blockset_idx_entry *idx;
+   uint64                  offset;
+   size_t                  numBytes;
+   int                     numHeaders;
+
+   struct mutex           *lock;
+   struct condvar         *cv;
+   int                     numPending;
+   struct blockset_hash_job jobs[CEILING(BLOCKSET_CHUNK_SIZE,
+                                         BLOCKSET_HASH_JOB_SIZE)];
 };
 
 
+/*
+ * Locking: only one thread at a time modifies the blockstore and it does so
+ * with 'lock' held, which lets it read the blockstore without further ado.
+ * It takes 'rwlock' for writing around the actual changes to the index and to
+ * the best chain, while the other threads take it for reading. The tip of the
+ * best chain is also published in 'tip' which is read without any lock:
+ * 'tipSeq' is odd while it's being updated.
+ */
 struct blockstore {
    struct blockset       *blockSet;
    uint256                genesis_hash;
    uint256                best_hash;
    struct mutex          *lock;
+   struct rwlock         *rwlock;
+
+   atomic_uint32          tipSeq;
+   struct blockstore_tip  tip;
 
    struct blockentry     *best_chain;
    struct blockentry     *genesis;
 
+   struct bestchain_slot *chain;
+   int                    chainSize;
+
    int                    height;
    struct hashtable      *hash_blk;
    struct hashtable      *hash_orphans;
+
+   struct hashtable      *hash_waiting;
+   struct circlist_item  *orphanList;
+   uint32                 numOrphans;
+   mtime_t                orphanExpiry;
+
+   /*
+    * The entries are never freed one by one: they all go away with the
+    * blockstore. Those pointing in the mapping of headers.dat are smaller.
+    */
+   struct slab           *slab_entries;
+   struct slab           *slab_mapped;
 };
 
 
@@ -75,6 +231,8 @@ struct blockstore {
  *
  * blockstore_lookup --
  *
+ *      The caller holds either bs->lock or bs->rwlock.
+ *
  *------------------------------------------------------------------------
  */
 
@@ -86,19 +244,161 @@ blockstore_lookup(const struct blockstore *bs,
    bool s;
 
    be = NULL;
-   mutex_lock(bs->lock);
 
    s = hashtable_lookup(bs->hash_orphans, hash, sizeof *hash, (void *)&be);
    if (s) {
-      goto done;
+      return be;
    }
    s = hashtable_lookup(bs->hash_blk, hash, sizeof *hash, (void *)&be);
    if (s) {
-      goto done;
+      return be;
+   }
+   return NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_tip_publish --
+ *
+ *      Called by the writer once the best chain has changed.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_tip_publish(struct blockstore *bs)
+{
+   atomic_inc(&bs->tipSeq);
+
+   if (bs->best_chain == NULL) {
+      memset(&bs->tip.hash, 0, sizeof bs->tip.hash);
+      bs->tip.height    = 0;
+      bs->tip.timestamp = 1231006505; //  2009-01-03 18:15:05
+   } else {
+      memcpy(&bs->tip.hash, &bs->best_hash, sizeof bs->best_hash);
+      bs->tip.height    = bs->height;
+      bs->tip.timestamp = bs->best_chain->header->timestamp;
+   }
+
+   atomic_inc(&bs->tipSeq);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_tip_read --
+ *
+ *      Lockless read of the tip of the best chain: retries if the writer
+ *      updated the snapshot in the meantime.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_tip_read(const struct blockstore *bs,
+                    struct blockstore_tip   *tip)
+{
+   uint32 seq;
+
+   do {
+      seq = atomic_read(&bs->tipSeq);
+      atomic_mb();
+      memcpy(tip, &bs->tip, sizeof *tip);
+      atomic_mb();
+   } while ((seq & 1) || seq != atomic_read(&bs->tipSeq));
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_chain_reserve --
+ *
+ *      Makes room for the best chain to reach 'height'.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_chain_reserve(struct blockstore *bs,
+                         int                height)
+{
+   int size;
+
+   if (height < bs->chainSize) {
+      return;
+   }
+
+   size = MAX(2 * bs->chainSize, 1024);
+   while (size <= height) {
+      size *= 2;
+   }
+   bs->chain = safe_realloc(bs->chain, size * sizeof *bs->chain);
+   memset(bs->chain + bs->chainSize, 0,
+          (size - bs->chainSize) * sizeof *bs->chain);
+   bs->chainSize = size;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_chain_set --
+ *
+ *      Records 'be' in the height-indexed view of the best chain. Entries are
+ *      always added in increasing height order, either when the chain is
+ *      extended or when a new branch is wired after a reorg.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_chain_set(struct blockstore *bs,
+                     struct blockentry *be)
+{
+   struct bestchain_slot *slot;
+   uint32 maxTimestamp;
+
+   ASSERT(be->height >= 0);
+
+   blockstore_chain_reserve(bs, be->height);
+
+   maxTimestamp = be->header->timestamp;
+   if (be->height > 0) {
+      ASSERT(bs->chain[be->height - 1].be == be->prev);
+      maxTimestamp = MAX(maxTimestamp, bs->chain[be->height - 1].maxTimestamp);
+   }
+
+   slot = bs->chain + be->height;
+   slot->be = be;
+   slot->maxTimestamp = maxTimestamp;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_chain_truncate --
+ *
+ *      Drops all the entries above 'height' from the height-indexed view of
+ *      the best chain.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_chain_truncate(struct blockstore *bs,
+                          int height)
+{
+   int i;
+
+   for (i = height + 1; i < bs->chainSize && bs->chain[i].be; i++) {
+      bs->chain[i].be = NULL;
+      bs->chain[i].maxTimestamp = 0;
    }
-done:
-   mutex_unlock(bs->lock);
-   return be;
 }
 
 
@@ -113,11 +413,11 @@ done:
 time_t
 blockstore_get_timestamp(const struct blockstore *bs)
 {
-   if (bs->best_chain == NULL) {
-      return 1231006505; //  2009-01-03 18:15:05
-   }
-   ASSERT(bs->height == bs->best_chain->height);
-   return bs->best_chain->header.timestamp;
+   struct blockstore_tip tip;
+
+   blockstore_tip_read(bs, &tip);
+
+   return tip.timestamp;
 }
 
 
@@ -132,11 +432,14 @@ blockstore_get_timestamp(const struct blockstore *bs)
 int
 blockstore_get_height(const struct blockstore *bs)
 {
-   if (bs == NULL || bs->best_chain == NULL) {
+   struct blockstore_tip tip;
+
+   if (bs == NULL) {
       return 0;
    }
-   ASSERT(bs->height == bs->best_chain->height);
-   return bs->height;
+   blockstore_tip_read(bs, &tip);
+
+   return tip.height;
 }
 
 
@@ -199,7 +502,7 @@ blockstore_get_block_height(struct blockstore *bs,
       return 0;
    }
 
-   mutex_lock(bs->lock);
+   rwlock_rdlock(bs->rwlock);
 
    s = hashtable_lookup(bs->hash_blk, hash, sizeof *hash, (void*)&be);
    if (s == 0) {
@@ -211,7 +514,7 @@ blockstore_get_block_height(struct blockstore *bs,
 
    height = be->height;
 
-   mutex_unlock(bs->lock);
+   rwlock_unlock(bs->rwlock);
 
    return height;
 }
@@ -232,24 +535,25 @@ blockstore_get_block_at_height(struct blockstore *bs,
                                btc_block_header  *header)
 {
    struct blockentry *e;
-   bool s = 0;
 
-   mutex_lock(bs->lock);
+   rwlock_rdlock(bs->rwlock);
 
    ASSERT(height <= bs->height);
 
-   for (e = bs->best_chain; e != bs->genesis; e = e->prev)  {
-      if (e->height == height) {
-         hash256_calc(&e->header, sizeof e->header, hash);
-         *header = e->header;
-         s = 1;
-         break;
-      }
+   if (height < 0 || height > bs->height) {
+      rwlock_unlock(bs->rwlock);
+      return 0;
    }
 
-   mutex_unlock(bs->lock);
+   e = bs->chain[height].be;
+   ASSERT(e && e->height == height);
 
-   return s;
+   memcpy(hash, &e->hash, sizeof *hash);
+   *header = *e->header;
+
+   rwlock_unlock(bs->rwlock);
+
+   return 1;
 }
 
 
@@ -297,176 +601,593 @@ blockstore_validate_chkpt(const uint256 *hash,
 /*
  *------------------------------------------------------------------------
  *
- * blockstore_set_chain_links --
+ * blockstore_get_next_checkpoint --
+ *
+ *      Returns the height of the first checkpoint above 'height', or -1.
  *
  *------------------------------------------------------------------------
  */
 
-static int
-blockstore_set_chain_links(struct blockstore *bs,
-                           struct blockentry *be)
+int
+blockstore_get_next_checkpoint(const struct blockstore *bs,
+                               int                      height,
+                               uint256                 *hash)
 {
-   struct blockentry *prev;
-   char hashStr[80];
-   uint256 hash;
-   int height;
-   bool s;
-
-   mutex_lock(bs->lock);
-
-   hash256_calc(&be->header, sizeof be->header, &hash);
-   uint256_snprintf_reverse(hashStr, sizeof hashStr, &hash);
-
-   if (be->height >= 0) {
-      struct blockentry *li;
-      /*
-       * We've reached the junction with the current/old best chain. All the
-       * entries from now on need to be made orphans.
-       */
+   struct block_cpt_entry *array;
+   size_t n;
+   int i;
 
-      Log(LGPFX" Reached block %s\n", hashStr);
+   if (btc->testnet) {
+      array = block_cpt_testnet;
+      n = ARRAYSIZE(block_cpt_testnet);
+   } else {
+      array = block_cpt_main;
+      n = ARRAYSIZE(block_cpt_main);
+   }
 
-      li = be->next;
-      while (li) {
-         hash256_calc(&li->header, sizeof li->header, &hash);
-         uint256_snprintf_reverse(hashStr, sizeof hashStr, &hash);
-         Log(LGPFX" moving #%d %s from blk -> orphan\n", li->height, hashStr);
-         s = hashtable_remove(bs->hash_blk, &hash, sizeof hash);
-         ASSERT(s);
-         li->height = -1;
-         s = hashtable_insert(bs->hash_orphans, &hash, sizeof hash, li);
-         ASSERT(s);
-         li = li->next;
+   for (i = 0; i < n; i++) {
+      if ((int)array[i].height > height) {
+         memcpy(hash, &array[i].hash, sizeof *hash);
+         return array[i].height;
       }
-
-      goto done;
    }
-
-   ASSERT(be->height == -1); // orphan
-
-   prev = blockstore_lookup(bs, &be->header.prevBlock);
-   ASSERT(prev);
-
-   be->height = 1 + blockstore_set_chain_links(bs, prev);
-
-   Log(LGPFX" moving #%d %s from orphan -> blk\n", be->height, hashStr);
-
-   prev->next = be;
-   be->prev = prev;
-
-   s = hashtable_remove(bs->hash_orphans, &hash, sizeof hash);
-   ASSERT(s);
-   s = hashtable_insert(bs->hash_blk, &hash, sizeof hash, be);
-   ASSERT(s);
-
-done:
-   height = be->height;
-   mutex_unlock(bs->lock);
-
-   return height;
+   return -1;
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * blockstore_find_alternate_chain_height --
+ * blockstore_skip_height --
  *
- *      Returns the height of an alternate chain starting at 'be'.
+ *      Height of the ancestor 'skip' points to for an entry at 'height'.
+ *      Any height works, but this one, taken from bitcoind, makes ancestor
+ *      lookups O(log n).
  *
  *------------------------------------------------------------------------
  */
 
-static int
-blockstore_find_alternate_chain_height(struct blockstore *bs,
-                                       struct blockentry *be)
+static inline int
+blockstore_invert_lowest_one(int n)
 {
-   struct blockentry *prev;
-   int height;
-
-   mutex_lock(bs->lock);
-
-   if (be->height > 0) {
-      mutex_unlock(bs->lock);
-      return be->height;
-   }
-
-   ASSERT(be->height == -1); // orphan
+   return n & (n - 1);
+}
 
-   prev = blockstore_lookup(bs, &be->header.prevBlock);
-   if (prev == NULL) {
-      mutex_unlock(bs->lock);
+static inline int
+blockstore_skip_height(int height)
+{
+   if (height < 2) {
       return 0;
    }
+   if (height & 1) {
+      return blockstore_invert_lowest_one(
+                blockstore_invert_lowest_one(height - 1)) + 1;
+   }
+   return blockstore_invert_lowest_one(height);
+}
 
-   height = 1 + blockstore_find_alternate_chain_height(bs, prev);
 
-   mutex_unlock(bs->lock);
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_get_ancestor --
+ *
+ *      Returns the ancestor of 'be' at 'height', following 'skip' whenever
+ *      it doesn't overshoot.
+ *
+ *------------------------------------------------------------------------
+ */
 
-   return height;
+static struct blockentry *
+blockstore_get_ancestor(struct blockentry *be,
+                        int                height)
+{
+   struct blockentry *walk = be;
+   int heightWalk = be->chainHeight;
+
+   ASSERT(height >= 0 && height <= heightWalk);
+
+   while (heightWalk > height) {
+      int heightSkip = blockstore_skip_height(heightWalk);
+      int heightSkipPrev = blockstore_skip_height(heightWalk - 1);
+
+      if (walk->skip &&
+          (heightSkip == height ||
+           (heightSkip > height && !(heightSkipPrev < heightSkip - 2 &&
+                                     heightSkipPrev >= height)))) {
+         walk = walk->skip;
+         heightWalk = heightSkip;
+      } else {
+         ASSERT(walk->prev);
+         walk = walk->prev;
+         heightWalk--;
+      }
+   }
+   return walk;
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * blockstore_set_best_chain --
+ * blockstore_link_parent --
+ *
+ *      Wires a new entry to its parent, if known. 'chainHeight' stays -1 as
+ *      long as the branch isn't connected to the genesis block.
  *
  *------------------------------------------------------------------------
  */
 
 static void
-blockstore_set_best_chain(struct blockstore *bs,
-                          struct blockentry *be,
-                          const uint256 *hash)
+blockstore_link_parent(struct blockentry *be,
+                       struct blockentry *parent)
 {
-   int height;
-
-   mutex_lock(bs->lock);
-   height = blockstore_find_alternate_chain_height(bs, be);
-
-   Log(LGPFX" orphan block: alternate chain height is %d vs current %d\n",
-       height, bs->height);
-
-   if (height <= bs->height) {
-      mutex_unlock(bs->lock);
+   be->prev = parent;
+   if (parent == NULL || parent->chainHeight < 0) {
       return;
    }
-
-   /*
-    * Properly wire the new chain.
-    */
-   blockstore_set_chain_links(bs, be);
-
-   bs->best_chain = be;
-   bs->height = height;
-
-   memcpy(&bs->best_hash, hash, sizeof *hash);
-
-   mutex_unlock(bs->lock);
+   be->chainHeight = parent->chainHeight + 1;
+   be->skip = blockstore_get_ancestor(parent,
+                                      blockstore_skip_height(be->chainHeight));
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * blockstore_add_entry --
+ * blockstore_find_fork --
+ *
+ *      Returns the last entry of the best chain that is also an ancestor of
+ *      'be'. Once an ancestor of 'be' is on the best chain, all the ones
+ *      below are as well: we can binary search on the height.
  *
  *------------------------------------------------------------------------
  */
 
-static void
-blockstore_add_entry(struct blockstore *bs,
-                     struct blockentry *be,
-                     const uint256 *hash)
+static struct blockentry *
+blockstore_find_fork(const struct blockstore *bs,
+                     struct blockentry       *be)
 {
-   bool s;
+   int lo = 0;
+   int hi = MIN(be->chainHeight, bs->height);
 
-   mutex_lock(bs->lock);
+   ASSERT(be->chainHeight >= 0);
 
-   if (bs->best_chain == NULL) {
+   while (lo < hi) {
+      int mid = lo + (hi - lo + 1) / 2;
 
-      s = hashtable_insert(bs->hash_blk, hash, sizeof *hash, be);
+      if (bs->chain[mid].be == blockstore_get_ancestor(be, mid)) {
+         lo = mid;
+      } else {
+         hi = mid - 1;
+      }
+   }
+   return bs->chain[lo].be;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_get_fork_height --
+ *
+ *      Height of the last block of the best chain that 'hash' descends
+ *      from: its own height if it's on the best chain. -1 if 'hash' isn't
+ *      connected to the genesis block.
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+blockstore_get_fork_height(const struct blockstore *bs,
+                           const uint256           *hash)
+{
+   struct blockentry *be;
+   int height = -1;
+
+   rwlock_rdlock(bs->rwlock);
+
+   be = blockstore_lookup(bs, hash);
+   if (be && be->chainHeight >= 0) {
+      height = blockstore_find_fork(bs, be)->height;
+   }
+
+   rwlock_unlock(bs->rwlock);
+
+   return height;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_reorg --
+ *
+ *      Makes the branch ending at 'be' the best chain: the entries of the
+ *      current best chain above the fork point become orphans, and the ones
+ *      of the new branch are wired from the fork point up.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_reorg(struct blockstore *bs,
+                 struct blockentry *be)
+{
+   struct blockentry *fork;
+   struct blockentry *li;
+   char hashStr[80];
+   int oldHeight;
+   int h;
+   bool s;
+
+   mutex_lock(bs->lock);
+
+   fork = blockstore_find_fork(bs, be);
+   oldHeight = bs->height;
+
+   for (h = oldHeight; h > fork->height; h--) {
+      li = bs->chain[h].be;
+
+      s = hashtable_remove(bs->hash_blk, &li->hash, sizeof li->hash);
+      ASSERT(s);
+      li->height = -1;
+      s = hashtable_insert(bs->hash_orphans, &li->hash, sizeof li->hash, li);
+      ASSERT(s);
+   }
+   blockstore_chain_truncate(bs, fork->height);
+   blockstore_chain_reserve(bs, be->chainHeight);
+
+   for (li = be; li != fork; li = li->prev) {
+      bs->chain[li->chainHeight].be = li;
+   }
+
+   for (h = fork->height + 1; h <= be->chainHeight; h++) {
+      li = bs->chain[h].be;
+
+      li->height = h;
+      li->prev->next = li;
+      blockstore_chain_set(bs, li);
+
+      s = hashtable_remove(bs->hash_orphans, &li->hash, sizeof li->hash);
+      ASSERT(s);
+      s = hashtable_insert(bs->hash_blk, &li->hash, sizeof li->hash, li);
+      ASSERT(s);
+   }
+   be->next = NULL;
+
+   bs->best_chain = be;
+   bs->height = be->height;
+   memcpy(&bs->best_hash, &be->hash, sizeof be->hash);
+
+   uint256_snprintf_reverse(hashStr, sizeof hashStr, &fork->hash);
+   Log(LGPFX" reorg at #%d %s: %d blocks disconnected, %d connected.\n",
+       fork->height, hashStr, oldHeight - fork->height,
+       bs->height - fork->height);
+
+   mutex_unlock(bs->lock);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_set_best_chain --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_set_best_chain(struct blockstore *bs,
+                          struct blockentry *be)
+{
+   mutex_lock(bs->lock);
+
+   Log(LGPFX" orphan block: alternate chain height is %d vs current %d\n",
+       be->chainHeight, bs->height);
+
+   if (be->chainHeight > bs->height) {
+      blockstore_reorg(bs, be);
+   }
+
+   mutex_unlock(bs->lock);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_free_entry --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_free_entry(struct blockstore *bs,
+                      struct blockentry *be)
+{
+   if (be->header == (const btc_block_header *)(be + 1)) {
+      slab_free(bs->slab_entries, be);
+   } else {
+      slab_free(bs->slab_mapped, be);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_orphan_unlink --
+ *
+ *      Removes an orphan from the list of the ones waiting on its parent.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_orphan_unlink(struct blockstore  *bs,
+                         struct blockorphan *orphan)
+{
+   const uint256 *parent = &orphan->be->header->prevBlock;
+   struct blockorphan *first;
+   struct blockorphan *o;
+   bool s;
+
+   s = hashtable_lookup(bs->hash_waiting, parent, sizeof *parent,
+                        (void *)&first);
+   ASSERT(s);
+
+   if (first == orphan) {
+      hashtable_remove(bs->hash_waiting, parent, sizeof *parent);
+      if (orphan->sibling) {
+         s = hashtable_insert(bs->hash_waiting, parent, sizeof *parent,
+                              orphan->sibling);
+         ASSERT(s);
+      }
+      return;
+   }
+   for (o = first; o->sibling != orphan; o = o->sibling) {
+      ASSERT(o->sibling);
+   }
+   o->sibling = orphan->sibling;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_orphan_evict --
+ *
+ *      Forgets about the oldest orphan. The ones that were waiting on it now
+ *      wait on a block we don't know about.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_orphan_evict(struct blockstore *bs)
+{
+   struct blockorphan *orphan;
+   struct blockorphan *o;
+   struct blockentry *be;
+   char hashStr[80];
+   bool s;
+
+   orphan = CIRCLIST_CONTAINER(bs->orphanList, struct blockorphan, item);
+   be = orphan->be;
+
+   uint256_snprintf_reverse(hashStr, sizeof hashStr, &be->hash);
+   Log(LGPFX" evicting orphan %s -- %u orphans.\n", hashStr, bs->numOrphans);
+
+   if (hashtable_lookup(bs->hash_waiting, &be->hash, sizeof be->hash,
+                        (void *)&o)) {
+      for (; o; o = o->sibling) {
+         o->be->prev = NULL;
+      }
+   }
+
+   blockstore_orphan_unlink(bs, orphan);
+   circlist_delete_item(&bs->orphanList, &orphan->item);
+   bs->numOrphans--;
+   free(orphan);
+
+   s = hashtable_remove(bs->hash_orphans, &be->hash, sizeof be->hash);
+   ASSERT(s);
+   blockstore_free_entry(bs, be);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_orphan_expire --
+ *
+ *      The pool is bounded: the oldest orphans get evicted when it's full or
+ *      once they've waited for too long. This must run before a new entry is
+ *      wired to its parent, as the parent may be one of them.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_orphan_expire(struct blockstore *bs)
+{
+   mtime_t now = time_get();
+
+   while (bs->orphanList) {
+      struct blockorphan *oldest;
+
+      oldest = CIRCLIST_CONTAINER(bs->orphanList, struct blockorphan, item);
+      if (bs->numOrphans < BLOCKSTORE_MAX_ORPHANS &&
+          now - oldest->ts < bs->orphanExpiry) {
+         break;
+      }
+      blockstore_orphan_evict(bs);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_orphan_add --
+ *
+ *      Indexes an entry that doesn't connect to the genesis block by the hash
+ *      of its parent.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_orphan_add(struct blockstore *bs,
+                      struct blockentry *be)
+{
+   const uint256 *parent = &be->header->prevBlock;
+   struct blockorphan *orphan;
+   struct blockorphan *first;
+   mtime_t now = time_get();
+
+   orphan = safe_calloc(1, sizeof *orphan);
+   orphan->be = be;
+   orphan->ts = now;
+   circlist_init_item(&orphan->item);
+   circlist_queue_item(&bs->orphanList, &orphan->item);
+   bs->numOrphans++;
+
+   if (hashtable_lookup(bs->hash_waiting, parent, sizeof *parent,
+                        (void *)&first)) {
+      orphan->sibling = first->sibling;
+      first->sibling = orphan;
+   } else {
+      bool s = hashtable_insert(bs->hash_waiting, parent, sizeof *parent,
+                                orphan);
+      ASSERT(s);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_orphan_clear --
+ *
+ *      Drops the orphan index. The entries themselves are left alone.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_orphan_clear(struct blockstore *bs)
+{
+   while (bs->orphanList) {
+      struct blockorphan *o;
+
+      o = CIRCLIST_CONTAINER(bs->orphanList, struct blockorphan, item);
+      circlist_delete_item(&bs->orphanList, &o->item);
+      free(o);
+   }
+   bs->numOrphans = 0;
+   hashtable_clear(bs->hash_waiting);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_orphan_connect --
+ *
+ *      'be' just got connected to the genesis block: so do all the orphans
+ *      descending from it. Returns the highest of them, if any.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct blockentry *
+blockstore_orphan_connect(struct blockstore *bs,
+                          struct blockentry *be)
+{
+   struct blockentry **queue;
+   struct blockentry *best = NULL;
+   int queueSize;
+   int head;
+   int tail;
+
+   if (bs->numOrphans == 0) {
+      return NULL;
+   }
+
+   queueSize = 16;
+   queue = safe_malloc(queueSize * sizeof *queue);
+   head = 0;
+   tail = 0;
+   queue[tail++] = be;
+
+   while (head < tail) {
+      struct blockentry *parent = queue[head++];
+      struct blockorphan *o;
+
+      if (!hashtable_lookup(bs->hash_waiting, &parent->hash,
+                            sizeof parent->hash, (void *)&o)) {
+         continue;
+      }
+      hashtable_remove(bs->hash_waiting, &parent->hash, sizeof parent->hash);
+
+      while (o) {
+         struct blockorphan *sibling = o->sibling;
+         struct blockentry *child = o->be;
+
+         ASSERT(child->prev == NULL || child->prev == parent);
+         blockstore_link_parent(child, parent);
+         ASSERT(child->chainHeight >= 0);
+         if (best == NULL || child->chainHeight > best->chainHeight) {
+            best = child;
+         }
+
+         if (tail == queueSize) {
+            queueSize *= 2;
+            queue = safe_realloc(queue, queueSize * sizeof *queue);
+         }
+         queue[tail++] = child;
+
+         circlist_delete_item(&bs->orphanList, &o->item);
+         bs->numOrphans--;
+         free(o);
+         o = sibling;
+      }
+   }
+   free(queue);
+
+   if (best) {
+      Log(LGPFX" connected %d orphans -- %u left.\n", tail - 1, bs->numOrphans);
+   }
+   return best;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_add_entry --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_add_entry(struct blockstore *bs,
+                     struct blockentry *be,
+                     const uint256 *hash)
+{
+   struct blockentry *connected = NULL;
+   struct blockentry *oldBest = bs->best_chain;
+   struct blockentry *best;
+   bool s;
+
+   mutex_lock(bs->lock);
+   rwlock_wrlock(bs->rwlock);
+
+   if (bs->best_chain == NULL) {
+
+      s = hashtable_insert(bs->hash_blk, hash, sizeof *hash, be);
 
       ASSERT(s);
       ASSERT(uint256_issame(hash, &bs->genesis_hash));
@@ -477,9 +1198,12 @@ blockstore_add_entry(struct blockstore *bs,
       bs->genesis = be;
       bs->height  = 0;
       be->height  = 0;
+      be->chainHeight = 0;
+      blockstore_chain_set(bs, be);
 
       memcpy(&bs->best_hash, hash, sizeof *hash);
-   } else if (uint256_issame(&be->header.prevBlock, &bs->best_hash)) {
+      connected = be;
+   } else if (uint256_issame(&be->header->prevBlock, &bs->best_hash)) {
 
       s = hashtable_insert(bs->hash_blk, hash, sizeof *hash, be);
       ASSERT(s);
@@ -488,15 +1212,19 @@ blockstore_add_entry(struct blockstore *bs,
       be->height = bs->height;
 
       bs->best_chain->next = be;
-      be->prev = bs->best_chain;
+      blockstore_link_parent(be, bs->best_chain);
       bs->best_chain = be;
+      blockstore_chain_set(bs, be);
 
       memcpy(&bs->best_hash, hash, sizeof *hash);
+      connected = be;
    } else {
       char hashStr[80];
       uint32 count;
 
       be->height = -1;
+      blockstore_orphan_expire(bs);
+      blockstore_link_parent(be, blockstore_lookup(bs, &be->header->prevBlock));
       count = hashtable_getnumentries(bs->hash_orphans);
 
       uint256_snprintf_reverse(hashStr, sizeof hashStr, hash);
@@ -506,7 +1234,30 @@ blockstore_add_entry(struct blockstore *bs,
       s = hashtable_insert(bs->hash_orphans, hash, sizeof *hash, be);
       ASSERT(s);
 
-      blockstore_set_best_chain(bs, be, hash);
+      if (be->chainHeight < 0) {
+         blockstore_orphan_add(bs, be);
+      } else {
+         connected = be;
+      }
+   }
+
+   /*
+    * Hook up the orphans that were waiting on this block and switch to the
+    * best branch we now have.
+    */
+   if (connected) {
+      best = blockstore_orphan_connect(bs, connected);
+      if (best == NULL) {
+         best = connected;
+      }
+      if (best != bs->best_chain) {
+         blockstore_set_best_chain(bs, best);
+      }
+   }
+   rwlock_unlock(bs->rwlock);
+
+   if (bs->best_chain != oldBest) {
+      blockstore_tip_publish(bs);
    }
    mutex_unlock(bs->lock);
 }
@@ -526,9 +1277,9 @@ blockstore_has_header(const struct blockstore *bs,
 {
    bool s;
 
-   mutex_lock(bs->lock);
+   rwlock_rdlock(bs->rwlock);
    s = hashtable_lookup(bs->hash_blk, hash, sizeof *hash, NULL);
-   mutex_unlock(bs->lock);
+   rwlock_unlock(bs->rwlock);
 
    return s;
 }
@@ -548,9 +1299,9 @@ blockstore_is_orphan(const struct blockstore *bs,
 {
    bool s;
 
-   mutex_lock(bs->lock);
+   rwlock_rdlock(bs->rwlock);
    s = hashtable_lookup(bs->hash_orphans, hash, sizeof *hash, NULL);
-   mutex_unlock(bs->lock);
+   rwlock_unlock(bs->rwlock);
 
    return s;
 }
@@ -578,146 +1329,729 @@ blockstore_is_block_known(const struct blockstore *bs,
  *
  * blockstore_alloc_entry --
  *
+ *      'mapped' headers live in the mapping of headers.dat and aren't copied.
+ *
  *------------------------------------------------------------------------
  */
 
 static struct blockentry *
-blockstore_alloc_entry(const btc_block_header *hdr)
+blockstore_alloc_entry(struct blockstore      *bs,
+                       const btc_block_header *hdr,
+                       const uint256          *hash,
+                       bool                    mapped)
 {
    struct blockentry *be;
 
-   be = safe_malloc(sizeof *be);
+   if (mapped) {
+      be = slab_alloc(bs->slab_mapped);
+      be->header = hdr;
+   } else {
+      btc_block_header *copy;
+
+      be = slab_alloc(bs->slab_entries);
+      copy = (btc_block_header *)(be + 1);
+      memcpy(copy, hdr, sizeof *hdr);
+      be->header = copy;
+   }
    be->prev = NULL;
    be->next = NULL;
+   be->skip = NULL;
    be->height = 0;
+   be->chainHeight = -1;
    be->written = 0;
-   memcpy(&be->header, hdr, sizeof *hdr);
+   memcpy(&be->hash, hash, sizeof *hash);
+
+   return be;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_idx_get_filename --
+ *
+ *      headers.dat -> headers.idx.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static char *
+blockset_idx_get_filename(const char *filename)
+{
+   size_t len = strlen(filename);
+   char *idxFilename;
+
+   if (len > 4 && strcmp(filename + len - 4, ".dat") == 0) {
+      len -= 4;
+   }
+   idxFilename = safe_malloc(len + sizeof ".idx");
+   memcpy(idxFilename, filename, len);
+   memcpy(idxFilename + len, ".idx", sizeof ".idx");
+
+   return idxFilename;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_idx_write_header --
+ *
+ *      Records that the index covers the first 'filesize' bytes of
+ *      headers.dat, the last header of which hashes to 'tail'. A NULL 'tail'
+ *      invalidates the index.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blockset_idx_write_header(const struct blockset *bs,
+                          const uint256         *tail)
+{
+   struct blockset_idx_header hdr;
+   size_t numWritten;
+   int res;
+
+   ASSERT_ON_COMPILE(sizeof hdr == 56);
+
+   memset(&hdr, 0, sizeof hdr);
+   if (tail) {
+      hdr.magic    = BLOCKSET_IDX_MAGIC;
+      hdr.version  = BLOCKSET_IDX_VERSION;
+      hdr.filesize = bs->filesize;
+      memcpy(&hdr.tail, tail, sizeof hdr.tail);
+      hash4_calc(&hdr, offsetof(struct blockset_idx_header, checksum),
+                 hdr.checksum);
+   }
+
+   res = file_pwrite(bs->idxDesc, 0, &hdr, sizeof hdr, &numWritten);
+   if (res == 0 && numWritten != sizeof hdr) {
+      res = EIO;
+   }
+   return res;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_idx_write_entries --
+ *
+ *      Writes the index entries of headers #first .. #first + n - 1.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blockset_idx_write_entries(const struct blockset           *bs,
+                           uint64                           first,
+                           const struct blockset_idx_entry *entries,
+                           int                              n)
+{
+   size_t numWritten;
+   uint64 offset;
+   int res;
+
+   ASSERT_ON_COMPILE(sizeof *entries == 36);
+
+   offset = sizeof(struct blockset_idx_header) + first * sizeof *entries;
+
+   res = file_pwrite(bs->idxDesc, offset, entries, n * sizeof *entries,
+                     &numWritten);
+   if (res == 0 && numWritten != n * sizeof *entries) {
+      res = EIO;
+   }
+   return res;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_write_headers --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+blockstore_write_headers(struct blockstore *bs)
+{
+   struct blockset *bset = bs->blockSet;
+   struct blockset_idx_entry *idx;
+   btc_block_header *buf;
+   struct blockentry *e;
+   size_t numWritten;
+   uint32 count;
+   uint32 numhdr;
+   int res;
+
+   mutex_lock(bs->lock);
+
+   e = bs->best_chain;
+   count = 0;
+   while (e && e->written == 0) {
+      e = e->prev;
+      count++;
+   }
+   numhdr = count;
+   if (count == 0) {
+      mutex_unlock(bs->lock);
+      return;
+   }
+
+   buf = safe_malloc(count * sizeof *buf);
+   idx = bset->idxValid ? safe_malloc(count * sizeof *idx) : NULL;
+
+   e = bs->best_chain;
+   while (e && e->written == 0) {
+      count--;
+      memcpy(buf + count, e->header, sizeof *e->header);
+      if (idx) {
+         memcpy(&idx[count].hash, &e->hash, sizeof e->hash);
+         idx[count].height = e->height;
+      }
+      e->written = 1;
+      e = e->prev;
+   }
+
+   ASSERT(count == 0);
+   ASSERT(bset);
+   ASSERT_ON_COMPILE(sizeof *buf == 80);
+
+   res = file_pwrite(bset->desc, bset->filesize,
+                     buf, numhdr * sizeof *buf, &numWritten);
+   free(buf);
+
+   if (res != 0 || numWritten != numhdr * sizeof *buf) {
+      Warning(LGPFX" failed to write %u block entries.\n", numhdr);
+      free(idx);
+      mutex_unlock(bs->lock);
+      return;
+   }
+
+   bset->filesize += numWritten;
+
+   if (idx == NULL) {
+      mutex_unlock(bs->lock);
+      return;
+   }
+
+   /*
+    * headers.dat is updated first: if we die before the index header is
+    * rewritten, the index won't match on the next start and gets rebuilt.
+    */
+   res = blockset_idx_write_entries(bset,
+                                    bset->filesize / sizeof *buf - numhdr,
+                                    idx, numhdr);
+   if (res == 0) {
+      res = blockset_idx_write_header(bset, &bs->best_chain->hash);
+   }
+   free(idx);
+
+   if (res != 0) {
+      Warning(LGPFX" failed to update '%s': %s\n", bset->idxFilename,
+              strerror(res));
+      bset->idxValid = FALSE;
+   }
+   mutex_unlock(bs->lock);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_add_header --
+ *
+ *------------------------------------------------------------------------
+ */
+
+bool
+blockstore_add_header(struct blockstore      *bs,
+                      const btc_block_header *hdr,
+                      const uint256          *hash,
+                      bool                   *orphan)
+{
+   static unsigned int count;
+   struct blockentry *be;
+
+   *orphan = 0;
+
+   /*
+    * The caller is supposed to compute the checksum of the header it's adding.
+    * Verify that it doesn't get this wrong every few blocks.
+    */
+   count++;
+   if ((count % 32) == 0) {
+      uint256 hash0;
+      hash256_calc(hdr, sizeof *hdr, &hash0);
+      ASSERT(uint256_issame(hash, &hash0));
+   }
+
+   mutex_lock(bs->lock);
+
+   be = blockstore_lookup(bs, hash);
+   if (be) {
+      mutex_unlock(bs->lock);
+      return 0;
+   }
+
+   ASSERT(blockstore_validate_chkpt(hash, bs->height + 1));
+   ASSERT(bs->best_chain || uint256_issame(hash, &bs->genesis_hash));
+
+   be = blockstore_alloc_entry(bs, hdr, hash, FALSE);
+   blockstore_add_entry(bs, be, hash);
+
+   *orphan = be->height == -1;
+
+   mutex_unlock(bs->lock);
+
+   return 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_add_headers --
+ *
+ *      Batch version of blockstore_add_header() used when processing a
+ *      'headers' message: the headers are expected to form a chain. They're
+ *      all inserted with the blockstore lock held and the new best chain
+ *      entries are appended to headers.dat with a single write.
+ *
+ *      Returns 1 if the headers in the batch do not connect to each other.
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+blockstore_add_headers(struct blockstore      *bs,
+                       const btc_block_header *hdrs,
+                       const uint256          *hashes,
+                       int                     n,
+                       int                    *numAdded,
+                       int                    *numOrphans)
+{
+   int i;
+
+   *numAdded = 0;
+   *numOrphans = 0;
+
+   for (i = 1; i < n; i++) {
+      if (!uint256_issame(&hdrs[i].prevBlock, hashes + i - 1)) {
+         char hashStr[80];
+
+         uint256_snprintf_reverse(hashStr, sizeof hashStr, hashes + i);
+         Warning(LGPFX" header #%d/%d %s does not connect to the batch.\n",
+                 i, n, hashStr);
+         return 1;
+      }
+   }
+
+   mutex_lock(bs->lock);
+
+   for (i = 0; i < n; i++) {
+      struct blockentry *be;
+
+      if (blockstore_lookup(bs, hashes + i)) {
+         continue;
+      }
+
+      ASSERT(blockstore_validate_chkpt(hashes + i, bs->height + 1));
+      ASSERT(bs->best_chain || uint256_issame(hashes + i, &bs->genesis_hash));
+
+      be = blockstore_alloc_entry(bs, hdrs + i, hashes + i, FALSE);
+      blockstore_add_entry(bs, be, hashes + i);
+
+      (*numAdded)++;
+      if (be->height == -1) {
+         (*numOrphans)++;
+      }
+   }
+
+   if (*numAdded > 0) {
+      blockstore_write_headers(bs);
+   }
+
+   mutex_unlock(bs->lock);
+
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_close --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockset_close(struct blockset *bset)
+{
+   file_munmap((void *)bset->map, bset->mapLen);
+
+   if (file_valid(bset->desc)) {
+      file_close(bset->desc);
+   }
+   if (file_valid(bset->idxDesc)) {
+      file_close(bset->idxDesc);
+   }
+
+   free(bset->idxFilename);
+   free(bset->filename);
+   free(bset);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_hash_cb --
+ *
+ *      Runs on a pool worker: hashes a slice of a chunk of headers.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockset_hash_cb(void *clientData)
+{
+   struct blockset_hash_job *job = clientData;
+   struct blockset_chunk *chunk = job->chunk;
+   int i;
+
+   for (i = job->start; i < job->start + job->num; i++) {
+      hash256_calc(chunk->hdrs + i, sizeof chunk->hdrs[0], chunk->hashes + i);
+   }
+
+   mutex_lock(chunk->lock);
+   chunk->numPending--;
+   if (chunk->numPending == 0) {
+      condvar_signal(chunk->cv);
+   }
+   mutex_unlock(chunk->lock);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_chunk_wait --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockset_chunk_wait(struct blockset_chunk *chunk)
+{
+   mutex_lock(chunk->lock);
+   while (chunk->numPending > 0) {
+      condvar_wait(chunk->cv, chunk->lock);
+   }
+   mutex_unlock(chunk->lock);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_chunk_read_idx --
+ *
+ *      Fetches the hashes of a chunk from headers.idx instead of computing
+ *      them. A few of them are still verified: ESTALE means the index can't
+ *      be trusted.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blockset_chunk_read_idx(const struct blockset *bs,
+                        struct blockset_chunk *chunk)
+{
+   size_t len = chunk->numHeaders * sizeof *chunk->idx;
+   uint64 offset;
+   size_t numRead;
+   int res;
+   int i;
+
+   offset = sizeof(struct blockset_idx_header) +
+            chunk->offset / sizeof *chunk->hdrs * sizeof *chunk->idx;
+
+   res = file_pread(bs->idxDesc, offset, chunk->idx, len, &numRead);
+   if (res != 0 || numRead != len) {
+      return ESTALE;
+   }
+
+   for (i = 0; i < chunk->numHeaders; i++) {
+      memcpy(chunk->hashes + i, &chunk->idx[i].hash, sizeof chunk->hashes[0]);
+   }
+
+   for (i = 0; i < chunk->numHeaders; i += BLOCKSET_IDX_CHECK_FREQ) {
+      uint256 hash;
+
+      hash256_calc(chunk->hdrs + i, sizeof chunk->hdrs[0], &hash);
+      if (!uint256_issame(&hash, chunk->hashes + i)) {
+         return ESTALE;
+      }
+   }
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_chunk_read --
+ *
+ *      Reads the next chunk of headers from the file and starts hashing it,
+ *      on the pool of worker threads if there's one.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blockset_chunk_read(struct blockset       *bs,
+                    uint64                 offset,
+                    struct blockset_chunk *chunk)
+{
+   size_t numRead;
+   int numJobs;
+   int res;
+   int i;
+
+   ASSERT(chunk->numPending == 0);
+
+   chunk->offset = offset;
+   chunk->numHeaders = 0;
+
+   if (bs->map) {
+      numRead = MIN(bs->mapLen - offset,
+                    BLOCKSET_CHUNK_SIZE * sizeof *chunk->hdrs);
+      chunk->hdrs = bs->map + offset / sizeof *chunk->hdrs;
+   } else {
+      chunk->numBytes = MIN(bs->filesize - offset,
+                            BLOCKSET_CHUNK_SIZE * sizeof *chunk->hdrs);
+      res = file_pread(bs->desc, offset, chunk->buf, chunk->numBytes, &numRead);
+      if (res != 0) {
+         return res;
+      }
+      chunk->hdrs = chunk->buf;
+   }
+   chunk->numBytes = numRead;
+   chunk->numHeaders = numRead / sizeof *chunk->hdrs;
+
+   if (bs->idxValid) {
+      return blockset_chunk_read_idx(bs, chunk);
+   }
+
+   if (btc->pw == NULL) {
+      for (i = 0; i < chunk->numHeaders; i++) {
+         hash256_calc(chunk->hdrs + i, sizeof chunk->hdrs[0], chunk->hashes + i);
+      }
+      return 0;
+   }
+
+   numJobs = CEILING(chunk->numHeaders, BLOCKSET_HASH_JOB_SIZE);
+   chunk->numPending = numJobs;
+
+   for (i = 0; i < numJobs; i++) {
+      struct blockset_hash_job *job = chunk->jobs + i;
+
+      job->chunk = chunk;
+      job->start = i * BLOCKSET_HASH_JOB_SIZE;
+      job->num   = MIN(BLOCKSET_HASH_JOB_SIZE, chunk->numHeaders - job->start);
 
-   return be;
+      poolworker_queue_work(btc->pw, blockset_hash_cb, job);
+   }
+   return 0;
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * blockstore_write_headers --
+ * blockset_chunk_link --
+ *
+ *      Adds the headers of a hashed chunk to the blockstore, in file order.
  *
  *------------------------------------------------------------------------
  */
 
-void
-blockstore_write_headers(struct blockstore *bs)
+static int
+blockset_chunk_link(struct blockstore     *blockStore,
+                    struct blockset_chunk *chunk)
 {
-   btc_block_header *buf;
-   struct blockentry *e;
-   size_t numWritten;
-   uint32 count;
-   uint32 numhdr;
+   struct blockset *bs = blockStore->blockSet;
    int res;
+   int i;
 
-   e = bs->best_chain;
-   count = 0;
-   while (e && e->written == 0) {
-      e = e->prev;
-      count++;
-   }
-   ASSERT(count < 2048);
-   numhdr = count;
-   if (count == 0) {
-      return;
-   }
+   for (i = 0; i < chunk->numHeaders; i++) {
+      const uint256 *hash = chunk->hashes + i;
+      struct blockentry *be;
 
-   buf = safe_malloc(count * sizeof *buf);
+      if (!blockstore_validate_chkpt(hash, blockStore->height + 1)) {
+         return 1;
+      }
 
-   e = bs->best_chain;
-   while (e && e->written == 0) {
-      count--;
-      memcpy(buf + count, &e->header, sizeof e->header);
-      e->written = 1;
-      e = e->prev;
-   }
+      /*
+       * Headers are only ever appended to headers.dat after their parent: if
+       * the index is right, the parent of each header is already known and
+       * the height recorded matches the one we compute.
+       */
+      if (bs->idxValid && blockStore->best_chain &&
+          blockstore_lookup(blockStore, &chunk->hdrs[i].prevBlock) == NULL) {
+         return ESTALE;
+      }
 
-   ASSERT(count == 0);
-   ASSERT(bs->blockSet);
-   ASSERT_ON_COMPILE(sizeof *buf == 80);
+      be = blockstore_alloc_entry(blockStore, chunk->hdrs + i, hash,
+                                  bs->map != NULL);
+      be->written = 1;
 
-   res = file_pwrite(bs->blockSet->desc, bs->blockSet->filesize,
-                     buf, numhdr * sizeof *buf, &numWritten);
-   free(buf);
+      blockstore_add_entry(blockStore, be, hash);
 
-   if (res != 0 || numWritten != numhdr * sizeof *buf) {
-      Warning(LGPFX" failed to write %u block entries.\n", numhdr);
-      return;
+      if (bs->idxValid) {
+         if (be->height >= 0 && chunk->idx[i].height >= 0 &&
+             be->height != chunk->idx[i].height) {
+            return ESTALE;
+         }
+      } else {
+         memcpy(&chunk->idx[i].hash, hash, sizeof *hash);
+         chunk->idx[i].height = be->height;
+      }
+
+      if (i == chunk->numHeaders - 1) {
+         bitcui_set_status("loading headers .. %llu%%",
+                          (chunk->offset + chunk->numBytes) * 100 / bs->filesize);
+      }
+      if (i == chunk->numHeaders - 1 ||
+          (chunk->numHeaders < BLOCKSET_CHUNK_SIZE &&
+           i > chunk->numHeaders - 256)) {
+         bitcui_set_last_block_info(hash, blockStore->height,
+                                   be->header->timestamp);
+      }
    }
 
-   bs->blockSet->filesize += numWritten;
+   if (bs->idxValid || !file_valid(bs->idxDesc)) {
+      return 0;
+   }
+
+   res = blockset_idx_write_entries(bs, chunk->offset / sizeof *chunk->hdrs,
+                                    chunk->idx, chunk->numHeaders);
+   if (res != 0) {
+      Warning(LGPFX" failed to write to '%s': %s\n", bs->idxFilename,
+              strerror(res));
+      file_close(bs->idxDesc);
+      bs->idxDesc = NULL;
+   }
+   return 0;
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * blockstore_add_header --
+ * blockset_idx_open --
+ *
+ *      Opens headers.idx, creating it if needed, and checks whether it
+ *      matches headers.dat. Failing to open it is not fatal: we just won't
+ *      have an index.
  *
  *------------------------------------------------------------------------
  */
 
-bool
-blockstore_add_header(struct blockstore      *bs,
-                      const btc_block_header *hdr,
-                      const uint256          *hash,
-                      bool                   *orphan)
+static void
+blockset_idx_open(struct blockset *bs)
 {
-   static unsigned int count;
-   struct blockentry *be;
+   struct blockset_idx_header hdr;
+   uint64 numRecords;
+   const char *stale;
+   uint8 checksum[4];
+   size_t numRead;
+   int64 idxSize;
+   int res;
 
-   *orphan = 0;
+   bs->idxFilename = blockset_idx_get_filename(bs->filename);
+   bs->idxValid = FALSE;
 
-   /*
-    * The caller is supposed to compute the checksum of the header it's adding.
-    * Verify that it doesn't get this wrong every few blocks.
-    */
-   count++;
-   if ((count % 32) == 0) {
-      uint256 hash0;
-      hash256_calc(hdr, sizeof *hdr, &hash0);
-      ASSERT(uint256_issame(hash, &hash0));
+   if (!file_exists(bs->idxFilename)) {
+      res = file_create(bs->idxFilename);
+      if (res == 0) {
+         res = file_chmod(bs->idxFilename, 0600);
+      }
+      if (res != 0) {
+         Warning(LGPFX" failed to create '%s': %s\n", bs->idxFilename,
+                 strerror(res));
+         return;
+      }
    }
 
-   be = blockstore_lookup(bs, hash);
-   if (be) {
-      return 0;
+   res = file_open(bs->idxFilename, 0 /* !ro */, 0 /* !unbuf */, &bs->idxDesc);
+   if (res != 0) {
+      Warning(LGPFX" failed to open '%s': %s\n", bs->idxFilename,
+              strerror(res));
+      return;
    }
 
-   ASSERT(blockstore_validate_chkpt(hash, bs->height + 1));
-   ASSERT(bs->best_chain || uint256_issame(hash, &bs->genesis_hash));
-
-   be = blockstore_alloc_entry(hdr);
-   blockstore_add_entry(bs, be, hash);
-
-   *orphan = be->height == -1;
+   numRecords = bs->filesize / sizeof(btc_block_header);
+   idxSize = file_getsize(bs->idxDesc);
 
-   return 1;
-}
+   if (idxSize < 0 || idxSize < sizeof hdr +
+                                 numRecords * sizeof(struct blockset_idx_entry)) {
+      stale = "too short";
+      goto stale;
+   }
 
+   res = file_pread(bs->idxDesc, 0, &hdr, sizeof hdr, &numRead);
+   if (res != 0 || numRead != sizeof hdr) {
+      stale = "failed to read header";
+      goto stale;
+   }
 
-/*
- *------------------------------------------------------------------------
- *
- * blockset_close --
- *
- *------------------------------------------------------------------------
- */
+   hash4_calc(&hdr, offsetof(struct blockset_idx_header, checksum), checksum);
+   if (hdr.magic != BLOCKSET_IDX_MAGIC || hdr.version != BLOCKSET_IDX_VERSION ||
+       memcmp(checksum, hdr.checksum, sizeof checksum) != 0) {
+      stale = "bad header";
+      goto stale;
+   }
+   if (hdr.filesize != bs->filesize) {
+      stale = "size mismatch";
+      goto stale;
+   }
 
-static void
-blockset_close(struct blockset *bset)
-{
-   if (file_valid(bset->desc)) {
-      file_close(bset->desc);
+   if (numRecords > 0) {
+      struct blockset_idx_entry entry;
+      btc_block_header last;
+      uint256 hash;
+      size_t numRead2;
+
+      res = file_pread(bs->desc, (numRecords - 1) * sizeof last,
+                       &last, sizeof last, &numRead);
+      if (res == 0) {
+         res = file_pread(bs->idxDesc,
+                          sizeof hdr + (numRecords - 1) * sizeof entry,
+                          &entry, sizeof entry, &numRead2);
+      }
+      if (res != 0 || numRead != sizeof last || numRead2 != sizeof entry) {
+         stale = "failed to read tail";
+         goto stale;
+      }
+      hash256_calc(&last, sizeof last, &hash);
+      if (!uint256_issame(&hash, &hdr.tail) ||
+          !uint256_issame(&hash, &entry.hash)) {
+         stale = "tail mismatch";
+         goto stale;
+      }
    }
 
-   free(bset->filename);
-   free(bset);
+   Log(LGPFX" using index '%s'.\n", bs->idxFilename);
+   bs->idxValid = TRUE;
+   return;
+
+stale:
+   Log(LGPFX" index '%s' is stale (%s): rebuilding it.\n",
+       bs->idxFilename, stale);
 }
 
 
@@ -726,15 +2060,17 @@ blockset_close(struct blockset *bset)
  *
  * blockset_open_file --
  *
+ *      With 'useMmap', the headers present in the file are mapped and the
+ *      entries created for them at load time point directly in the mapping.
+ *      The ones added later are still allocated on the heap.
+ *
  *------------------------------------------------------------------------
  */
 
 static int
-blockset_open_file(struct blockstore *blockStore,
-                   struct blockset *bs)
+blockset_open_file(struct blockset *bs,
+                   bool             useMmap)
 {
-   uint64 offset;
-   mtime_t ts;
    int res;
 
    res = file_open(bs->filename, 0 /* R/O */, 0 /* !unbuf */, &bs->desc);
@@ -756,55 +2092,137 @@ blockset_open_file(struct blockstore *blockStore,
       free(s);
    }
 
+   if (useMmap && bs->filesize >= sizeof(btc_block_header)) {
+      size_t len = bs->filesize / sizeof(btc_block_header) *
+                   sizeof(btc_block_header);
+      void *map;
+
+      res = file_mmap(bs->desc, 0, len, &map);
+      if (res == 0) {
+         bs->map = map;
+         bs->mapLen = len;
+      } else {
+         Warning(LGPFX" failed to map '%s': %s\n", bs->filename, strerror(res));
+      }
+   }
+
+   blockset_idx_open(bs);
+
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockset_load --
+ *
+ *      Chunk N+1 gets read and hashed by the pool workers while the main
+ *      thread links chunk N, so that the ordering constraint of linking does
+ *      not serialize the hashing. When headers.idx can be trusted, the hashes
+ *      are read from it instead. Otherwise the index is rewritten as we go.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+blockset_load(struct blockstore *blockStore,
+              struct blockset   *bs)
+{
+   struct blockset_chunk chunks[2];
+   struct blockset_chunk *cur;
+   struct blockset_chunk *next;
+   uint64 numHeaders;
+   uint64 offset;
+   uint256 tail;
+   mtime_t ts;
+   int res;
+   int i;
+
+   if (!bs->idxValid && file_valid(bs->idxDesc)) {
+      res = blockset_idx_write_header(bs, NULL);
+      if (res != 0) {
+         Warning(LGPFX" failed to write to '%s': %s\n", bs->idxFilename,
+                 strerror(res));
+         file_close(bs->idxDesc);
+         bs->idxDesc = NULL;
+      }
+   }
+
+   memset(chunks, 0, sizeof chunks);
+   for (i = 0; i < ARRAYSIZE(chunks); i++) {
+      chunks[i].buf    = bs->map ? NULL :
+                         safe_malloc(BLOCKSET_CHUNK_SIZE * sizeof *chunks[i].buf);
+      chunks[i].hashes = safe_malloc(BLOCKSET_CHUNK_SIZE * sizeof *chunks[i].hashes);
+      chunks[i].idx    = safe_malloc(BLOCKSET_CHUNK_SIZE * sizeof *chunks[i].idx);
+      chunks[i].lock   = mutex_alloc();
+      chunks[i].cv     = condvar_alloc();
+   }
+
    ts = time_get();
+   numHeaders = 0;
    offset = 0;
-   while (offset < bs->filesize) {
-      btc_block_header buf[10000];
-      size_t numRead;
-      size_t numBytes;
-      int numHeaders;
-      int i;
+   res = 0;
+   cur = chunks;
+   next = chunks + 1;
+   memset(&tail, 0, sizeof tail);
+
+   if (offset < bs->filesize) {
+      res = blockset_chunk_read(bs, offset, cur);
+      offset += cur->numBytes;
+   }
 
-      numBytes = MIN(bs->filesize - offset, sizeof buf);
+   while (res == 0 && cur->numHeaders > 0) {
+      struct blockset_chunk *tmp;
+      int resRead = 0;
 
-      res = file_pread(bs->desc, offset, buf, numBytes, &numRead);
-      if (res != 0) {
-         break;
+      next->numHeaders = 0;
+      if (offset < bs->filesize) {
+         resRead = blockset_chunk_read(bs, offset, next);
+         offset += next->numBytes;
       }
 
+      blockset_chunk_wait(cur);
+
       if (btc->stop != 0) {
          res = 1;
          NOT_TESTED();
          break;
       }
 
-      numHeaders = numRead / sizeof(btc_block_header);
-      for (i = 0; i < numHeaders; i++) {
-         struct blockentry *be;
-         uint256 hash;
+      res = blockset_chunk_link(blockStore, cur);
+      if (res == 0) {
+         res = resRead;
+      }
+      numHeaders += cur->numHeaders;
+      memcpy(&tail, cur->hashes + cur->numHeaders - 1, sizeof tail);
 
-         be = blockstore_alloc_entry(buf + i);
-         be->written = 1;
-         hash256_calc(buf + i, sizeof buf[0], &hash);
+      tmp = cur;
+      cur = next;
+      next = tmp;
+   }
 
-         if (!blockstore_validate_chkpt(&hash, blockStore->height + 1)) {
-            return 1;
-         }
+   for (i = 0; i < ARRAYSIZE(chunks); i++) {
+      blockset_chunk_wait(chunks + i);
+      condvar_free(chunks[i].cv);
+      mutex_free(chunks[i].lock);
+      free(chunks[i].idx);
+      free(chunks[i].hashes);
+      free(chunks[i].buf);
+   }
 
-         blockstore_add_entry(blockStore, be, &hash);
+   if (res != 0) {
+      return res;
+   }
 
-         if (i == numHeaders - 1) {
-            bitcui_set_status("loading headers .. %llu%%",
-                             (offset + numBytes) * 100 / bs->filesize);
-         }
-         if (i == numHeaders - 1 ||
-             (numBytes < sizeof buf && i > numHeaders - 256)) {
-            bitcui_set_last_block_info(&hash, blockStore->height,
-                                      be->header.timestamp);
-         }
+   if (!bs->idxValid && file_valid(bs->idxDesc)) {
+      int resIdx = blockset_idx_write_header(bs, &tail);
+      if (resIdx != 0) {
+         Warning(LGPFX" failed to write to '%s': %s\n", bs->idxFilename,
+                 strerror(resIdx));
+      } else {
+         bs->idxValid = TRUE;
       }
-
-      offset += numRead;
    }
 
    ts = time_get() - ts;
@@ -815,10 +2233,41 @@ blockset_open_file(struct blockstore *blockStore,
    uint256_snprintf_reverse(hashStr, sizeof hashStr, &blockStore->best_hash);
    Log(LGPFX" loaded blocks up to %s\n", hashStr);
    latStr = print_latency(ts);
-   Log(LGPFX" this took %s\n", latStr);
+   Log(LGPFX" this took %s -- %llu headers/sec\n", latStr,
+       ts > 0 ? numHeaders * 1000 * 1000 / ts : 0);
    free(latStr);
 
-   return res;
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * blockstore_reset --
+ *
+ *      Forgets about all the headers loaded so far.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+blockstore_reset(struct blockstore *bs)
+{
+   blockstore_orphan_clear(bs);
+   hashtable_clear(bs->hash_blk);
+   hashtable_clear(bs->hash_orphans);
+   slab_reset(bs->slab_entries);
+   slab_reset(bs->slab_mapped);
+
+   free(bs->chain);
+   bs->chain      = NULL;
+   bs->chainSize  = 0;
+   bs->best_chain = NULL;
+   bs->genesis    = NULL;
+   bs->height     = -1;
+   memset(&bs->best_hash, 0, sizeof bs->best_hash);
+   blockstore_tip_publish(bs);
 }
 
 
@@ -832,16 +2281,32 @@ blockset_open_file(struct blockstore *blockStore,
 
 static int
 blockset_open(struct blockstore *blockStore,
-             const char *filename)
+             const char *filename,
+             bool useMmap)
 {
    struct blockset *bs;
+   int res;
 
    bs = safe_calloc(1, sizeof *bs);
    bs->filename = safe_strdup(filename);
 
    blockStore->blockSet = bs;
 
-   return blockset_open_file(blockStore, bs);
+   res = blockset_open_file(bs, useMmap);
+   if (res != 0) {
+      return res;
+   }
+
+   res = blockset_load(blockStore, bs);
+   if (res == ESTALE) {
+      Warning(LGPFX" index '%s' does not match headers: rebuilding it.\n",
+              bs->idxFilename);
+      blockstore_reset(blockStore);
+      bs->idxValid = FALSE;
+      res = blockset_load(blockStore, bs);
+   }
+   blockstore_tip_publish(blockStore);
+   return res;
 }
 
 
@@ -878,12 +2343,16 @@ blockstore_get_filename(struct config *config)
 void
 blockstore_zap(struct config *config)
 {
+   char *idxFile;
    char *file;
 
    file = blockstore_get_filename(config);
+   idxFile = blockset_idx_get_filename(file);
 
    Warning(LGPFX" removing blockset '%s'.\n", file);
    file_unlink(file);
+   file_unlink(idxFile);
+   free(idxFile);
    free(file);
 }
 
@@ -930,8 +2399,17 @@ blockstore_init(struct config *config,
 
    bs = safe_calloc(1, sizeof *bs);
    bs->height       = -1;
-   bs->hash_blk     = hashtable_create();
-   bs->hash_orphans = hashtable_create();
+   bs->orphanExpiry = config_getint64(config,
+                                      BLOCKSTORE_ORPHAN_EXPIRY / (1000 * 1000),
+                                      "headers.orphanExpiry") * 1000 * 1000;
+   bs->hash_blk     = hashtable_create_fixed("blocks", sizeof(uint256));
+   bs->hash_orphans = hashtable_create_fixed("orphans", sizeof(uint256));
+   bs->hash_waiting = hashtable_create_fixed("waiting", sizeof(uint256));
+   bs->slab_entries = slab_create("blockentry",
+                                  sizeof(struct blockentry) +
+                                  sizeof(btc_block_header));
+   bs->slab_mapped  = slab_create("blockentry-mapped",
+                                  sizeof(struct blockentry));
 
    const struct block_cpt_entry_str *arrayStr;
    struct block_cpt_entry *array;
@@ -955,7 +2433,7 @@ blockstore_init(struct config *config,
    memcpy(&bs->genesis_hash.data, &array[0].hash.data, sizeof bs->genesis_hash);
    Log(LGPFX" Genesis: %s\n", arrayStr[0].hashStr);
 
-   res = blockset_open(bs, file);
+   res = blockset_open(bs, file, config_getbool(config, TRUE, "headers.mmap"));
    free(file);
    if (res != 0) {
       goto exit;
@@ -964,6 +2442,7 @@ blockstore_init(struct config *config,
    Log(LGPFX" loaded %d headers.\n", bs->height + 1);
 
    bs->lock = mutex_alloc();
+   bs->rwlock = rwlock_alloc();
    *blockStore = bs;
 
    return 0;
@@ -996,20 +2475,90 @@ blockstore_exit(struct blockstore *bs)
       Log(LGPFX" closing blockstore w/ height=%d\n", bs->height);
    }
 
-   blockset_close(bs->blockSet);
-
    hashtable_printstats(bs->hash_blk, "blocks");
-   hashtable_clear_with_free(bs->hash_blk);
-   hashtable_clear_with_free(bs->hash_orphans);
+   slab_printstats(bs->slab_entries);
+   slab_printstats(bs->slab_mapped);
+   blockstore_orphan_clear(bs);
+   hashtable_clear(bs->hash_blk);
+   hashtable_clear(bs->hash_orphans);
    hashtable_destroy(bs->hash_blk);
    hashtable_destroy(bs->hash_orphans);
+   hashtable_destroy(bs->hash_waiting);
+   slab_destroy(bs->slab_entries);
+   slab_destroy(bs->slab_mapped);
+   free(bs->chain);
+
+   /*
+    * After the entries are gone: they may point in the mapping of the file.
+    */
+   blockset_close(bs->blockSet);
 
    mutex_free(bs->lock);
+   rwlock_free(bs->rwlock);
    memset(bs, 0, sizeof *bs);
    free(bs);
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * blockstore_find_height_from_birth --
+ *
+ *      Returns the height of the last block of the best chain such that no
+ *      block up to it is younger than 'birth', or -1 if there's none. Block
+ *      timestamps are not strictly increasing, so we binary search on their
+ *      running maximum: the block returned may be slightly older than the
+ *      last block with a timestamp before 'birth', never younger.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+blockstore_find_height_from_birth(const struct blockstore *bs,
+                                  uint64                   birth)
+{
+   int lo;
+   int hi;
+
+   lo = 0;
+   hi = bs->height;
+
+   while (lo <= hi) {
+      int mid = lo + (hi - lo) / 2;
+
+      if (bs->chain[mid].maxTimestamp < birth) {
+         lo = mid + 1;
+      } else {
+         hi = mid - 1;
+      }
+   }
+   return hi;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * blockstore_get_height_from_birth --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+int
+blockstore_get_height_from_birth(const struct blockstore *bs,
+                                 uint64                   birth)
+{
+   int height;
+
+   rwlock_rdlock(bs->rwlock);
+   height = blockstore_find_height_from_birth(bs, birth);
+   rwlock_unlock(bs->rwlock);
+
+   return height;
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -1024,24 +2573,30 @@ blockstore_get_hash_from_birth(const struct blockstore *bs,
                                uint256                 *hash)
 {
    struct blockentry *e;
-   
-   for (e = bs->best_chain; e != bs->genesis; e = e->prev)  {
-      if (e->header.timestamp < birth) {
-         char hashStr[80];
-         char *s;
-         uint64 ts = birth;
+   char hashStr[80];
+   uint64 ts = birth;
+   int height;
+   char *s;
 
-         hash256_calc(&e->header, sizeof e->header, hash);
+   rwlock_rdlock(bs->rwlock);
 
-         uint256_snprintf_reverse(hashStr, sizeof hashStr, hash);
-         s = print_time_local(birth, "%c");
-         Log(LGPFX" birth %llu (%s) --> block %s.\n", ts, s, hashStr);
-         free(s);
-         return;
-      }
+   height = blockstore_find_height_from_birth(bs, birth);
+   if (height < 0) {
+      rwlock_unlock(bs->rwlock);
+      memcpy(hash, &bs->genesis_hash, sizeof *hash);
+      ASSERT(0);
+      return;
    }
-   memcpy(hash, &bs->genesis_hash, sizeof *hash);
-   ASSERT(0);
+
+   e = bs->chain[height].be;
+   memcpy(hash, &e->hash, sizeof *hash);
+
+   rwlock_unlock(bs->rwlock);
+
+   uint256_snprintf_reverse(hashStr, sizeof hashStr, hash);
+   s = print_time_local(birth, "%c");
+   Log(LGPFX" birth %llu (%s) --> block %s.\n", ts, s, hashStr);
+   free(s);
 }
 
 
@@ -1060,21 +2615,20 @@ blockstore_is_next(struct blockstore *bs,
                    const uint256 *next)
 {
    struct blockentry *be;
-   uint256 hash;
    bool s;
 
-   mutex_lock(bs->lock);
+   rwlock_rdlock(bs->rwlock);
 
    s = hashtable_lookup(bs->hash_blk, prev, sizeof *prev, (void*)&be);
    if (s == 0 || be->next == NULL) {
-      mutex_unlock(bs->lock);
+      rwlock_unlock(bs->rwlock);
       return 0;
    }
 
-   hash256_calc(&be->next->header, sizeof be->next->header, &hash);
-   mutex_unlock(bs->lock);
+   s = uint256_issame(&be->next->hash, next);
+   rwlock_unlock(bs->rwlock);
 
-   return uint256_issame(&hash, next);
+   return s;
 }
 
 
@@ -1083,37 +2637,39 @@ blockstore_is_next(struct blockstore *bs,
  *
  * blockstore_get_next_hashes --
  *
+ *      Returns the hashes of up to 'num' blocks following 'start' on the
+ *      best chain.
+ *
  *-------------------------------------------------------------------------
  */
 
 void
 blockstore_get_next_hashes(struct blockstore *bs,
                            const uint256 *start,
+                           int num,
                            uint256 **hash,
                            int *n)
 {
    struct blockentry *be;
    uint256 *table;
-   int num;
    bool s;
    int i;
 
    i = 0;
    table = NULL;
 
-   mutex_lock(bs->lock);
+   rwlock_rdlock(bs->rwlock);
 
    s = hashtable_lookup(bs->hash_blk, start, sizeof *start, (void*)&be);
-   if (s == 0 || be->next == NULL) {
+   if (s == 0 || be->next == NULL || num <= 0) {
       goto exit;
    }
 
    be = be->next;
-   num = 1000;
    table = safe_malloc(num * sizeof *table);
 
    while (be && i < num) {
-      hash256_calc(&be->header, sizeof be->header, table + i);
+      memcpy(table + i, &be->hash, sizeof be->hash);
       i++;
       be = be->next;
    }
@@ -1121,7 +2677,7 @@ blockstore_get_next_hashes(struct blockstore *bs,
 exit:
    *n = i;
    *hash = table;
-   mutex_unlock(bs->lock);
+   rwlock_unlock(bs->rwlock);
 }
 
 
@@ -1137,13 +2693,10 @@ void
 blockstore_get_best_hash(const struct blockstore *bs,
                          uint256 *hash)
 {
-   mutex_lock(bs->lock);
-   if (bs->best_chain == NULL) {
-      memset(hash, 0, sizeof *hash);
-   } else {
-      memcpy(hash, &bs->best_hash, sizeof *hash);
-   }
-   mutex_unlock(bs->lock);
+   struct blockstore_tip tip;
+
+   blockstore_tip_read(bs, &tip);
+   memcpy(hash, &tip.hash, sizeof *hash);
 }
 
 
@@ -1160,29 +2713,27 @@ blockstore_get_locator_hashes(const struct blockstore *bs,
                               uint256 **hash,
                               int *num)
 {
-   volatile struct blockentry *be;
    uint256 h[64];
    uint32 step = 1;
+   int height;
    int n = 0;
 
    *hash = NULL;
    *num = 0;
 
-   mutex_lock(bs->lock);
+   rwlock_rdlock(bs->rwlock);
 
-   be = bs->best_chain;
-   while (be) {
-      int i;
+   height = bs->best_chain ? bs->height : -1;
+   while (height >= 0) {
+      const struct blockentry *be = bs->chain[height].be;
 
       ASSERT(n < ARRAYSIZE(h));
-      hash256_calc((void *)&be->header, sizeof be->header, h + n);
+      memcpy(h + n, &be->hash, sizeof be->hash);
       n++;
       if (n >= 10) {
          step *= 2;
       }
-      for (i = 0; i < step && be; i++) {
-         be = be->prev;
-      }
+      height -= step;
    }
    *num = n;
    if (n > 0) {
@@ -1190,7 +2741,7 @@ blockstore_get_locator_hashes(const struct blockstore *bs,
       memcpy(*hash, h, n * sizeof(uint256));
    }
 
-   mutex_unlock(bs->lock);
+   rwlock_unlock(bs->rwlock);
 }
 
 
@@ -1223,14 +2774,14 @@ blockstore_get_block_timestamp(const struct blockstore *bs,
                                const uint256 *hash)
 {
    struct blockentry *be;
-   time_t ts = 0;
-
-   mutex_lock(bs->lock);
+   time_t ts;
 
    if (uint256_iszero(hash)) {
-      goto done;
+      return 0;
    }
 
+   rwlock_rdlock(bs->rwlock);
+
    be = blockstore_lookup(bs, hash);
    if (be == NULL) {
       char hashStr[80];
@@ -1239,10 +2790,9 @@ blockstore_get_block_timestamp(const struct blockstore *bs,
       Panic(LGPFX" block %s not found.\n", hashStr);
    }
 
-   ts = be->header.timestamp;
+   ts = be->header->timestamp;
 
-done:
-   mutex_unlock(bs->lock);
+   rwlock_unlock(bs->rwlock);
 
    return ts;
 }
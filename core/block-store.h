@@ -15,16 +15,21 @@ void blockstore_zap(struct config *config);
 void blockstore_get_genesis(const struct blockstore *bs, uint256 *hash);
 void blockstore_get_best_hash(const struct blockstore *bs, uint256 *hash);
 void blockstore_get_next_hashes(struct blockstore *bs, const uint256 *start,
-                                uint256 **hash, int *n);
+                                int num, uint256 **hash, int *n);
 bool blockstore_add_header(struct blockstore *bs, const btc_block_header *hdr,
                            const uint256 *hash, bool *orphan);
+int  blockstore_add_headers(struct blockstore *bs, const btc_block_header *hdrs,
+                            const uint256 *hashes, int n, int *numAdded,
+                            int *numOrphans);
 void blockstore_write_headers(struct blockstore *bs);
 bool blockstore_has_header(const struct blockstore *bs, const uint256 *hash);
 bool blockstore_is_orphan(const struct blockstore *bs, const uint256 *hash);
 bool blockstore_is_block_known(const struct blockstore *bs, const uint256 *hash);
 int  blockstore_get_height(const struct blockstore *bs);
 int  blockstore_get_block_height(struct blockstore *bs, const uint256 *hash);
+int  blockstore_get_fork_height(const struct blockstore *bs, const uint256 *hash);
 void blockstore_get_hash_from_birth(const struct blockstore *bs, uint64 b, uint256 *h);
+int  blockstore_get_height_from_birth(const struct blockstore *bs, uint64 b);
 bool blockstore_is_next(struct blockstore *bs, const uint256 *p, const uint256 *n);
 time_t blockstore_get_timestamp(const struct blockstore *bs);
 time_t blockstore_get_block_timestamp(const struct blockstore *bs,
@@ -35,6 +40,8 @@ void blockstore_get_highest(struct blockstore *bs,
                             uint256 *hash);
 void blockstore_get_locator_hashes(const struct blockstore *bs,
                                    uint256 **hash, int *num);
+int  blockstore_get_next_checkpoint(const struct blockstore *bs, int height,
+                                    uint256 *hash);
 bool
 blockstore_get_block_at_height(struct blockstore *bs, int height, uint256 *hash,
                                btc_block_header *header);
@@ -41,6 +41,7 @@ bloom_create(int n,
    f->filter = safe_calloc(1, f->filterSize);
    ASSERT(f->filterSize <= MAX_BLOOM_FILTER_SIZE);
    f->numHashFuncs = MIN((uint32)(f->filterSize * 8 / n * LN2), MAX_HASH_FUNCS);
+   f->numHashFuncs = MAX(f->numHashFuncs, 1);
    ASSERT(f->numHashFuncs <= MAX_HASH_FUNCS);
    f->tweak = 5; /* XXX */
 
@@ -139,3 +140,43 @@ bloom_getinfo(const struct bloom_filter *f,
    *numHashFuncs = f->numHashFuncs;
    *tweak        = f->tweak;
 }
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * bloom_get_max_elements --
+ *
+ *      How many elements a filter of the maximum size peers accept can
+ *      hold while keeping to a false-positive rate of 'fp'.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+int
+bloom_get_max_elements(double fp)
+{
+   return MAX_BLOOM_FILTER_SIZE * 8 * LN2SQUARED / -log(fp);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * bloom_get_fp_rate --
+ *
+ *      Expected false-positive rate of the filter once 'n' elements have
+ *      been added to it.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+double
+bloom_get_fp_rate(const struct bloom_filter *f,
+                  int                        n)
+{
+   double m = f->filterSize * 8.0;
+   double k = f->numHashFuncs;
+
+   return pow(1.0 - exp(-k * n / m), k);
+}
@@ -10,5 +10,7 @@ void bloom_free(struct bloom_filter *f);
 void bloom_add(struct bloom_filter *f, const void *data, size_t len);
 void bloom_getinfo(const struct bloom_filter *f, uint8 **filter,
                    uint32 *filterSize, uint32 *numHashFuncs, uint32 *tweak);
+double bloom_get_fp_rate(const struct bloom_filter *f, int n);
+int bloom_get_max_elements(double fp);
 
 #endif /* __BLOOM_H__ */
@@ -47,6 +47,7 @@ static const struct {
    [BTC_MSG_FILTERCLEAR]  = { "filterclear" },
    [BTC_MSG_MERKLEBLOCK]  = { "merkleblock" },
    [BTC_MSG_NOTFOUND]     = { "notfound"    },
+   [BTC_MSG_SENDHEADERS]  = { "sendheaders" },
 };
 
 
@@ -319,12 +320,18 @@ btcmsg_payload_valid(const struct buff *buf,
  */
 
 int
-btcmsg_parse_notfound(struct buff *buf)
+btcmsg_parse_notfound(struct buff  *buf,
+                      btc_msg_inv **invOut,
+                      int          *num)
 {
+   btc_msg_inv *inv;
    uint64 n;
    uint64 i;
    int res;
 
+   *invOut = NULL;
+   *num = 0;
+
    res = deserialize_varint(buf, &n);
    if (res) {
       NOT_TESTED();
@@ -336,20 +343,27 @@ btcmsg_parse_notfound(struct buff *buf)
       return 1;
    }
 
+   inv = safe_malloc(n * sizeof *inv);
+
    for (i = 0; i < n; i++) {
       char str[128];
-      btc_msg_inv inv;
-
-      res = deserialize_inv(buf, &inv);
-      ASSERT(res == 0);
 
-      uint256_snprintf_reverse(str, sizeof str, &inv.hash);
-      Warning(LGPFX" NOTFOUND: inv: %s %s\n", str, btc_inv_type2str(inv.type));
+      res |= deserialize_inv(buf, inv + i);
+      uint256_snprintf_reverse(str, sizeof str, &inv[i].hash);
+      Warning(LGPFX" NOTFOUND: inv: %s %s\n", str, btc_inv_type2str(inv[i].type));
+   }
+   if (res) {
+      free(inv);
+      NOT_TESTED();
+      return res;
    }
 
    ASSERT(buff_space_left(buf) == 0);
 
-   return res;
+   *num = n;
+   *invOut = inv;
+
+   return 0;
 }
 
 
@@ -644,14 +658,17 @@ btcmsg_parse_block(struct buff   *buf,
 int
 btcmsg_parse_headers(struct buff       *buf,
                      btc_block_header **headersOut,
+                     uint256          **hashesOut,
                      int               *num)
 {
    btc_block_header *headers;
+   uint256 *hashes;
    uint64 n;
    uint64 i;
    int res;
 
    *headersOut = NULL;
+   *hashesOut = NULL;
    *num = 0;
 
    res = deserialize_varint(buf, &n);
@@ -666,6 +683,7 @@ btcmsg_parse_headers(struct buff       *buf,
    }
 
    headers = safe_malloc(n * sizeof *headers);
+   hashes = safe_malloc(n * sizeof *hashes);
 
    for (i = 0; i < n; i++) {
       uint64 numTx;
@@ -675,14 +693,17 @@ btcmsg_parse_headers(struct buff       *buf,
 
       if (res) {
          free(headers);
+         free(hashes);
          return res;
       }
       ASSERT(numTx == 0);
+      hash256_calc(headers + i, sizeof headers[i], hashes + i);
    }
 
    ASSERT(buff_space_left(buf) == 0);
 
    *headersOut = headers;
+   *hashesOut = hashes;
    *num = n;
 
    return res;
@@ -733,7 +754,10 @@ btcmsg_craft_msgheader(struct buff **bufOut,
    strncpy(h.message, message, ARRAYSIZE(h.message));
    hash4_calc(buff_base(bufData), buff_curlen(bufData), h.checksum);
 
-   buf = buff_alloc();
+   /*
+    * Sized to fit: netasync releases it to the pool once sent.
+    */
+   buf = buff_alloc_pool(sizeof h + h.payloadLength);
 
    serialize_msgheader(buf, &h);
    buff_append(buf, bufData);
@@ -776,7 +800,7 @@ btcmsg_craft_filterload(const btc_msg_filterload *fl,
 {
    struct buff *buf;
 
-   buf = buff_alloc();
+   buf = buff_alloc_pool(fl->filterSize + 32);
 
    serialize_varint(buf, fl->filterSize);
    serialize_bytes(buf,  fl->filter, fl->filterSize);
@@ -791,6 +815,35 @@ btcmsg_craft_filterload(const btc_msg_filterload *fl,
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * btcmsg_craft_filteradd --
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+btcmsg_craft_filteradd(const uint8   *data,
+                       size_t         len,
+                       struct buff  **bufOut)
+{
+   struct buff *buf;
+
+   ASSERT(len <= MAX_FILTERADD_DATA_SIZE);
+
+   buf = buff_alloc_pool(len + 16);
+
+   serialize_varint(buf, len);
+   serialize_bytes(buf,  data, len);
+
+   btcmsg_craft_msgheader(bufOut, "filteradd", buf);
+   buff_free(buf);
+
+   return 0;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -806,7 +859,7 @@ btcmsg_craft_ping(uint32        protversion,
 {
    struct buff *bufNonce;
 
-   bufNonce = buff_alloc();
+   bufNonce = buff_alloc_pool(sizeof nonce);
 
    if (protversion > BTC_PROTO_PING) {
       serialize_uint64(bufNonce, nonce);
@@ -834,7 +887,7 @@ btcmsg_craft_pong(uint32        protversion,
 {
    struct buff *bufNonce;
 
-   bufNonce = buff_alloc();
+   bufNonce = buff_alloc_pool(sizeof nonce);
 
    if (protversion > BTC_PROTO_PING) {
       serialize_uint64(bufNonce, nonce);
@@ -926,7 +979,7 @@ btcmsg_craft_getblocks(const uint256 *hashes,
 
    bl = btcmsg_prepare_blocklocator(hashes, num, NULL);
 
-   buf = buff_alloc();
+   buf = buff_alloc_pool(16 + (bl->numHashes + 1) * sizeof(uint256));
    serialize_blocklocator(buf, bl);
    free(bl);
 
@@ -948,24 +1001,20 @@ btcmsg_craft_getblocks(const uint256 *hashes,
 int
 btcmsg_craft_getheaders(const uint256 *hashes,
                         int            num,
-                        const uint256 *genesis,
+                        const uint256 *stop,
                         struct buff  **bufOut)
 {
    btc_block_locator *bl;
    struct buff *buf;
 
    /*
-    * Yes, this looks somewhat funny.
-    *
-    * However, it works. So until more time frees up..
+    * With an empty locator, the peer only sends the header of 'stop': that's
+    * how we get the genesis block. Otherwise 'stop' bounds the batch, or is
+    * NULL to get as many headers as the peer is willing to send.
     */
-   if (num > 0) {
-      bl = btcmsg_prepare_blocklocator(hashes, num, NULL);
-   } else {
-      bl = btcmsg_prepare_blocklocator(NULL, 0, genesis);
-   }
+   bl = btcmsg_prepare_blocklocator(num > 0 ? hashes : NULL, num, stop);
 
-   buf = buff_alloc();
+   buf = buff_alloc_pool(16 + (bl->numHashes + 1) * sizeof(uint256));
    serialize_blocklocator(buf, bl);
    free(bl);
 
@@ -995,7 +1044,7 @@ btcmsg_craft_inv(struct buff     **bufOut,
 
    ASSERT(n <= BTC_MSG_INV_MAX_ENTRIES);
 
-   buf = buff_alloc();
+   buf = buff_alloc_pool(16 + n * sizeof(btc_msg_inv));
    serialize_varint(buf, n);
 
    for (i = 0; i < n; i++) {
@@ -1033,7 +1082,7 @@ btcmsg_craft_getdata(struct buff     **bufOut,
 
    ASSERT(n <= BTC_MSG_GETDATA_MAX_ENTRIES);
 
-   buf = buff_alloc();
+   buf = buff_alloc_pool(16 + n * sizeof(btc_msg_inv));
    serialize_varint(buf, n);
 
    for (i = 0; i < n; i++) {
@@ -1067,6 +1116,21 @@ btcmsg_craft_verack(struct buff **bufOut)
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * btcmsg_craft_sendheaders --
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+btcmsg_craft_sendheaders(struct buff **bufOut)
+{
+   return btcmsg_craft_msgheader(bufOut, "sendheaders", NULL);
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -1111,7 +1175,7 @@ btcmsg_craft_version(struct buff **bufOut)
 {
    struct buff *buf;
 
-   buf = buff_alloc();
+   buf = buff_alloc_pool(256);
 
    btcmsg_prepare_version(buf);
    btcmsg_craft_msgheader(bufOut, "version", buf);
@@ -1187,7 +1251,7 @@ btcmsg_craft_addr(uint32                        protversion,
 
    ASSERT(numAddrs <= BTC_MSG_ADDR_MAX_ENTRIES);
 
-   buf = buff_alloc();
+   buf = buff_alloc_pool(16 + numAddrs * sizeof(btc_msg_address));
    serialize_varint(buf, numAddrs);
 
    for (i = 0; i < numAddrs; i++) {
@@ -1475,6 +1539,44 @@ btc_msg_block_free(btc_msg_block *blk)
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * btc_msg_merkleblock_dup --
+ *
+ *------------------------------------------------------------------------
+ */
+
+btc_msg_merkleblock *
+btc_msg_merkleblock_dup(const btc_msg_merkleblock *blk0)
+{
+   btc_msg_merkleblock *blk;
+
+   blk = safe_malloc(sizeof *blk);
+   memcpy(blk, blk0, sizeof *blk0);
+
+   blk->hash          = NULL;
+   blk->bit           = NULL;
+   blk->matchedTxHash = NULL;
+
+   if (blk->hashCount > 0) {
+      blk->hash = safe_malloc(blk->hashCount * sizeof *blk->hash);
+      memcpy(blk->hash, blk0->hash, blk->hashCount * sizeof *blk->hash);
+   }
+   if (blk->bitArraySize > 0) {
+      blk->bit = safe_malloc(blk->bitArraySize);
+      memcpy(blk->bit, blk0->bit, blk->bitArraySize);
+   }
+   if (blk->matchedTxCount > 0) {
+      size_t sz = blk->matchedTxCount * sizeof *blk->matchedTxHash;
+
+      blk->matchedTxHash = safe_malloc(sz);
+      memcpy(blk->matchedTxHash, blk0->matchedTxHash, sz);
+   }
+   return blk;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
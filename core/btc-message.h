@@ -19,7 +19,9 @@ void btcmsg_print_txin(const btc_msg_tx_in *txIn);
 
 int btcmsg_craft_version(struct buff **buf);
 int btcmsg_craft_verack(struct buff **buf);
+int btcmsg_craft_sendheaders(struct buff **buf);
 int btcmsg_craft_filterload(const btc_msg_filterload *fl, struct buff **buf);
+int btcmsg_craft_filteradd(const uint8 *data, size_t len, struct buff **buf);
 int btcmsg_craft_getaddr(struct buff **buf);
 int btcmsg_craft_mempool(struct buff **buf);
 int btcmsg_craft_getblocks(const uint256 *hashes, int n, struct buff **bufOut);
@@ -29,19 +31,20 @@ int btcmsg_craft_tx(struct buff *txBuf, struct buff **bufOut);
 int btcmsg_craft_addr(uint32 protversion, const struct btc_msg_address *addrs,
                       size_t numAddrs, struct buff **buf);
 int btcmsg_craft_getheaders(const uint256 *hashes, int n,
-                            const uint256 *genesis,
+                            const uint256 *stop,
                             struct buff **buf);
 int btcmsg_craft_getdata(struct buff **bufOut, enum btc_inv_type type,
                          const uint256 *hash, int numHash);
 int btcmsg_craft_inv(struct buff **bufOut, enum btc_inv_type type,
                      const uint256 *hash, int n);
 
-int btcmsg_parse_notfound(struct buff *buf);
+int btcmsg_parse_notfound(struct buff *buf, btc_msg_inv **invOut, int *num);
 int btcmsg_parse_version(struct buff *buf, btc_msg_version *version);
 int btcmsg_parse_alert(struct buff *buf);
 int btcmsg_parse_pingpong(uint32 protversion, struct buff *buf, uint64 *nonce);
 int btcmsg_parse_inv(struct buff *buf, btc_msg_inv **invOut, int *num);
-int btcmsg_parse_headers(struct buff *buf, btc_block_header **h, int *num);
+int btcmsg_parse_headers(struct buff *buf, btc_block_header **h,
+                         uint256 **hashes, int *num);
 int btcmsg_parse_block(struct buff *buf, btc_msg_block *blk);
 int btcmsg_parse_merkleblock(struct buff *buf, btc_msg_merkleblock **blkOut);
 int btcmsg_parse_addr(uint32 prot, struct buff *buf,
@@ -56,6 +59,7 @@ void btc_msg_tx_init(btc_msg_tx *tx);
 uint64 btc_msg_tx_value(const btc_msg_tx *tx);
 
 void btc_msg_block_free(btc_msg_block *blk);
+btc_msg_merkleblock *btc_msg_merkleblock_dup(const btc_msg_merkleblock *blk0);
 void btc_msg_merkleblock_free(btc_msg_merkleblock *blk);
 
 #endif /* __BTC_MESSAGE_H__ */
@@ -5,12 +5,14 @@
 #include <stdlib.h>
 
 #include "util.h"
+#include "bufpool.h"
 
 struct buff {
    uint8     *base;
    size_t     len;
    ssize_t    idx;
    bool       grow;
+   bool       pool;   /* base comes from bufpool */
 };
 
 
@@ -35,8 +37,13 @@ buff_resize(struct buff *buf,
     */
    newlen = MAX(buf->len * 2, buf->len + sz);
 
-   buf->base = safe_realloc(buf->base, newlen);
-   buf->len = newlen;
+   if (buf->pool) {
+      buf->base = bufpool_realloc(buf->base, newlen);
+      buf->len = bufpool_get_size(buf->base);
+   } else {
+      buf->base = safe_realloc(buf->base, newlen);
+      buf->len = newlen;
+   }
 }
 
 
@@ -207,6 +214,7 @@ buff_init(struct buff *buf,
    buf->len  = len;
    buf->idx  = 0;
    buf->grow = 0;
+   buf->pool = 0;
 }
 
 
@@ -294,7 +302,11 @@ buff_free_base(struct buff *buf)
 {
    ASSERT(buf);
 
-   free(buf->base);
+   if (buf->pool) {
+      bufpool_free(buf->base);
+   } else {
+      free(buf->base);
+   }
    buf->base = NULL;
    buf->len = 0;
    buf->idx = 0;
@@ -339,6 +351,7 @@ buff_alloc_base(struct buff *buf,
    buf->base = safe_malloc(len);
    buf->len = len;
    buf->idx = 0;
+   buf->pool = 0;
 }
 
 
@@ -359,12 +372,40 @@ buff_alloc(void)
    buf->idx  = 0;
    buf->len  = 64;
    buf->grow = 1;
+   buf->pool = 0;
    buf->base = safe_malloc(buf->len);
 
    return buf;
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * buff_alloc_pool --
+ *
+ *      A growable buffer of at least 'len' bytes drawn from bufpool. Its
+ *      base must be released with bufpool_free.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static inline struct buff *
+buff_alloc_pool(size_t len)
+{
+   struct buff *buf;
+
+   buf = safe_malloc(sizeof *buf);
+   buf->idx  = 0;
+   buf->grow = 1;
+   buf->pool = 1;
+   buf->base = bufpool_alloc(len);
+   buf->len  = bufpool_get_size(buf->base);
+
+   return buf;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -378,7 +419,7 @@ buff_dup(const struct buff *buf)
 {
    struct buff *buf2;
 
-   buf2 = buff_alloc();
+   buf2 = buf->pool ? buff_alloc_pool(buff_curlen(buf)) : buff_alloc();
    buff_append(buf2, buf);
 
    return buf2;
@@ -97,17 +97,34 @@ struct peer {
    bool                    got_version;
    bool                    got_verack;
 
-   bool                    recvMsgHdr;
    btc_msg_header          msgHdr;
 
    uint32                  startingHeight;
    uint32                  protversion;
    char                   *clientStr;
+   int                     filterIdx;  /* wallet filter it holds */
+
+   /*
+    * How well the peer did this session: lowest round-trip seen, bytes/sec
+    * measured on the transfers we asked for, and how often it stalled.
+    */
+   mtime_t                 versionTS;
+   mtime_t                 pingTS;
+   uint64                  numBytesRecv;
+   mtime_t                 rtt;
+   double                  rate;
+   uint32                  numStalls;
 
    struct peer_addr       *paddr;
 };
 
 
+struct peer_broadcast {
+   uint256 *hashes;
+   int      num;
+};
+
+
 #define GET_PEER(_li) \
       CIRCLIST_CONTAINER(_li, struct peer, item)
 
@@ -188,6 +205,7 @@ peer_send_msg(struct peer *peer,
    peergroup_send_stats_inc(type);
 
    ASSERT(peer->sendBuf);
+   ASSERT(peer->sendBuf->pool);
 
    buf = buff_base(peer->sendBuf);
    len = buff_curlen(peer->sendBuf);
@@ -238,21 +256,35 @@ peer_send_getblocks(struct peer *peer)
  *
  * peer_send_getheaders --
  *
+ *      Asks for the headers following 'from', or following our best chain if
+ *      'from' is NULL, up to 'stop' if not NULL.
+ *
  *------------------------------------------------------------------------
  */
 
 int
-peer_send_getheaders(struct peer *peer)
+peer_send_getheaders(struct peer   *peer,
+                     const uint256 *from,
+                     const uint256 *stop)
 {
    uint256 *hashes = NULL;
    int num = 0;
    uint256 genesis;
    int res;
 
-   blockstore_get_genesis(btc->blockStore, &genesis);
-   blockstore_get_locator_hashes(btc->blockStore, &hashes, &num);
+   if (from) {
+      hashes = safe_malloc(sizeof *hashes);
+      memcpy(hashes, from, sizeof *from);
+      num = 1;
+   } else {
+      blockstore_get_locator_hashes(btc->blockStore, &hashes, &num);
+   }
+   if (num == 0) {
+      blockstore_get_genesis(btc->blockStore, &genesis);
+      stop = &genesis;
+   }
 
-   res = btcmsg_craft_getheaders(num > 0 ? hashes : NULL, num, &genesis, &peer->sendBuf);
+   res = btcmsg_craft_getheaders(hashes, num, stop, &peer->sendBuf);
    free(hashes);
    if (res) {
       NOT_TESTED();
@@ -271,14 +303,14 @@ peer_send_getheaders(struct peer *peer)
  *------------------------------------------------------------------------
  */
 
-static int
+int
 peer_send_filterload(struct peer *peer)
 {
    btc_msg_filterload fl;
    int res;
 
-   wallet_get_bloom_filter_info(btc->wallet, &fl.filter, &fl.filterSize,
-                                &fl.numHashFuncs, &fl.tweak);
+   wallet_get_bloom_filter_info(btc->wallet, peer->filterIdx, &fl.filter,
+                                &fl.filterSize, &fl.numHashFuncs, &fl.tweak);
 
    fl.flags = BLOOM_UPDATE_P2PUBKEY_ONLY;
 
@@ -290,6 +322,29 @@ peer_send_filterload(struct peer *peer)
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_send_filteradd --
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+peer_send_filteradd(struct peer *peer,
+                    const uint8 *data,
+                    size_t       len)
+{
+   int res;
+
+   res = btcmsg_craft_filteradd(data, len, &peer->sendBuf);
+   if (res) {
+      return res;
+   }
+   return peer_send_msg(peer, BTC_MSG_FILTERADD);
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -363,6 +418,154 @@ peer_send_getaddr(struct peer *peer)
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_add_rtt_sample --
+ *
+ *      We keep the lowest: a sample can only be inflated by whatever the
+ *      peer had queued in front of our message.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peer_add_rtt_sample(struct peer *peer,
+                    mtime_t      rtt)
+{
+   if (peer->rtt == 0 || rtt < peer->rtt) {
+      peer->rtt = MAX(rtt, 1);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_add_rate_sample --
+ *
+ *      'bytes' is what the peer sent us over 'delay' usec while it had
+ *      requests of ours to serve.
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+peer_add_rate_sample(struct peer *peer,
+                     uint64       bytes,
+                     mtime_t      delay)
+{
+   double rate;
+
+   if (delay <= 0 || bytes == 0) {
+      return;
+   }
+   rate = bytes * 1000000.0 / delay;
+   peer->rate = peer->rate == 0 ? rate : (3 * peer->rate + rate) / 4;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_add_stall --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+peer_add_stall(struct peer *peer)
+{
+   peer->numStalls++;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_get_bytes_recv --
+ *
+ *------------------------------------------------------------------------
+ */
+
+uint64
+peer_get_bytes_recv(const struct peer *peer)
+{
+   return peer->numBytesRecv;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_get_perf --
+ *
+ *      Blends what we measured this session with what the addrbook
+ *      remembers from the previous ones.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peer_get_perf(const struct peer *peer,
+              struct peer_perf  *perf)
+{
+   const struct peer_perf *hist = &peer->paddr->perf;
+   uint32 rtt  = peer->rtt / 1000;
+   uint32 rate = MIN(peer->rate, 0xffffffff);
+
+   perf->rtt  = rtt == 0       ? hist->rtt
+              : hist->rtt == 0 ? rtt
+              : (hist->rtt + rtt) / 2;
+   perf->rate = rate == 0       ? hist->rate
+              : hist->rate == 0 ? rate
+              : (hist->rate + rate) / 2;
+   perf->numStalls   = MIN(hist->numStalls / 2 + peer->numStalls, 0xffff);
+   perf->numSessions = MIN(hist->numSessions + 1, 0xffff);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_get_rtt --
+ *
+ *      In usec.
+ *
+ *------------------------------------------------------------------------
+ */
+
+mtime_t
+peer_get_rtt(const struct peer *peer)
+{
+   if (peer->rtt == 0) {
+      return (mtime_t)peer->paddr->perf.rtt * 1000;
+   }
+   return peer->rtt;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_get_cost --
+ *
+ *      See addrbook_perf_cost(): the lower, the better.
+ *
+ *------------------------------------------------------------------------
+ */
+
+uint32
+peer_get_cost(const struct peer *peer)
+{
+   struct peer_perf perf;
+
+   peer_get_perf(peer, &perf);
+
+   return addrbook_perf_cost(&perf);
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -376,6 +579,8 @@ peer_handshake_ok(struct peer *peer)
 {
    int res;
 
+   peer->filterIdx = peergroup_assign_filter(btc->peerGroup, peer);
+
    res = peer_send_filterload(peer);
    if (res) {
       return res;
@@ -389,6 +594,21 @@ peer_handshake_ok(struct peer *peer)
       return res;
    }
 
+   /*
+    * Have the peer announce new blocks with their headers rather than an
+    * inv: we can request the filtered blocks right away, and the headers
+    * of any block we missed come along.
+    */
+   if (peer->protversion >= BTC_PROTO_SENDHEADERS) {
+      res = btcmsg_craft_sendheaders(&peer->sendBuf);
+      if (res == 0) {
+         res = peer_send_msg(peer, BTC_MSG_SENDHEADERS);
+      }
+      if (res) {
+         return res;
+      }
+   }
+
    return peergroup_handle_handshake_ok(peer, peer->startingHeight);
 }
 
@@ -435,6 +655,13 @@ peer_destroy(struct circlist_item *li,
    peer->paddr->connected = 0;
    peer->connected = 0;
 
+   if (peer->got_verack) {
+      struct peer_perf perf;
+
+      peer_get_perf(peer, &perf);
+      addrbook_set_perf(btc->book, peer->paddr, &perf);
+   }
+
    if (peer_remove_addr(err)) {
       addrbook_remove_entry(btc->book, peer->paddr);
       free(peer->paddr);
@@ -442,8 +669,8 @@ peer_destroy(struct circlist_item *li,
    }
 
    peergroup_dequeue_peerlist(&peer->item);
+   peergroup_release_peer(peer);
    netasync_close(peer->sock);
-   buff_free_base(&peer->recvBuf);
    buff_free(peer->sendBuf);
    free(peer->hostname);
    free(peer->clientStr);
@@ -546,11 +773,15 @@ peer_handle_ping(struct peer *peer)
  *
  * peer_send_ping --
  *
+ *      The pong comes back once the peer is done with all the messages we
+ *      sent before: 'nonce' is what it will carry, if non NULL.
+ *
  *------------------------------------------------------------------------
  */
 
-static int
-peer_send_ping(struct peer *peer)
+int
+peer_send_ping(struct peer *peer,
+               uint64      *nonce)
 {
    int res;
 
@@ -559,7 +790,11 @@ peer_send_ping(struct peer *peer)
       return res;
    }
 
+   if (nonce) {
+      *nonce = peer->pingNonce;
+   }
    peer->pingNonce++;
+   peer->pingTS = time_get();
    return peer_send_msg(peer, BTC_MSG_PING);
 }
 
@@ -575,7 +810,18 @@ peer_send_ping(struct peer *peer)
 static int
 peer_handle_notfound(struct peer *peer)
 {
-   return btcmsg_parse_notfound(&peer->recvBuf);
+   btc_msg_inv *inv = NULL;
+   int n = 0;
+   int res;
+
+   res = btcmsg_parse_notfound(&peer->recvBuf, &inv, &n);
+   if (res) {
+      return res;
+   }
+   peergroup_handle_notfound(peer, inv, n);
+   free(inv);
+
+   return 0;
 }
 
 
@@ -684,7 +930,7 @@ peer_handle_tx(struct peer *peer)
    buf = buff_base(&peer->recvBuf);
    len = buff_maxlen(&peer->recvBuf);
 
-   res = wallet_handle_tx(btc->wallet, &peer->last_merkle_block, buf, len);
+   res = peergroup_handle_tx(peer, &peer->last_merkle_block, buf, len);
    ASSERT(res == 0);
 
    return res;
@@ -728,7 +974,7 @@ peer_handle_merkleblock(struct peer *peer)
       NOT_TESTED();
       Log(LGPFX" %s: got %s parent unknown %s\n",
           peer->name, hashStr0, hashStr1);
-      peer_send_getblocks(peer);
+      peer_send_getheaders(peer, NULL, NULL);
    }
    btc_msg_merkleblock_free(blk);
    return res;
@@ -775,17 +1021,20 @@ static int
 peer_handle_headers(struct peer *peer)
 {
    btc_block_header *headers;
+   uint256 *hashes;
    int res;
    int n;
 
-   res = btcmsg_parse_headers(&peer->recvBuf, &headers, &n);
+   res = btcmsg_parse_headers(&peer->recvBuf, &headers, &hashes, &n);
    if (res) {
       NOT_TESTED();
       return res;
    }
 
-   res = peergroup_handle_headers(peer, peer->startingHeight, headers, n);
+   res = peergroup_handle_headers(peer, peer->startingHeight, headers,
+                                  hashes, n);
    free(headers);
+   free(hashes);
    return res;
 }
 
@@ -811,7 +1060,10 @@ peer_handle_pong(struct peer *peer)
    if (nonce != peer->pingNonce - 1) {
       Log(LGPFX" %s: received ping nonce %#llx instead of %#llx.\n",
           peer->name, nonce, peer->pingNonce - 1);
+   } else {
+      peer_add_rtt_sample(peer, time_get() - peer->pingTS);
    }
+   peergroup_handle_pong(peer, nonce);
    return 0;
 }
 
@@ -909,15 +1161,38 @@ peer_handle_inv(struct peer *peer)
    LOG(1, (LGPFX" %s: handling inv msg: tx=%2d blk=%2d numfblk=%d numHash=%d\n",
            peer->name, numtx, numblk, numfblk, numHash));
 
-   if (bitc_state_ready()) {
-      for (i = 0; i < numHash; i++) {
-         uint256_snprintf_reverse(hashStr, sizeof hashStr, hash + i);
-         Log(LGPFX" %s: [%d / %d] requesting %s %s\n",
-             peer->name, i, numHash,
-             type[i] == INV_TYPE_MSG_FILTERED_BLOCK ? "block" : "tx",
-             hashStr);
-         res = peer_send_getdata(peer, type[i], hash + i, 1);
+   /*
+    * One getdata per inv type. The txs go first: a loose tx following a
+    * merkleblock would be taken as part of that block.
+    */
+   if (bitc_state_ready() && numHash > 0) {
+      static const enum btc_inv_type types[] = {
+         INV_TYPE_MSG_TX,
+         INV_TYPE_MSG_FILTERED_BLOCK,
+      };
+      uint256 *req = safe_malloc(numHash * sizeof *req);
+      int t;
+
+      for (t = 0; t < ARRAYSIZE(types) && res == 0; t++) {
+         int num = 0;
+
+         for (i = 0; i < numHash; i++) {
+            if (type[i] != types[t] ||
+                !peergroup_getdata_add(peer, type[i], hash + i)) {
+               continue;
+            }
+            uint256_snprintf_reverse(hashStr, sizeof hashStr, hash + i);
+            Log(LGPFX" %s: [%d / %d] requesting %s %s\n",
+                peer->name, i, numHash,
+                type[i] == INV_TYPE_MSG_FILTERED_BLOCK ? "block" : "tx",
+                hashStr);
+            req[num++] = hash[i];
+         }
+         if (num > 0) {
+            res = peer_send_getdata(peer, types[t], req, num);
+         }
       }
+      free(req);
    }
 
 exit:
@@ -972,6 +1247,7 @@ peer_handle_version(struct peer *peer)
    }
 
    peer->got_version = 1;
+   peer_add_rtt_sample(peer, time_get() - peer->versionTS);
 
    res = btcmsg_craft_verack(&peer->sendBuf);
    if (res) {
@@ -1003,32 +1279,57 @@ peer_handle_verack(struct peer *peer)
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * peer_frame_len --
+ *
+ *      Length of the message starting with header 'hdr'. An invalid header
+ *      is handed over on its own for peer_receive_cb to reject.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static size_t
+peer_frame_len(const void *hdr,
+               void *clientData)
+{
+   btc_msg_header msgHdr;
+
+   memcpy(&msgHdr, hdr, sizeof msgHdr);
+   if (!btcmsg_header_valid(&msgHdr)) {
+      return sizeof msgHdr;
+   }
+   return sizeof msgHdr + msgHdr.payloadLength;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
  * peer_handle_msgheader --
  *
+ *      The payload is parsed in place, out of the socket's receive buffer.
+ *
  *------------------------------------------------------------------------
  */
 
 static int
-peer_handle_msgheader(struct peer *peer)
+peer_handle_msgheader(struct peer *peer,
+                      uint8 *frame,
+                      size_t frameLen)
 {
+   memcpy(&peer->msgHdr, frame, sizeof peer->msgHdr);
+
    if (!btcmsg_header_valid(&peer->msgHdr)) {
       Warning(LGPFX" %s: invalid msg header -- %s\n",
               peer->name, peer->clientStr);
       return 1;
    }
+   ASSERT(frameLen == sizeof peer->msgHdr + peer->msgHdr.payloadLength);
 
-   buff_alloc_base(&peer->recvBuf, peer->msgHdr.payloadLength);
-   peer->recvMsgHdr = 0;
-   if (buff_maxlen(&peer->recvBuf) > 0) {
-      netasync_receive(peer->sock,
-                       buff_base(&peer->recvBuf),
-                       buff_maxlen(&peer->recvBuf),
-                       0 /* full */,
-                       peer_receive_cb, peer);
-   }
+   buff_init(&peer->recvBuf, frame + sizeof peer->msgHdr,
+             peer->msgHdr.payloadLength);
    return 0;
 }
 
@@ -1071,20 +1372,16 @@ peer_receive_cb(struct netasync_socket *sock,
    }
    ASSERT(peer->magic == PEER_MAGIC);
    peer->last_ts = time_get();
+   peer->numBytesRecv += bufLen;
 
    if (bitc_exiting()) {
       return;
    }
 
-   msg = btcmsg_str_to_type(peer->msgHdr.message);
-   if (peer->recvMsgHdr) {
-      if (peer_handle_msgheader(peer)) {
-         goto exit;
-      }
-      if (buff_maxlen(&peer->recvBuf) > 0) {
-         return;
-      }
+   if (peer_handle_msgheader(peer, buf, bufLen)) {
+      goto exit;
    }
+   msg = btcmsg_str_to_type(peer->msgHdr.message);
 
    if (!btcmsg_payload_valid(&peer->recvBuf, peer->msgHdr.checksum)) {
       Warning(LGPFX" %s: invalid checksum for '%s'.\n",
@@ -1133,6 +1430,7 @@ peer_receive_cb(struct netasync_socket *sock,
    case BTC_MSG_ALERT:       res = peer_handle_alert(peer);      break;
    case BTC_MSG_NOTFOUND:    res = peer_handle_notfound(peer);   break;
    case BTC_MSG_HEADERS:     res = peer_handle_headers(peer);    break;
+   case BTC_MSG_SENDHEADERS: res = 0; /* we don't announce blocks */ break;
    default:
       Warning(LGPFX" %s: got unhandled msg '%s' from %s.\n",
               peer->name, btcmsg_type_to_str(msg), peer->clientStr);
@@ -1151,13 +1449,11 @@ next:
    }
 
    peer_update_timestamp(peer);
-   buff_free_base(&peer->recvBuf);
-   peer->recvMsgHdr = 1;
-   netasync_receive(peer->sock, &peer->msgHdr, sizeof peer->msgHdr,
-                    0 /* full */, peer_receive_cb, peer);
+   buff_init(&peer->recvBuf, NULL, 0);
 
    return;
 exit:
+   buff_init(&peer->recvBuf, NULL, 0);
    peer_destroy(&peer->item, EINVAL);
 }
 
@@ -1188,7 +1484,6 @@ peer_connect_cb(struct netasync_socket *sock,
    }
 
    peer->connected = 1;
-   peer->recvMsgHdr = 1;
 
    Log(LGPFX" %s: connected to %s. sending version msg.\n",
        peer->name, netasync_hostname(sock));
@@ -1196,13 +1491,14 @@ peer_connect_cb(struct netasync_socket *sock,
    /*
     * Setup receiving.
     */
-   netasync_receive(peer->sock, &peer->msgHdr, sizeof peer->msgHdr,
-                    0 /* full */, peer_receive_cb, peer);
+   netasync_receive_frames(peer->sock, sizeof peer->msgHdr, peer_frame_len,
+                           peer_receive_cb, peer);
 
    /*
     * Send "version" message.
     */
    btcmsg_craft_version(&peer->sendBuf);
+   peer->versionTS = time_get();
    peer_send_msg(peer, BTC_MSG_VERSION);
 }
 
@@ -1289,6 +1585,62 @@ peer_getinfo(struct circlist_item *item,
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * peer_get_ready_li --
+ *
+ *      Returns the peer if we're done with the handshake, NULL otherwise.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+struct peer *
+peer_get_ready_li(struct circlist_item *item)
+{
+   struct peer *peer = GET_PEER(item);
+
+   ASSERT(peer->magic == PEER_MAGIC);
+
+   if (peer->got_verack == 0 || peer->connected == 0) {
+      return NULL;
+   }
+   return peer;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * peer_get_height --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+int
+peer_get_height(const struct peer *peer)
+{
+   return peer->startingHeight;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * peer_get_filter --
+ *
+ *      Which of the wallet's filters we loaded on this peer.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+int
+peer_get_filter(const struct peer *peer)
+{
+   return peer->filterIdx;
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -1311,7 +1663,7 @@ peer_check_liveness(struct circlist_item *item,
       return 0;
    }
 
-   return peer_send_ping(peer);
+   return peer_send_ping(peer, NULL);
 }
 
 
@@ -1348,20 +1700,26 @@ peer_send_inv(struct circlist_item *item,
  *
  * peer_tx_broadcast --
  *
+ *      Announces 'n' txs in a single inv.
+ *
  *------------------------------------------------------------------------
  */
 
 static int
-peer_tx_broadcast(struct peer *peer,
-                  const uint256 *hash)
+peer_tx_broadcast(struct peer   *peer,
+                  const uint256 *hash,
+                  int            n)
 {
    struct buff *bufInv;
    char hashStr[80];
    int res;
+   int i;
 
-   uint256_snprintf_reverse(hashStr, sizeof hashStr, hash);
-   Log(LGPFX" %s: broadcasting tx %s\n", peer->name, hashStr);
-   res = btcmsg_craft_inv(&bufInv, INV_TYPE_MSG_TX, hash, 1);
+   for (i = 0; i < n; i++) {
+      uint256_snprintf_reverse(hashStr, sizeof hashStr, hash + i);
+      Log(LGPFX" %s: broadcasting tx %s\n", peer->name, hashStr);
+   }
+   res = btcmsg_craft_inv(&bufInv, INV_TYPE_MSG_TX, hash, n);
    ASSERT(res == 0);
 
    res = peer_send_inv(&peer->item, bufInv);
@@ -1385,12 +1743,12 @@ peer_broadcast_one_tx_cb(const void *key,
                          void *cbData,
                          void *keyData)
 {
-   struct peer *peer = cbData;
+   struct peer_broadcast *bcast = cbData;
    const uint256 *hash = key;
 
    ASSERT(keyLen == sizeof *hash);
 
-   peer_tx_broadcast(peer, hash);
+   bcast->hashes[bcast->num++] = *hash;
 }
 
 
@@ -1405,7 +1763,28 @@ peer_broadcast_one_tx_cb(const void *key,
 static void
 peer_broadcast_all_tx(struct peer *peer)
 {
-   hashtable_for_each(btc->peerGroup->hash_broadcast, peer_broadcast_one_tx_cb, peer);
+   struct hashtable *hash_broadcast = btc->peerGroup->hash_broadcast;
+   struct peer_broadcast bcast;
+   int i;
+
+   if (hashtable_getnumentries(hash_broadcast) == 0) {
+      return;
+   }
+
+   bcast.hashes = safe_malloc(hashtable_getnumentries(hash_broadcast) *
+                              sizeof *bcast.hashes);
+   bcast.num = 0;
+
+   hashtable_for_each(hash_broadcast, peer_broadcast_one_tx_cb, &bcast);
+
+   for (i = 0; i < bcast.num; i += BTC_MSG_INV_MAX_ENTRIES) {
+      int n = MIN(bcast.num - i, BTC_MSG_INV_MAX_ENTRIES);
+
+      if (peer_tx_broadcast(peer, bcast.hashes + i, n) != 0) {
+         break;
+      }
+   }
+   free(bcast.hashes);
 }
 
 
@@ -1429,7 +1808,10 @@ peer_on_ready(struct peer *peer)
 
    peer_broadcast_all_tx(peer);
 
-   return peer_send_getblocks(peer);
+   /*
+    * The blocks we're missing, if any, get requested as their headers come.
+    */
+   return peer_send_getheaders(peer, NULL, NULL);
 }
 
 
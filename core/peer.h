@@ -15,13 +15,25 @@ void peer_add(struct peer_addr *paddr, int seq);
 int  peer_check_liveness(struct circlist_item *li, mtime_t now);
 void peer_destroy(struct circlist_item *li, int err);
 int  peer_getinfo(struct circlist_item *item, struct bitcui_peer *pinfo);
+struct peer *peer_get_ready_li(struct circlist_item *item);
+int  peer_get_height(const struct peer *peer);
+int  peer_get_filter(const struct peer *peer);
+mtime_t peer_get_rtt(const struct peer *peer);
+uint32  peer_get_cost(const struct peer *peer);
+uint64  peer_get_bytes_recv(const struct peer *peer);
+void peer_add_rate_sample(struct peer *peer, uint64 bytes, mtime_t delay);
+void peer_add_stall(struct peer *peer);
 int  peer_on_ready(struct peer *peer);
 int  peer_on_ready_li(struct circlist_item *li);
 
 int peer_send_inv(struct circlist_item *item, struct buff *buf);
-int peer_send_getheaders(struct peer *peer);
+int peer_send_getheaders(struct peer *peer, const uint256 *from,
+                         const uint256 *stop);
 int peer_send_getblocks(struct peer *peer);
 int peer_send_mempool(struct peer *peer);
+int peer_send_filterload(struct peer *peer);
+int peer_send_filteradd(struct peer *peer, const uint8 *data, size_t len);
+int peer_send_ping(struct peer *peer, uint64 *nonce);
 int peer_send_getdata(struct peer *peer, enum btc_inv_type type,
                       const uint256 *hash, int numHash);
 
@@ -15,9 +15,71 @@
 #include "bitc.h"
 #include "hashtable.h"
 #include "buff.h"
+#include "hash.h"
+#include "serialize.h"
 
 #define LGPFX   "PEERG:"
 
+/*
+ * Header sync: the headers between our tip and the height advertised by the
+ * peers are cut in segments at the checkpoints we know about. Each segment is
+ * fetched by a single peer, 2000 headers at a time, so that no header gets
+ * downloaded twice, and several segments are fetched in parallel. The headers
+ * of a segment starting at a checkpoint are orphans until the segments before
+ * it come in: the blockstore then stitches them to the best chain. We don't
+ * run too far ahead of the best chain as the pool of orphans is bounded.
+ */
+#define PEERGROUP_HDRSYNC_MAX_AHEAD      25000
+#define PEERGROUP_HDRSYNC_MAX_FAILURES   3
+#define PEERGROUP_HDRSYNC_TIMEOUT        (20 * 1000 * 1000) // 20 sec
+
+/*
+ * Filtered block download: the blocks between the last one processed by the
+ * txdb and our tip are cut in chunks, each sent to a peer as a getdata
+ * followed by a ping. The merkleblocks and the txs matching our filter are
+ * kept with their chunk until the pong comes back: by then the peer has sent
+ * all it's going to send for it. Chunks are applied to the txdb strictly in
+ * height order, as a tx spending one of our coins can only be recognized once
+ * the tx that funded it has been processed. A chunk whose peer goes away or is
+ * too slow is handed to another peer, and so are the blocks a peer didn't send.
+ *
+ * Each peer has several chunks in flight so that it never waits on us. The
+ * size of its chunks follows the rate at which it delivers blocks, and the
+ * number of blocks it has in flight covers its round-trip time on top of
+ * that. We don't get more than PEERGROUP_BLKSYNC_MAX_AHEAD blocks ahead of the
+ * txdb.
+ *
+ * A peer stalls when it doesn't send any of the blocks it owes us for
+ * PEERGROUP_BLKSYNC_TIMEOUT, or when it trickles them in at less than
+ * PEERGROUP_BLKSYNC_MIN_RATE or a PEERGROUP_BLKSYNC_MIN_SHARE of what the
+ * fastest peer does: its chunks then go to other peers, and it doesn't get
+ * new ones for a while, longer each time it stalls.
+ *
+ * When the wallet's keys are split over several bloom filters, each range of
+ * blocks is cut in one chunk per filter, fetched from peers holding that
+ * filter. A range is applied once all of its chunks are complete.
+ */
+#define PEERGROUP_BLKSYNC_MAX_AHEAD      20000
+#define PEERGROUP_BLKSYNC_BATCH_INIT     200
+#define PEERGROUP_BLKSYNC_BATCH_MIN      50
+#define PEERGROUP_BLKSYNC_BATCH_MAX      2000
+#define PEERGROUP_BLKSYNC_BATCH_TIME     (2 * 1000 * 1000)  // 2 sec
+#define PEERGROUP_BLKSYNC_TIMEOUT        (10 * 1000 * 1000) // 10 sec
+#define PEERGROUP_BLKSYNC_MIN_RATE       5                  // blocks/sec
+#define PEERGROUP_BLKSYNC_MIN_SHARE      10                 // 1/10th
+#define PEERGROUP_BLKSYNC_RATE_PERIOD    (10 * 1000 * 1000) // 10 sec
+#define PEERGROUP_BLKSYNC_PENALTY        (30 * 1000 * 1000) // 30 sec
+#define PEERGROUP_BLKSYNC_MAX_COST       4  // relative to the best peer
+
+/*
+ * Blocks and txs announced by an inv: each one is asked of a single peer at
+ * a time, however many announced it. The other ones are kept in line in case
+ * that peer doesn't deliver in time or replies with a notfound. When the
+ * wallet's keys are split over several filters, a filtered block is asked of
+ * one peer per filter.
+ */
+#define PEERGROUP_GETDATA_TIMEOUT        (30 * 1000 * 1000) // 30 sec
+
 
 struct tx_broadcast {
    struct buff *buf;     /* tx serialized */
@@ -25,6 +87,58 @@ struct tx_broadcast {
 };
 
 
+struct hdrsync_seg {
+   uint256      cursor;       /* last header received */
+   uint256      stop;         /* checkpoint ending the segment */
+   int          height;       /* height of 'cursor' */
+   int          stopHeight;   /* -1 for the last segment: no 'stop' */
+   struct peer *peer;         /* peer fetching the segment, if any */
+   struct peer *slowPeer;     /* last peer that timed out on it */
+   mtime_t      ts;           /* of the getheaders */
+   uint64       bytes0;       /* bytes received from 'peer' at 'ts' */
+   int          numFailures;
+   bool         fromTip;      /* starts at our best chain */
+   bool         done;
+};
+
+
+struct getdata_key {
+   uint256            hash;
+   int                filter;   /* of the peers asked, for filtered blocks */
+};
+
+
+struct getdata_req {
+   struct getdata_key key;
+   enum btc_inv_type  type;
+   struct peer       *peer;     /* peer we asked */
+   mtime_t            ts;       /* when we asked */
+   mtime_t            firstTS;  /* when it was first announced */
+   struct peer      **alts;     /* other peers that announced it */
+   int                numAlts;
+};
+
+
+struct getdata_scan {
+   struct getdata_req **reqs;
+   int                  num;
+};
+
+
+struct blksync_peer {
+   struct peer *peer;
+   double       rate;      /* blocks per sec */
+   uint64       bytes0;    /* bytes received from 'peer' at 'pongTS' */
+   mtime_t      lastTS;    /* last sign of progress */
+   mtime_t      pongTS;    /* last chunk completed */
+   int          numRecv;   /* blocks received */
+   mtime_t      floorTS;   /* start of the current throughput check */
+   int          floorRecv; /* 'numRecv' at 'floorTS' */
+   int          numStalls;
+   mtime_t      penaltyTS; /* no new chunks until then */
+};
+
+
 static const char *peer_seeds_main[] = {
    "bazco.in",
    "aux.bazco.in",
@@ -39,6 +153,11 @@ static struct {
 } cmdStats[BTC_MSG_MAX];
 
 
+static void peergroup_hdrsync_layout(struct peergroup *pg);
+static int peergroup_hdrsync_next(struct peergroup *pg, struct peer *peer);
+static void peergroup_blksync_next(struct peergroup *pg);
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -302,11 +421,27 @@ peergroup_download_progress(void)
 static void
 peergroup_on_ready(void)
 {
+   struct peergroup *pg = btc->peerGroup;
+   int numFilters = wallet_get_num_filters(btc->wallet);
    struct circlist_item *li;
 
    Log(LGPFX" peergroup ready.\n");
    bitcui_set_status("online.");
 
+   /*
+    * With several wallet filters, a new block is only done once we got it
+    * with each of them.
+    */
+   if (numFilters > 1 && pg->filterHeight == NULL) {
+      int height = blockstore_get_height(btc->blockStore);
+      int i;
+
+      pg->filterHeight = safe_malloc(numFilters * sizeof *pg->filterHeight);
+      for (i = 0; i < numFilters; i++) {
+         pg->filterHeight[i] = height;
+      }
+   }
+
    CIRCLIST_SCAN(li, btc->peerGroup->peer_list) {
       peer_on_ready_li(li);
    }
@@ -370,8 +505,7 @@ peergroup_add_block_finalize(struct blockstore *bs,
    if (headerOnly == 0) {
       peergroup_set_lastblk(btc->peerGroup, &best_hash);
    }
-   if (bitc_state_ready() || bitc_state_updating_txdb() ||
-       (blockstore_get_height(bs) % 2000) == 0) {
+   if (bitc_state_ready() || bitc_state_updating_txdb() || headerOnly) {
       bitcui_set_last_block_info(&best_hash, blockstore_get_height(bs),
                                  blockstore_get_timestamp(btc->blockStore));
    }
@@ -387,8 +521,7 @@ peergroup_add_block_finalize(struct blockstore *bs,
  */
 
 static void
-peergroup_process_filtered_block(struct peer *peer,
-                                 const btc_msg_merkleblock *blk)
+peergroup_process_filtered_block(const btc_msg_merkleblock *blk)
 {
    struct blockstore *bs = btc->blockStore;
    struct peergroup *pg = btc->peerGroup;
@@ -402,13 +535,14 @@ peergroup_process_filtered_block(struct peer *peer,
    peergroup_get_lastblk(pg, &lastTxdb);
    ASSERT(!uint256_iszero(&lastTxdb));
 
-   if (btc->state == BITC_STATE_UPDATE_TXDB &&
-       blockstore_is_next(bs, &lastTxdb, &blk->blkHash)) {
-      pg->numFetched++;
+   if (blockstore_is_next(bs, &lastTxdb, &blk->blkHash)) {
       peergroup_set_lastblk(pg, &blk->blkHash);
-      if ((pg->numFetched % 5000) == 0) {
-         Warning(LGPFX" fetched %6d blocks out of %d\n",
-                 pg->numFetched, pg->numToFetch);
+      if (btc->state == BITC_STATE_UPDATE_TXDB) {
+         pg->numFetched++;
+         if ((pg->numFetched % 5000) == 0) {
+            Warning(LGPFX" fetched %6d blocks out of %d\n",
+                    pg->numFetched, pg->numToFetch);
+         }
       }
    }
 
@@ -439,6 +573,7 @@ peergroup_download_headers(struct peer *peer,
                            int peerStartingHeight)
 {
    struct blockstore *bs = btc->blockStore;
+   struct peergroup *pg = btc->peerGroup;
 
    ASSERT(btc->state == BITC_STATE_STARTING ||
           btc->state == BITC_STATE_UPDATE_HEADERS);
@@ -470,7 +605,10 @@ peergroup_download_headers(struct peer *peer,
          free(lagStr);
       }
    }
-   return peer_send_getheaders(peer);
+
+   peergroup_hdrsync_layout(pg);
+
+   return peergroup_hdrsync_next(pg, peer);
 }
 
 
@@ -484,34 +622,30 @@ peergroup_download_headers(struct peer *peer,
  *------------------------------------------------------------------------
  */
 
-int
-peergroup_download_filtered_blocks(struct peer *peer)
+static int
+peergroup_download_filtered_blocks(void)
 {
    struct blockstore *bs = btc->blockStore;
+   struct peergroup *pg = btc->peerGroup;
    uint256 walletHash;
    uint256 lastHashStore;
    uint256 startHash;
-   uint256 *nextHash;
+   char hashStr[80];
    uint64 birth;
-   bool first;
-   int res = 0;
-   int n;
-
-   if (btc->state != BITC_STATE_UPDATE_HEADERS &&
-       btc->state != BITC_STATE_UPDATE_TXDB) {
-       return 0;
-    }
-   ASSERT(btc->state == BITC_STATE_UPDATE_HEADERS ||
-          btc->state == BITC_STATE_UPDATE_TXDB);
 
-   first = btc->state == BITC_STATE_UPDATE_HEADERS;
+   if (btc->state == BITC_STATE_UPDATE_TXDB) {
+      peergroup_blksync_next(pg);
+      return 0;
+   }
+   if (btc->state != BITC_STATE_UPDATE_HEADERS) {
+      return 0;
+   }
 
-   if (first && btc->peerGroup->numHdrToFetch > 0) {
-      mtime_t lat = time_get() - btc->peerGroup->firstConnectTS;
+   if (pg->numHdrToFetch > 0) {
+      mtime_t lat = time_get() - pg->firstConnectTS;
       char *s = print_latency(lat);
       Warning(LGPFX" %d header%s downloaded in %s\n",
-              btc->peerGroup->numHdrToFetch,
-              btc->peerGroup->numHdrToFetch > 1 ? "s" : "", s);
+              pg->numHdrToFetch, pg->numHdrToFetch > 1 ? "s" : "", s);
       free(s);
    }
    Log(LGPFX" %s -- BITC_STATE_UPDATE_TXDB.\n", __FUNCTION__);
@@ -524,83 +658,1821 @@ peergroup_download_filtered_blocks(struct peer *peer)
     */
    birth = wallet_get_birth(btc->wallet);
    blockstore_get_hash_from_birth(bs, birth, &walletHash);
-   peergroup_get_lastblk(btc->peerGroup, &lastHashStore);
+   peergroup_get_lastblk(pg, &lastHashStore);
 
    /*
     * Get the youngest of the two.
     */
    blockstore_get_highest(bs, &walletHash, &lastHashStore, &startHash);
+   peergroup_set_lastblk(pg, &startHash);
+   memcpy(&pg->blkCursor, &startHash, sizeof startHash);
 
-   if (first) {
-      char hashStr[80];
-      peergroup_set_lastblk(btc->peerGroup, &startHash);
+   pg->numToFetch = blockstore_get_height(bs)
+                  - blockstore_get_block_height(bs, &startHash);
+   uint256_snprintf_reverse(hashStr, sizeof hashStr, &startHash);
+   Log(LGPFX" downloading starting at %s\n", hashStr);
+   Log(LGPFX" downloading %d filtered block%s..\n",
+       pg->numToFetch, pg->numToFetch > 1 ? "s" : "");
+
+   peergroup_blksync_next(pg);
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_append --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct hdrsync_seg *
+peergroup_hdrsync_append(struct peergroup *pg,
+                         const uint256    *cursor,
+                         int               height,
+                         bool              fromTip)
+{
+   struct hdrsync_seg *seg;
 
-      btc->peerGroup->numToFetch = blockstore_get_height(bs)
-         - blockstore_get_block_height(bs, &startHash);
-      uint256_snprintf_reverse(hashStr, sizeof hashStr, &startHash);
-      Log(LGPFX" downloading starting at %s\n", hashStr);
+   pg->hdrSegs = safe_realloc(pg->hdrSegs,
+                              (pg->numHdrSegs + 1) * sizeof *pg->hdrSegs);
+   seg = pg->hdrSegs + pg->numHdrSegs;
+   pg->numHdrSegs++;
+
+   memset(seg, 0, sizeof *seg);
+   if (cursor) {
+      memcpy(&seg->cursor, cursor, sizeof *cursor);
    }
+   seg->height     = height;
+   seg->stopHeight = -1;
+   seg->fromTip    = fromTip;
 
-   Log(LGPFX" downloading %d filtered block%s..\n",
-       btc->peerGroup->numToFetch,
-       btc->peerGroup->numToFetch > 1 ? "s" : "");
-   blockstore_get_next_hashes(bs, &startHash, &nextHash, &n);
+   return seg;
+}
 
-   peergroup_download_progress();
 
-   if (n >= 1) {
-      btc->peerGroup->lastFilteredBlockReq = nextHash[n - 1];
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_layout --
+ *
+ *      Splits the headers we're missing in segments, or appends a segment
+ *      if the target got higher than what's been laid out so far.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_hdrsync_layout(struct peergroup *pg)
+{
+   struct blockstore *bs = btc->blockStore;
+   struct hdrsync_seg *seg;
+   uint256 hash;
+   int height;
+   int cpHeight;
+
+   if (pg->numHdrSegs > 0) {
+      seg = pg->hdrSegs + pg->numHdrSegs - 1;
+      if (seg->done && seg->height < pg->heightTarget) {
+         peergroup_hdrsync_append(pg, &seg->cursor, seg->height, seg->fromTip);
+      }
+      return;
+   }
+
+   height = blockstore_get_height(bs);
+   if (height >= pg->heightTarget) {
+      return;
+   }
+
+   seg = peergroup_hdrsync_append(pg, NULL, height, TRUE);
+
+   while (1) {
+      cpHeight = blockstore_get_next_checkpoint(bs, height, &hash);
+      if (cpHeight < 0 || cpHeight >= pg->heightTarget) {
+         break;
+      }
+      memcpy(&seg->stop, &hash, sizeof hash);
+      seg->stopHeight = cpHeight;
+
+      seg = peergroup_hdrsync_append(pg, &hash, cpHeight, FALSE);
+      height = cpHeight;
+   }
+   Log(LGPFX" headers #%d..#%d: %d segment%s.\n",
+       blockstore_get_height(bs), pg->heightTarget, pg->numHdrSegs,
+       pg->numHdrSegs > 1 ? "s" : "");
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_lookup --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct hdrsync_seg *
+peergroup_hdrsync_lookup(struct peergroup  *pg,
+                         const struct peer *peer)
+{
+   int i;
+
+   for (i = 0; i < pg->numHdrSegs; i++) {
+      if (pg->hdrSegs[i].peer == peer) {
+         return pg->hdrSegs + i;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_is_slow --
+ *
+ *      Whether 'peer' timed out on one of the segments still to fetch.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+peergroup_hdrsync_is_slow(const struct peergroup *pg,
+                          const struct peer      *peer)
+{
+   int i;
+
+   for (i = 0; i < pg->numHdrSegs; i++) {
+      if (pg->hdrSegs[i].done == 0 && pg->hdrSegs[i].slowPeer == peer) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_pick_peer --
+ *
+ *      Returns the best scoring of the idle peers that have at least
+ *      'height' blocks, if any. Ties go to the highest. The peers that timed
+ *      out on us only come last.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct peer *
+peergroup_hdrsync_pick_peer(struct peergroup *pg,
+                            int               height)
+{
+   struct circlist_item *li;
+   struct peer *best = NULL;
+   uint32 bestCost = 0;
+   bool bestSlow = 0;
+
+   CIRCLIST_SCAN(li, pg->peer_list) {
+      struct peer *peer = peer_get_ready_li(li);
+      uint32 cost;
+      bool slow;
+
+      if (peer == NULL ||
+          peer_get_height(peer) < height ||
+          peergroup_hdrsync_lookup(pg, peer) != NULL) {
+         continue;
+      }
+      cost = peer_get_cost(peer);
+      slow = peergroup_hdrsync_is_slow(pg, peer);
+      if (best == NULL || slow < bestSlow ||
+          (slow == bestSlow &&
+           (cost < bestCost ||
+            (cost == bestCost && peer_get_height(peer) > peer_get_height(best))))) {
+         best = peer;
+         bestCost = cost;
+         bestSlow = slow;
+      }
+   }
+   return best;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_dispatch --
+ *
+ *      Hands out the segments nobody is working on to the idle peers.
+ *      Returns the number of segments in flight.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_hdrsync_dispatch(struct peergroup *pg)
+{
+   int height = blockstore_get_height(btc->blockStore);
+   int numBusy = 0;
+   int i;
+
+   for (i = 0; i < pg->numHdrSegs; i++) {
+      struct hdrsync_seg *seg = pg->hdrSegs + i;
+      struct peer *peer;
+      int res;
+
+      if (seg->done) {
+         continue;
+      }
+      if (seg->peer) {
+         numBusy++;
+         continue;
+      }
+      if (!seg->fromTip && seg->height - height > PEERGROUP_HDRSYNC_MAX_AHEAD) {
+         break;
+      }
+
+      peer = peergroup_hdrsync_pick_peer(pg, seg->stopHeight > 0 ?
+                                             seg->stopHeight : seg->height + 1);
+      if (peer == NULL) {
+         continue;
+      }
+
+      Log(LGPFX" %s: fetching headers from #%d%s.\n", peer_name(peer),
+          seg->height, seg->fromTip ? " (tip)" : "");
+
+      res = peer_send_getheaders(peer, seg->fromTip ? NULL : &seg->cursor,
+                                 seg->stopHeight > 0 ? &seg->stop : NULL);
+      if (res != 0) {
+         Warning(LGPFX" %s: failed to send getheaders: %s (%d)\n",
+                 peer_name(peer), strerror(res), res);
+         continue;
+      }
+      seg->peer   = peer;
+      seg->ts     = time_get();
+      seg->bytes0 = peer_get_bytes_recv(peer);
+      numBusy++;
+   }
+   return numBusy;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_advance --
+ *
+ *      'seg' just got a batch of headers from its peer.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_hdrsync_advance(struct peergroup   *pg,
+                          struct hdrsync_seg *seg,
+                          const uint256      *hashes,
+                          int                 n)
+{
+   if (n > 0) {
+      peer_add_rate_sample(seg->peer, peer_get_bytes_recv(seg->peer) - seg->bytes0,
+                           time_get() - seg->ts);
+   }
+   seg->peer = NULL;
+
+   if (n > 0) {
+      memcpy(&seg->cursor, hashes + n - 1, sizeof *hashes);
+      seg->height += n;
+      seg->numFailures = 0;
+   } else {
+      seg->numFailures++;
+   }
+
+   if (seg->stopHeight > 0) {
+      if (n > 0 && uint256_issame(&seg->cursor, &seg->stop)) {
+         seg->done = 1;
+      } else if (seg->numFailures >= PEERGROUP_HDRSYNC_MAX_FAILURES) {
+         Warning(LGPFX" giving up on headers #%d..#%d.\n",
+                 seg->height, seg->stopHeight);
+         seg->done = 1;
+      }
+   } else if (n < BTC_MSG_GETHEADERS_MAX_ENTRIES ||
+              seg->height >= pg->heightTarget) {
+      /*
+       * Either we caught up with what the peers advertised, or this peer
+       * has nothing more: another one may, if it advertised a higher
+       * height. Careful, 'seg' may move.
+       */
+      seg->done = 1;
+      if (n > 0 && seg->height < pg->heightTarget) {
+         peergroup_hdrsync_append(pg, &seg->cursor, seg->height, seg->fromTip);
+      }
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_next --
+ *
+ *      Keeps the idle peers busy. Once nothing is in flight, either all the
+ *      segments are done or none of the peers can help with the remaining
+ *      ones: it's time to move on to the filtered blocks.
+ *
+ *      BITC_STATE_UPDATE_HEADERS -> BITC_STATE_UPDATE_TXDB
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_hdrsync_next(struct peergroup *pg,
+                       struct peer      *peer)
+{
+   int i;
+
+   if (peergroup_hdrsync_dispatch(pg) > 0) {
+      return 0;
+   }
+
+   if (peer == NULL && peergroup_hdrsync_pick_peer(pg, 0) == NULL) {
+      return 0;
+   }
+
+   for (i = 0; i < pg->numHdrSegs; i++) {
+      if (pg->hdrSegs[i].done == 0) {
+         Warning(LGPFX" no peer to fetch headers from #%d.\n",
+                 pg->hdrSegs[i].height);
+         break;
+      }
+   }
+   free(pg->hdrSegs);
+   pg->hdrSegs = NULL;
+   pg->numHdrSegs = 0;
+
+   return peergroup_download_filtered_blocks();
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_hdrsync_check_timeouts --
+ *
+ *      Takes back the segments of the peers that haven't answered our
+ *      getheaders in time.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_hdrsync_check_timeouts(struct peergroup *pg)
+{
+   mtime_t now = time_get();
+   bool timeout = 0;
+   int i;
+
+   for (i = 0; i < pg->numHdrSegs; i++) {
+      struct hdrsync_seg *seg = pg->hdrSegs + i;
+
+      if (seg->peer == NULL || now < seg->ts + PEERGROUP_HDRSYNC_TIMEOUT) {
+         continue;
+      }
+      pg->numHdrStalls++;
+      Warning(LGPFX" %s: stalled on headers from #%d -- %u stalls so far.\n",
+              peer_name(seg->peer), seg->height, pg->numHdrStalls);
+      peer_add_stall(seg->peer);
+      seg->slowPeer = seg->peer;
+      seg->peer = NULL;
+      timeout = 1;
+   }
+   if (timeout) {
+      peergroup_hdrsync_next(pg, NULL);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_free_chunk --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_blksync_free_chunk(struct blksync_chunk *chunk)
+{
+   int i;
+
+   for (i = 0; i < chunk->num; i++) {
+      struct blksync_blk *b = chunk->blks + i;
+      int j;
+
+      for (j = 0; j < b->numTxs; j++) {
+         buff_free(b->txs[j]);
+      }
+      free(b->txs);
+      if (b->blk) {
+         btc_msg_merkleblock_free(b->blk);
+      }
+   }
+   free(chunk->blks);
+   free(chunk->hashes);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_free --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_blksync_free(struct peergroup *pg)
+{
+   int i;
+
+   for (i = 0; i < pg->numBlkChunks; i++) {
+      peergroup_blksync_free_chunk(pg->blkChunks + i);
+   }
+   free(pg->blkChunks);
+   free(pg->blkPeers);
+   pg->blkChunks = NULL;
+   pg->numBlkChunks = 0;
+   pg->blkPeers = NULL;
+   pg->numBlkPeers = 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_get_peer --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct blksync_peer *
+peergroup_blksync_get_peer(struct peergroup *pg,
+                           struct peer      *peer,
+                           bool              create)
+{
+   struct blksync_peer *bp;
+   int i;
+
+   for (i = 0; i < pg->numBlkPeers; i++) {
+      if (pg->blkPeers[i].peer == peer) {
+         return pg->blkPeers + i;
+      }
+   }
+   if (create == 0) {
+      return NULL;
+   }
+
+   pg->blkPeers = safe_realloc(pg->blkPeers,
+                               (pg->numBlkPeers + 1) * sizeof *pg->blkPeers);
+   bp = pg->blkPeers + pg->numBlkPeers;
+   pg->numBlkPeers++;
+
+   memset(bp, 0, sizeof *bp);
+   bp->peer = peer;
+
+   return bp;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_batch --
+ *
+ *      How many blocks to ask for in a getdata: about
+ *      PEERGROUP_BLKSYNC_BATCH_TIME worth of this peer's delivery rate.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_blksync_batch(const struct blksync_peer *bp)
+{
+   int batch;
+
+   if (bp->rate == 0) {
+      return PEERGROUP_BLKSYNC_BATCH_INIT;
+   }
+   batch = bp->rate * PEERGROUP_BLKSYNC_BATCH_TIME / 1000000;
+   batch = MAX(batch, PEERGROUP_BLKSYNC_BATCH_MIN);
+   batch = MIN(batch, PEERGROUP_BLKSYNC_BATCH_MAX);
+
+   return batch;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_window --
+ *
+ *      How many blocks this peer may have in flight: what it delivers over a
+ *      round-trip, plus the batch it's working on and the next one.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_blksync_window(const struct blksync_peer *bp)
+{
+   return 2 * peergroup_blksync_batch(bp) +
+          bp->rate * peer_get_rtt(bp->peer) / 1000000;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_in_flight --
+ *
+ *      Returns the number of blocks 'peer' still has to send us.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_blksync_in_flight(const struct peergroup *pg,
+                            const struct peer      *peer)
+{
+   int n = 0;
+   int i;
+
+   for (i = 0; i < pg->numBlkChunks; i++) {
+      const struct blksync_chunk *chunk = pg->blkChunks + i;
+
+      if (chunk->peer == peer) {
+         n += chunk->num - chunk->numRecv;
+      }
+   }
+   return n;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_lookup --
+ *
+ *      Returns the chunk that the ping with 'nonce' followed.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct blksync_chunk *
+peergroup_blksync_lookup(struct peergroup  *pg,
+                         const struct peer *peer,
+                         uint64             nonce)
+{
+   int i;
+
+   for (i = 0; i < pg->numBlkChunks; i++) {
+      struct blksync_chunk *chunk = pg->blkChunks + i;
+
+      if (chunk->peer == peer && chunk->nonce == nonce) {
+         return chunk;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_find_blk --
+ *
+ *      Returns the slot of the chunk waiting for block 'hash', if any.
+ *      'hash' comes from the network: it may not even be on our best chain.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct blksync_blk *
+peergroup_blksync_find_blk(struct peergroup     *pg,
+                           const uint256        *hash,
+                           int                   filter,
+                           struct blksync_chunk **chunkOut)
+{
+   int height;
+   int lo;
+   int hi;
+
+   if (pg->numBlkChunks == 0 || !blockstore_has_header(btc->blockStore, hash)) {
+      return NULL;
+   }
+
+   height = blockstore_get_block_height(btc->blockStore, hash);
+
+   /*
+    * The chunks are sorted by height, the ones of a range next to each
+    * other by filter.
+    */
+   lo = 0;
+   hi = pg->numBlkChunks - 1;
+   while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      struct blksync_chunk *chunk = pg->blkChunks + mid;
+      int idx = height - chunk->height;
+
+      if (idx < 0) {
+         hi = mid - 1;
+      } else if (idx >= chunk->num) {
+         lo = mid + 1;
+      } else if (uint256_issame(chunk->hashes + idx, hash)) {
+         chunk += filter - chunk->filter;
+         ASSERT(chunk->filter == filter && chunk->num > idx);
+         *chunkOut = chunk;
+         return chunk->blks + idx;
+      } else {
+         break;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_is_applied --
+ *
+ *      Whether 'hash' is one of the blocks we already applied, that is,
+ *      that are not in a chunk anymore. Late copies come from the peers
+ *      that stalled on them.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+peergroup_blksync_is_applied(const struct peergroup *pg,
+                             const uint256          *hash)
+{
+   struct blockstore *bs = btc->blockStore;
+
+   return blockstore_has_header(bs, hash) &&
+          blockstore_get_block_height(bs, hash) <=
+          blockstore_get_block_height(bs, &pg->blkCursor);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_is_slow --
+ *
+ *      A peer that failed us on a chunk doesn't get any more work until
+ *      that chunk is done, nor while it's serving its stall penalty.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+peergroup_blksync_is_slow(const struct peergroup *pg,
+                          const struct peer      *peer)
+{
+   int i;
+
+   for (i = 0; i < pg->numBlkPeers; i++) {
+      if (pg->blkPeers[i].peer == peer) {
+         if (time_get() < pg->blkPeers[i].penaltyTS) {
+            return 1;
+         }
+         break;
+      }
+   }
+   for (i = 0; i < pg->numBlkChunks; i++) {
+      if (pg->blkChunks[i].slowPeer == peer) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_num_usable --
+ *
+ *      How many peers other than 'except' hold 'filter', are ready and not
+ *      slow.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_blksync_num_usable(const struct peergroup *pg,
+                             const struct peer      *except,
+                             int                     filter)
+{
+   struct circlist_item *li;
+   int n = 0;
+
+   CIRCLIST_SCAN(li, pg->peer_list) {
+      struct peer *peer = peer_get_ready_li(li);
+
+      if (peer && peer != except && peer_get_filter(peer) == filter &&
+          !peergroup_blksync_is_slow(pg, peer)) {
+         n++;
+      }
+   }
+   return n;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_has_room --
+ *
+ *      Whether 'peer' can take 'num' more blocks.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+peergroup_blksync_has_room(struct peergroup *pg,
+                           struct peer      *peer,
+                           int               num)
+{
+   struct blksync_peer *bp = peergroup_blksync_get_peer(pg, peer, TRUE);
+   int n = peergroup_blksync_in_flight(pg, peer);
+
+   return n == 0 || n + num <= peergroup_blksync_window(bp);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_pick_peer --
+ *
+ *      Returns the best scoring of the peers that hold the filter of
+ *      'chunk', have all of it and room for it. Slow peers only qualify if
+ *      not 'strict'.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct peer *
+peergroup_blksync_pick_peer(struct peergroup           *pg,
+                            const struct blksync_chunk *chunk,
+                            bool                        strict)
+{
+   struct circlist_item *li;
+   struct peer *best = NULL;
+   uint32 bestCost = 0;
+   int height = chunk->height + chunk->num - 1;
+
+   CIRCLIST_SCAN(li, pg->peer_list) {
+      struct peer *peer = peer_get_ready_li(li);
+      uint32 cost;
+
+      if (peer == NULL ||
+          peer_get_filter(peer) != chunk->filter ||
+          peer_get_height(peer) < height ||
+          (strict && peergroup_blksync_is_slow(pg, peer)) ||
+          !peergroup_blksync_has_room(pg, peer, chunk->num - chunk->numRecv)) {
+         continue;
+      }
+      cost = peer_get_cost(peer);
+      if (best == NULL || cost < bestCost) {
+         best = peer;
+         bestCost = cost;
+      }
+   }
+   return best;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_best_cost --
+ *
+ *      The cost of the best peer holding 'filter' we could give new chunks
+ *      to.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static uint32
+peergroup_blksync_best_cost(const struct peergroup *pg,
+                            int                     filter)
+{
+   struct circlist_item *li;
+   uint32 best = 0xffffffff;
+
+   CIRCLIST_SCAN(li, pg->peer_list) {
+      struct peer *peer = peer_get_ready_li(li);
+
+      if (peer == NULL || peer_get_filter(peer) != filter ||
+          peergroup_blksync_is_slow(pg, peer)) {
+         continue;
+      }
+      best = MIN(best, peer_get_cost(peer));
+   }
+   return best;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_cut --
+ *
+ *      Lays out the range of up to 'num' blocks past 'blkCursor': one chunk
+ *      per wallet filter. Returns the one for 'filter'.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct blksync_chunk *
+peergroup_blksync_cut(struct peergroup *pg,
+                      int               num,
+                      int               filter)
+{
+   struct blockstore *bs = btc->blockStore;
+   int numFilters = wallet_get_num_filters(btc->wallet);
+   struct blksync_chunk *chunks;
+   uint256 *hashes;
+   int n;
+   int i;
+
+   blockstore_get_next_hashes(bs, &pg->blkCursor, num, &hashes, &n);
+   if (n == 0) {
+      return NULL;
+   }
+
+   pg->blkChunks = safe_realloc(pg->blkChunks, (pg->numBlkChunks + numFilters) *
+                                               sizeof *pg->blkChunks);
+   chunks = pg->blkChunks + pg->numBlkChunks;
+   pg->numBlkChunks += numFilters;
+
+   memset(chunks, 0, numFilters * sizeof *chunks);
+   for (i = 0; i < numFilters; i++) {
+      struct blksync_chunk *chunk = chunks + i;
+
+      if (i == 0) {
+         chunk->hashes = hashes;
+      } else {
+         chunk->hashes = safe_malloc(n * sizeof *hashes);
+         memcpy(chunk->hashes, hashes, n * sizeof *hashes);
+      }
+      chunk->blks   = safe_calloc(n, sizeof *chunk->blks);
+      chunk->num    = n;
+      chunk->filter = i;
+      chunk->height = blockstore_get_block_height(bs, hashes);
+   }
+
+   memcpy(&pg->blkCursor, hashes + n - 1, sizeof *hashes);
+
+   return chunks + filter;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_pending --
+ *
+ *      Returns the first chunk of the filter of 'peer' that nobody is
+ *      fetching, and that 'peer' has all of.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct blksync_chunk *
+peergroup_blksync_pending(struct peergroup  *pg,
+                          const struct peer *peer)
+{
+   int filter = peer_get_filter(peer);
+   int i;
+
+   for (i = 0; i < pg->numBlkChunks; i++) {
+      struct blksync_chunk *chunk = pg->blkChunks + i;
+
+      if (chunk->peer == NULL && chunk->numRecv < chunk->num &&
+          chunk->filter == filter && chunk->slowPeer != peer &&
+          peer_get_height(peer) >= chunk->height + chunk->num - 1) {
+         return chunk;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_send --
+ *
+ *      Asks 'peer' for the blocks of 'chunk' we don't have yet.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_blksync_send(struct peergroup     *pg,
+                       struct blksync_chunk *chunk,
+                       struct peer          *peer)
+{
+   struct blksync_peer *bp = peergroup_blksync_get_peer(pg, peer, TRUE);
+   mtime_t now = time_get();
+   uint256 *hashes;
+   bool idle;
+   int res;
+   int n;
+   int i;
+
+   idle = peergroup_blksync_in_flight(pg, peer) == 0;
+
+   hashes = safe_malloc((chunk->num - chunk->numRecv) * sizeof *hashes);
+   n = 0;
+   for (i = 0; i < chunk->num; i++) {
+      if (chunk->blks[i].blk == NULL) {
+         memcpy(hashes + n, chunk->hashes + i, sizeof *hashes);
+         n++;
+      }
+   }
+
+   Log(LGPFX" %s: fetching %d blocks from #%d..#%d\n", peer_name(peer),
+       n, chunk->height, chunk->height + chunk->num - 1);
+
+   res = peer_send_getdata(peer, INV_TYPE_MSG_FILTERED_BLOCK, hashes, n);
+   if (res == 0) {
+      res = peer_send_ping(peer, &chunk->nonce);
+   }
+   free(hashes);
+   if (res != 0) {
+      Warning(LGPFX" %s: failed to send getdata: %s (%d)\n",
+              peer_name(peer), strerror(res), res);
+      return res;
+   }
+
+   chunk->peer      = peer;
+   chunk->ts        = now;
+   chunk->numAsked  = n;
+   chunk->recvAtAsk = chunk->numRecv;
+   if (idle) {
+      bp->lastTS    = now;
+      bp->bytes0    = peer_get_bytes_recv(peer);
+      bp->floorTS   = now;
+      bp->floorRecv = bp->numRecv;
+   }
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_dispatch --
+ *
+ *      The chunks taken back from other peers go first, to the best scoring
+ *      peers. Then every peer gets new chunks until its window is full,
+ *      except the ones doing much worse than the best: they'd only hold
+ *      back the chunks in front of the queue. Peers we know nothing about
+ *      get a chance to show what they can do. Slow peers are better than
+ *      nothing when they're all we have. With several wallet filters, a
+ *      peer first takes the chunks of its filter that the peers holding the
+ *      other ones left behind.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_blksync_dispatch(struct peergroup *pg)
+{
+   struct blockstore *bs = btc->blockStore;
+   struct circlist_item *li;
+   uint64 maxCost;
+   bool strict;
+   int i;
+
+   for (i = 0; i < pg->numBlkChunks; i++) {
+      struct blksync_chunk *chunk = pg->blkChunks + i;
+      struct peer *peer;
+
+      if (chunk->peer || chunk->numRecv == chunk->num) {
+         continue;
+      }
+      strict = peergroup_blksync_num_usable(pg, NULL, chunk->filter) > 0;
+      peer = peergroup_blksync_pick_peer(pg, chunk, strict);
+      if (peer) {
+         peergroup_blksync_send(pg, chunk, peer);
+      }
+   }
+
+   CIRCLIST_SCAN(li, pg->peer_list) {
+      struct peer *peer = peer_get_ready_li(li);
+      struct blksync_peer *bp;
+      uint32 cost;
+      int filter;
+
+      if (peer == NULL) {
+         continue;
+      }
+      filter = peer_get_filter(peer);
+      strict = peergroup_blksync_num_usable(pg, NULL, filter) > 0;
+      if (strict && peergroup_blksync_is_slow(pg, peer)) {
+         continue;
+      }
+      cost = peer_get_cost(peer);
+      maxCost = (uint64)peergroup_blksync_best_cost(pg, filter) *
+                PEERGROUP_BLKSYNC_MAX_COST;
+      if (cost != 0xffffffff && cost > maxCost) {
+         continue;
+      }
+      bp = peergroup_blksync_get_peer(pg, peer, TRUE);
+
+      while (1) {
+         struct blksync_chunk *chunk;
+         int height = blockstore_get_block_height(bs, &pg->blkCursor);
+         int ahead = pg->numBlkChunks > 0 ? height + 1 - pg->blkChunks[0].height : 0;
+         int num = peergroup_blksync_batch(bp);
+
+         chunk = peergroup_blksync_pending(pg, peer);
+         if (chunk) {
+            if (!peergroup_blksync_has_room(pg, peer, chunk->num - chunk->numRecv) ||
+                peergroup_blksync_send(pg, chunk, peer) != 0) {
+               break;
+            }
+            continue;
+         }
+
+         num = MIN(num, peer_get_height(peer) - height);
+         num = MIN(num, PEERGROUP_BLKSYNC_MAX_AHEAD - ahead);
+         if (num <= 0 || !peergroup_blksync_has_room(pg, peer, num)) {
+            break;
+         }
+         chunk = peergroup_blksync_cut(pg, num, filter);
+         if (chunk == NULL || peergroup_blksync_send(pg, chunk, peer) != 0) {
+            break;
+         }
+      }
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_order_txs --
+ *
+ *      The txs of a block matched by different filters come from different
+ *      peers: puts each one after the ones it spends from, as the txdb can
+ *      only tell that a tx spends our coins once it knows where they are.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_blksync_order_txs(struct buff **txs,
+                            int           n)
+{
+   struct buff **sorted;
+   uint256 *hashes;
+   btc_msg_tx *tx;
+   bool *done;
+   int num;
+   int i;
+
+   hashes = safe_malloc(n * sizeof *hashes);
+   tx     = safe_calloc(n, sizeof *tx);
+   done   = safe_calloc(n, sizeof *done);
+   sorted = safe_malloc(n * sizeof *sorted);
+
+   for (i = 0; i < n; i++) {
+      struct buff buf;
+      int res;
+
+      buff_init(&buf, buff_base(txs[i]), buff_curlen(txs[i]));
+      hash256_calc(buff_base(txs[i]), buff_curlen(txs[i]), hashes + i);
+      res = deserialize_tx(&buf, tx + i);
+      ASSERT(res == 0);
+   }
+
+   for (num = 0; num < n; num++) {
+      int next = -1;
+
+      for (i = 0; i < n && next == -1; i++) {
+         bool blocked = 0;
+         uint64 k;
+         int j;
+
+         if (done[i]) {
+            continue;
+         }
+         for (k = 0; k < tx[i].in_count && !blocked; k++) {
+            for (j = 0; j < n && !blocked; j++) {
+               blocked = !done[j] && j != i &&
+                         uint256_issame(hashes + j, &tx[i].tx_in[k].prevTxHash);
+            }
+         }
+         next = blocked ? -1 : i;
+      }
+      ASSERT(next != -1);
+      done[next] = 1;
+      sorted[num] = txs[next];
+   }
+   memcpy(txs, sorted, n * sizeof *txs);
+
+   for (i = 0; i < n; i++) {
+      btc_msg_tx_free(tx + i);
+   }
+   free(sorted);
+   free(done);
+   free(tx);
+   free(hashes);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_apply_blk --
+ *
+ *      Feeds the txdb with block 'idx' of the chunks of a range: one chunk
+ *      per wallet filter.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_blksync_apply_blk(struct blksync_chunk *chunks,
+                            int                   numFilters,
+                            int                   idx)
+{
+   struct blksync_blk *b = chunks[0].blks + idx;
+   struct buff **txs = b->txs;
+   int numTxs = b->numTxs;
+   int f;
+   int i;
+
+   peergroup_process_filtered_block(b->blk);
+
+   if (numFilters > 1) {
+      txs = NULL;
+      numTxs = 0;
+   }
+   for (f = 0; f < numFilters; f++) {
+      b = chunks[f].blks + idx;
+      wallet_confirm_tx_in_block(btc->wallet, b->blk);
+
+      if (numFilters > 1 && b->numTxs > 0) {
+         txs = safe_realloc(txs, (numTxs + b->numTxs) * sizeof *txs);
+         memcpy(txs + numTxs, b->txs, b->numTxs * sizeof *txs);
+         numTxs += b->numTxs;
+      }
+   }
+   if (numFilters > 1 && numTxs > 1) {
+      peergroup_blksync_order_txs(txs, numTxs);
+   }
+
+   for (i = 0; i < numTxs; i++) {
+      int res;
+
+      res = wallet_handle_tx(btc->wallet, &b->blk->blkHash,
+                             buff_base(txs[i]), buff_curlen(txs[i]));
+      ASSERT(res == 0);
+   }
+   if (numFilters > 1) {
+      free(txs);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_apply --
+ *
+ *      Feeds the txdb with the ranges at the front of the queue, as long as
+ *      all their chunks are complete.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_blksync_apply(struct peergroup *pg)
+{
+   int numFilters = wallet_get_num_filters(btc->wallet);
+   int numApplied = 0;
+
+   while (numApplied + numFilters <= pg->numBlkChunks) {
+      struct blksync_chunk *chunks = pg->blkChunks + numApplied;
+      int f;
+      int i;
+
+      for (f = 0; f < numFilters; f++) {
+         if (chunks[f].peer || chunks[f].numRecv < chunks[f].num) {
+            break;
+         }
+      }
+      if (f < numFilters) {
+         break;
+      }
+
+      for (i = 0; i < chunks->num; i++) {
+         peergroup_blksync_apply_blk(chunks, numFilters, i);
+      }
+      for (f = 0; f < numFilters; f++) {
+         peergroup_blksync_free_chunk(chunks + f);
+      }
+      numApplied += numFilters;
+   }
+
+   if (numApplied > 0) {
+      pg->numBlkChunks -= numApplied;
+      memmove(pg->blkChunks, pg->blkChunks + numApplied,
+              pg->numBlkChunks * sizeof *pg->blkChunks);
+   }
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_rewind --
+ *
+ *      The headers we just got may have switched our best chain to another
+ *      branch, forking below 'blkCursor' or even below the last block we
+ *      applied. The chunks past the fork point are dropped and the cursor
+ *      goes back there, so that they're laid out again on the new branch.
+ *      Returns whether anything changed.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static bool
+peergroup_blksync_rewind(struct peergroup *pg)
+{
+   struct blockstore *bs = btc->blockStore;
+   btc_block_header hdr;
+   uint256 lastBlk;
+   bool cursorOk;
+   bool lastOk;
+   int height;
+   int n;
+   int i;
+
+   peergroup_get_lastblk(pg, &lastBlk);
+   cursorOk = uint256_iszero(&pg->blkCursor) ||
+              blockstore_has_header(bs, &pg->blkCursor);
+   lastOk = uint256_iszero(&lastBlk) || blockstore_has_header(bs, &lastBlk);
+   if (cursorOk && lastOk) {
+      return 0;
+   }
+
+   height = blockstore_get_height(bs);
+   if (!lastOk) {
+      int lastHeight = blockstore_get_fork_height(bs, &lastBlk);
+
+      ASSERT(lastHeight >= 0);
+      blockstore_get_block_at_height(bs, lastHeight, &lastBlk, &hdr);
+      peergroup_set_lastblk(pg, &lastBlk);
+      height = MIN(height, lastHeight);
+   }
+   if (!cursorOk) {
+      height = MIN(height, blockstore_get_fork_height(bs, &pg->blkCursor));
+      ASSERT(height >= 0);
+   }
+
+   /*
+    * The chunks are sorted by height: the ones to drop are at the end.
+    */
+   n = pg->numBlkChunks;
+   while (n > 0 && pg->blkChunks[n - 1].height + pg->blkChunks[n - 1].num - 1 > height) {
+      n--;
+   }
+   if (n < pg->numBlkChunks) {
+      height = MIN(height, pg->blkChunks[n].height - 1);
+   }
+   for (i = n; i < pg->numBlkChunks; i++) {
+      peergroup_blksync_free_chunk(pg->blkChunks + i);
+   }
+
+   Warning(LGPFX" reorg below the blocks we're fetching: back to #%d, "
+           "%d chunk%s dropped.\n", height, pg->numBlkChunks - n,
+           pg->numBlkChunks - n > 1 ? "s" : "");
+
+   pg->numBlkChunks = n;
+   blockstore_get_block_at_height(bs, height, &pg->blkCursor, &hdr);
+
+   return 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_next --
+ *
+ *      Applies what can be, and keeps the peers busy. We're done once
+ *      there's nothing left past our tip.
+ *
+ *      BITC_STATE_UPDATE_TXDB -> BITC_STATE_READY
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_blksync_next(struct peergroup *pg)
+{
+   uint256 best;
+
+   ASSERT(btc->state == BITC_STATE_UPDATE_TXDB);
+
+   peergroup_blksync_apply(pg);
+   peergroup_download_progress();
+
+   blockstore_get_best_hash(btc->blockStore, &best);
+   if (pg->numBlkChunks == 0 && uint256_issame(&pg->blkCursor, &best)) {
+      peergroup_blksync_free(pg);
+      peergroup_download_complete();
+      return;
+   }
+   peergroup_blksync_dispatch(pg);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_release --
+ *
+ *      Takes back all the chunks 'peer' is working on.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_blksync_release(struct peergroup *pg,
+                          struct peer      *peer,
+                          bool              slow)
+{
+   int n = 0;
+   int i;
+
+   for (i = 0; i < pg->numBlkChunks; i++) {
+      struct blksync_chunk *chunk = pg->blkChunks + i;
+
+      if (chunk->peer == peer) {
+         chunk->peer = NULL;
+         chunk->slowPeer = slow ? peer : chunk->slowPeer;
+         n++;
+      } else if (chunk->slowPeer == peer && !slow) {
+         chunk->slowPeer = NULL;
+      }
+   }
+   return n;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_blksync_check_timeouts --
+ *
+ *      Takes back the chunks of the peers that haven't sent us anything
+ *      for too long, or that send us blocks too slowly to be of any help:
+ *      the latter only if there's another peer to turn to. Also gives work
+ *      to the peers whose penalty is over.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_blksync_check_timeouts(struct peergroup *pg)
+{
+   mtime_t now = time_get();
+   double minRate = PEERGROUP_BLKSYNC_MIN_RATE;
+   int i;
+
+   for (i = 0; i < pg->numBlkPeers; i++) {
+      minRate = MAX(minRate, pg->blkPeers[i].rate / PEERGROUP_BLKSYNC_MIN_SHARE);
+   }
+
+   for (i = 0; i < pg->numBlkPeers; i++) {
+      struct blksync_peer *bp = pg->blkPeers + i;
+      char reason[64];
+      double rate;
+      int n;
+
+      if (peergroup_blksync_in_flight(pg, bp->peer) == 0) {
+         continue;
+      }
+      if (now >= bp->lastTS + PEERGROUP_BLKSYNC_TIMEOUT) {
+         snprintf(reason, sizeof reason, "no block in %llu sec",
+                  (now - bp->lastTS) / 1000000);
+      } else if (now >= bp->floorTS + PEERGROUP_BLKSYNC_RATE_PERIOD) {
+         rate = (bp->numRecv - bp->floorRecv) * 1000000.0 / (now - bp->floorTS);
+         bp->floorTS   = now;
+         bp->floorRecv = bp->numRecv;
+         if (rate >= minRate ||
+             peergroup_blksync_num_usable(pg, bp->peer,
+                                          peer_get_filter(bp->peer)) == 0) {
+            continue;
+         }
+         snprintf(reason, sizeof reason, "%.1f blocks/sec", rate);
+      } else {
+         continue;
+      }
+
+      n = peergroup_blksync_release(pg, bp->peer, TRUE);
+      bp->numStalls++;
+      bp->penaltyTS = now + bp->numStalls * PEERGROUP_BLKSYNC_PENALTY;
+      peer_add_stall(bp->peer);
+      pg->numBlkStalls++;
+      Warning(LGPFX" %s: stalled (%s), taking back %d chunk%s -- "
+              "stall #%d, %u so far.\n", peer_name(bp->peer), reason,
+              n, n > 1 ? "s" : "", bp->numStalls, pg->numBlkStalls);
+   }
+   peergroup_blksync_next(pg);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_getdata_remove --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_getdata_remove(struct peergroup   *pg,
+                         struct getdata_req *req)
+{
+   bool s;
+
+   s = hashtable_remove(pg->hash_getdata, &req->key, sizeof req->key);
+   ASSERT(s);
+   free(req->alts);
+   free(req);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_getdata_free_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_getdata_free_cb(const void *key,
+                          size_t      keyLen,
+                          void       *clientData)
+{
+   struct getdata_req *req = (struct getdata_req *)clientData;
+
+   free(req->alts);
+   free(req);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_getdata_scan_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_getdata_scan_cb(const void *key,
+                          size_t      keyLen,
+                          void       *cbData,
+                          void       *keyData)
+{
+   struct getdata_scan *scan = (struct getdata_scan *)cbData;
+
+   scan->reqs[scan->num++] = (struct getdata_req *)keyData;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_getdata_list --
+ *
+ *      Returns a snapshot of the requests in flight, so that the caller may
+ *      remove some of them as it goes.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_getdata_list(struct peergroup     *pg,
+                       struct getdata_req ***reqs)
+{
+   struct getdata_scan scan;
+
+   scan.reqs = safe_malloc(hashtable_getnumentries(pg->hash_getdata) *
+                           sizeof *scan.reqs);
+   scan.num = 0;
+   hashtable_for_each(pg->hash_getdata, peergroup_getdata_scan_cb, &scan);
+
+   *reqs = scan.reqs;
+   return scan.num;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_getdata_retry --
+ *
+ *      The peer we asked for 'req' won't deliver: moves on to the next
+ *      peer that announced it. If there's none left, we forget about it
+ *      until someone announces it again.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_getdata_retry(struct peergroup   *pg,
+                        struct getdata_req *req)
+{
+   char hashStr[80];
+
+   uint256_snprintf_reverse(hashStr, sizeof hashStr, &req->key.hash);
+
+   while (req->numAlts > 0) {
+      struct peer *peer = req->alts[0];
+      int res;
+
+      req->numAlts--;
+      memmove(req->alts, req->alts + 1, req->numAlts * sizeof *req->alts);
+
+      res = peer_send_getdata(peer, req->type, &req->key.hash, 1);
+      if (res == 0) {
+         Log(LGPFX" %s: re-requesting %s from %s.\n",
+             peer_name(req->peer), hashStr, peer_name(peer));
+         req->peer = peer;
+         req->ts   = time_get();
+         return;
+      }
+   }
+
+   Log(LGPFX" %s: no other peer to ask for %s.\n",
+       peer_name(req->peer), hashStr);
+   peergroup_getdata_remove(pg, req);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_getdata_lookup --
+ *
+ *      Returns the request for 'hash' that 'peer' is in line for, if any.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static struct getdata_req *
+peergroup_getdata_lookup(struct peergroup   *pg,
+                         const struct peer  *peer,
+                         enum btc_inv_type   type,
+                         const uint256      *hash,
+                         struct getdata_key *key)
+{
+   struct getdata_req *req;
+   bool s;
+
+   memset(key, 0, sizeof *key);
+   memcpy(&key->hash, hash, sizeof *hash);
+   if (type == INV_TYPE_MSG_FILTERED_BLOCK) {
+      key->filter = peer_get_filter(peer);
+   }
+
+   s = hashtable_lookup(pg->hash_getdata, key, sizeof *key, (void *)&req);
+
+   return s ? req : NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_getdata_add --
+ *
+ *      'peer' announced 'hash'. Returns TRUE if the caller should ask it
+ *      for it, FALSE if another peer already has the request.
+ *
+ *------------------------------------------------------------------------
+ */
+
+bool
+peergroup_getdata_add(struct peer       *peer,
+                      enum btc_inv_type  type,
+                      const uint256     *hash)
+{
+   struct peergroup *pg = btc->peerGroup;
+   struct getdata_key key;
+   struct getdata_req *req;
+   bool s;
+   int i;
+
+   req = peergroup_getdata_lookup(pg, peer, type, hash, &key);
+   if (req) {
+      if (req->peer == peer) {
+         return 0;
+      }
+      for (i = 0; i < req->numAlts; i++) {
+         if (req->alts[i] == peer) {
+            return 0;
+         }
+      }
+      req->alts = safe_realloc(req->alts, (req->numAlts + 1) * sizeof *req->alts);
+      req->alts[req->numAlts++] = peer;
+      return 0;
+   }
+
+   req = safe_calloc(1, sizeof *req);
+   req->key     = key;
+   req->type    = type;
+   req->peer    = peer;
+   req->ts      = time_get();
+   req->firstTS = req->ts;
+
+   s = hashtable_insert(pg->hash_getdata, &req->key, sizeof req->key, req);
+   ASSERT(s);
+
+   return 1;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_getdata_done --
+ *
+ *      Returns when 'hash' was first announced, 0 if we didn't ask for it.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static mtime_t
+peergroup_getdata_done(struct peergroup  *pg,
+                       const struct peer *peer,
+                       enum btc_inv_type  type,
+                       const uint256     *hash)
+{
+   struct getdata_key key;
+   struct getdata_req *req;
+   mtime_t ts;
+
+   req = peergroup_getdata_lookup(pg, peer, type, hash, &key);
+   if (req == NULL) {
+      return 0;
+   }
+   ts = req->firstTS;
+   peergroup_getdata_remove(pg, req);
+
+   return ts;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_getdata_check_timeouts --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_getdata_check_timeouts(struct peergroup *pg)
+{
+   struct getdata_req **reqs;
+   mtime_t now = time_get();
+   int n;
+   int i;
+
+   if (hashtable_getnumentries(pg->hash_getdata) == 0) {
+      return;
+   }
+
+   n = peergroup_getdata_list(pg, &reqs);
+   for (i = 0; i < n; i++) {
+      if (now >= reqs[i]->ts + PEERGROUP_GETDATA_TIMEOUT) {
+         peergroup_getdata_retry(pg, reqs[i]);
+      }
+   }
+   free(reqs);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_getdata_release --
+ *
+ *      'peer' is going away: forgets it ever announced anything.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_getdata_release(struct peergroup *pg,
+                          struct peer      *peer)
+{
+   struct getdata_req **reqs;
+   int n;
+   int i;
+
+   if (hashtable_getnumentries(pg->hash_getdata) == 0) {
+      return;
+   }
 
-      res = peer_send_getdata(peer, INV_TYPE_MSG_FILTERED_BLOCK,
-                              nextHash, n);
-      ASSERT(res == 0);
-   } else {
-      peergroup_download_complete();
+   n = peergroup_getdata_list(pg, &reqs);
+   for (i = 0; i < n; i++) {
+      struct getdata_req *req = reqs[i];
+      int j;
+
+      for (j = 0; j < req->numAlts; j++) {
+         if (req->alts[j] == peer) {
+            req->numAlts--;
+            memmove(req->alts + j, req->alts + j + 1,
+                    (req->numAlts - j) * sizeof *req->alts);
+            break;
+         }
+      }
+      if (req->peer == peer) {
+         peergroup_getdata_retry(pg, req);
+      }
    }
-   free(nextHash);
-   return res;
+   free(reqs);
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * peergroup_download_filtered_blocks_continue --
+ * peergroup_release_peer --
+ *
+ *      'peer' is going away: whatever it was working on goes to another peer.
  *
  *------------------------------------------------------------------------
  */
 
-int
-peergroup_download_filtered_blocks_continue(struct peer *peer)
+void
+peergroup_release_peer(struct peer *peer)
 {
-   uint256 best_hash;
-   uint256 lastTxdb;
-   int res = 0;
-
-   ASSERT(btc->state == BITC_STATE_UPDATE_TXDB);
-
-   peergroup_download_progress();
-   blockstore_get_best_hash(btc->blockStore, &best_hash);
-   peergroup_get_lastblk(btc->peerGroup, &lastTxdb);
+   struct peergroup *pg = btc->peerGroup;
+   struct blksync_peer *bp;
+   struct hdrsync_seg *seg;
+   int n;
+   int i;
 
-   if (uint256_issame(&lastTxdb, &best_hash)) {
-      peergroup_download_complete();
-   } else if (uint256_issame(&lastTxdb, &btc->peerGroup->lastFilteredBlockReq)) {
-      uint256 *nextHash;
-      int n;
+   peergroup_getdata_release(pg, peer);
 
-      blockstore_get_next_hashes(btc->blockStore, &lastTxdb, &nextHash, &n);
+   for (i = 0; i < pg->numHdrSegs; i++) {
+      if (pg->hdrSegs[i].slowPeer == peer) {
+         pg->hdrSegs[i].slowPeer = NULL;
+      }
+   }
 
-      Log(LGPFX" %s: querying %d blocks: %u processed out of %d\n",
-          peer_name(peer), n, btc->peerGroup->numFetched, btc->peerGroup->numToFetch);
+   seg = peergroup_hdrsync_lookup(pg, peer);
+   if (seg) {
+      Log(LGPFX" %s: headers from #%d up for grabs.\n", peer_name(peer),
+          seg->height);
+      seg->peer = NULL;
 
-      ASSERT(n > 0);
-      btc->peerGroup->lastFilteredBlockReq = nextHash[n - 1];
+      if (btc->state == BITC_STATE_UPDATE_HEADERS) {
+         peergroup_hdrsync_next(pg, NULL);
+      }
+   }
 
-      res = peer_send_getdata(peer, INV_TYPE_MSG_FILTERED_BLOCK, nextHash, n);
-      free(nextHash);
+   bp = peergroup_blksync_get_peer(pg, peer, FALSE);
+   if (bp == NULL) {
+      return;
+   }
+   pg->numBlkPeers--;
+   memmove(bp, bp + 1, (pg->blkPeers + pg->numBlkPeers - bp) * sizeof *bp);
+
+   n = peergroup_blksync_release(pg, peer, FALSE);
+   if (n > 0) {
+      Log(LGPFX" %s: %d chunk%s up for grabs.\n", peer_name(peer),
+          n, n > 1 ? "s" : "");
+      if (btc->state == BITC_STATE_UPDATE_TXDB) {
+         peergroup_blksync_next(pg);
+      }
    }
-   return res;
 }
 
 
@@ -692,6 +2564,14 @@ peergroup_print_stats(struct peergroup *peerGroup)
 
    Log(LGPFX" active=%u maxActive=%u\n",
        peerGroup->active, peerGroup->maxActive);
+   Log(LGPFX" stalls: headers=%u blocks=%u\n",
+       peerGroup->numHdrStalls, peerGroup->numBlkStalls);
+   if (peerGroup->numBlkLatency > 0) {
+      Log(LGPFX" block to wallet: %u blocks, avg=%llu msec max=%llu msec\n",
+          peerGroup->numBlkLatency,
+          peerGroup->blkLatencyTotal / peerGroup->numBlkLatency / 1000,
+          peerGroup->blkLatencyMax / 1000);
+   }
 
    for (i = 0; i < BTC_MSG_MAX; i++) {
       if (cmdStats[i].received != 0 || cmdStats[i].sent != 0) {
@@ -729,6 +2609,19 @@ peergroup_refill(bool init)
       max = MAX(max, pg->minActiveInit);
    }
 
+   /*
+    * The peers that served us best last time go first, but we keep a slot
+    * for one we haven't tried: it may be even better.
+    */
+   while (pg->active + 1 < max) {
+      struct peer_addr *paddr = addrbook_get_best_addr(btc->book);
+
+      if (paddr == NULL) {
+         break;
+      }
+      peergroup_add_peer(paddr);
+   }
+
    while (numTried < 2000 && pg->active < max) {
       struct peer_addr *paddr;
 
@@ -812,6 +2705,14 @@ peergroup_periodic_cb(void *clientData)
    }
    peergroup_refill(FALSE);
    peergroup_check_liveness();
+
+   if (btc->state == BITC_STATE_UPDATE_HEADERS) {
+      peergroup_hdrsync_check_timeouts(btc->peerGroup);
+   }
+   if (btc->state == BITC_STATE_UPDATE_TXDB) {
+      peergroup_blksync_check_timeouts(btc->peerGroup);
+   }
+   peergroup_getdata_check_timeouts(btc->peerGroup);
 }
 
 
@@ -844,6 +2745,7 @@ peergroup_init(struct config *config,
 
    memset(pg->lastBlk.data, 0, sizeof(uint256));
    pg->hash_broadcast = hashtable_create();
+   pg->hash_getdata   = hashtable_create();
 
    hashStr = config_getstring(config, NULL, "peergroup.lastblk");
    if (hashStr) {
@@ -917,11 +2819,22 @@ peergroup_add_peer_from_str(struct poll_loop *poll,
 void
 peergroup_seed(void)
 {
+   struct peergroup *pg = btc->peerGroup;
    const char **seeds;
    uint16 port;
    int i;
    int n;
 
+   /*
+    * We need a peer for each of the wallet's filters, and one to spare.
+    */
+   n = wallet_get_num_filters(btc->wallet) + 1;
+   if (pg->maxActive < n) {
+      Log(LGPFX" %d wallet filters: maxPeers %u -> %d\n", n - 1,
+          pg->maxActive, n);
+      pg->maxActive = n;
+   }
+
    port = btc->testnet ? BTC_PORT_TESTNET : BTC_PORT_MAIN;
 
    n = config_getint64(btc->config, 0, "numstaticpeers");
@@ -1052,6 +2965,11 @@ peergroup_exit(struct peergroup *pg)
    hashtable_destroy(pg->hash_broadcast);
    peergroup_print_stats(pg);
    peergroup_destroy_peers();
+   hashtable_clear_with_callback(pg->hash_getdata, peergroup_getdata_free_cb);
+   hashtable_destroy(pg->hash_getdata);
+   free(pg->hdrSegs);
+   free(pg->filterHeight);
+   peergroup_blksync_free(pg);
    free(btc->peerGroup);
    btc->peerGroup = NULL;
 }
@@ -1090,7 +3008,7 @@ peergroup_handle_handshake_ok(struct peer *peer,
        btc->state == BITC_STATE_UPDATE_HEADERS) {
       return peergroup_download_headers(peer, peerStartingHeight);
    } else if (btc->state == BITC_STATE_UPDATE_TXDB) {
-      return peergroup_download_filtered_blocks(peer);
+      return peergroup_download_filtered_blocks();
    } else if (btc->state == BITC_STATE_READY) {
       return peer_on_ready(peer);
    } else {
@@ -1100,6 +3018,94 @@ peergroup_handle_handshake_ok(struct peer *peer,
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_request_announced --
+ *
+ *      Once up to date, the headers we get are new blocks announced by
+ *      'peer', or the ones we missed: asks it for those we haven't
+ *      processed yet, unless another peer is already on it. With several
+ *      wallet filters, that's for the filter 'peer' holds.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+peergroup_request_announced(struct peergroup *pg,
+                            struct peer      *peer,
+                            const uint256    *hashes,
+                            int               n)
+{
+   struct blockstore *bs = btc->blockStore;
+   uint256 lastBlk;
+   uint256 *req;
+   int lastHeight;
+   int num = 0;
+   int res = 0;
+   int i;
+
+   if (n == 0) {
+      return 0;
+   }
+
+   peergroup_get_lastblk(pg, &lastBlk);
+   lastHeight = blockstore_has_header(bs, &lastBlk) ?
+                blockstore_get_block_height(bs, &lastBlk) : -1;
+   if (pg->filterHeight) {
+      lastHeight = pg->filterHeight[peer_get_filter(peer)];
+   }
+
+   req = safe_malloc(n * sizeof *req);
+   for (i = 0; i < n; i++) {
+      if (!blockstore_has_header(bs, hashes + i) ||
+          blockstore_get_block_height(bs, hashes + i) <= lastHeight ||
+          !peergroup_getdata_add(peer, INV_TYPE_MSG_FILTERED_BLOCK, hashes + i)) {
+         continue;
+      }
+      memcpy(req + num, hashes + i, sizeof *req);
+      num++;
+   }
+   if (num > 0) {
+      Log(LGPFX" %s: requesting %d announced block%s.\n", peer_name(peer),
+          num, num > 1 ? "s" : "");
+      res = peer_send_getdata(peer, INV_TYPE_MSG_FILTERED_BLOCK, req, num);
+   }
+   free(req);
+
+   return res;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_add_latency_sample --
+ *
+ *      How long it took from the first announcement of 'blk' until the
+ *      wallet processed it.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+peergroup_add_latency_sample(struct peergroup          *pg,
+                             const btc_msg_merkleblock *blk,
+                             mtime_t                    latency)
+{
+   char hashStr[80];
+
+   pg->numBlkLatency++;
+   pg->blkLatencyTotal += latency;
+   pg->blkLatencyMax = MAX(pg->blkLatencyMax, latency);
+
+   uint256_snprintf_reverse(hashStr, sizeof hashStr, &blk->blkHash);
+   Log(LGPFX" block %s: %llu msec from announcement to wallet (avg %llu).\n",
+       hashStr, latency / 1000,
+       pg->blkLatencyTotal / pg->numBlkLatency / 1000);
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -1112,48 +3118,67 @@ int
 peergroup_handle_headers(struct peer            *peer,
                          int                     peerStartingHeight,
                          const btc_block_header *headers,
+                         const uint256          *hashes,
                          int                     n)
 {
    struct blockstore *bs = btc->blockStore;
-   int numOrphans = 0;
-   int height;
-   int i;
+   struct peergroup *pg = btc->peerGroup;
+   struct hdrsync_seg *seg;
+   int numOrphans;
+   int numAdded;
+   int res;
 
-   for (i = 0; i < n; i++) {
-      const btc_block_header *hdr = headers + i;
+   res = blockstore_add_headers(bs, headers, hashes, n, &numAdded, &numOrphans);
+   if (res) {
+      Warning(LGPFX" %s: invalid batch of %d headers.\n", peer_name(peer), n);
+      return res;
+   }
+   if (numOrphans > 0) {
       char hashStr[80];
-      uint256 hash;
-      bool orphan;
-      bool s;
 
-      hash256_calc(hdr, sizeof *hdr, &hash);
-      uint256_snprintf_reverse(hashStr, sizeof hashStr, &hash);
+      uint256_snprintf_reverse(hashStr, sizeof hashStr, hashes + n - 1);
+      bitcui_set_status("Block %s orphaned (count = %d)", hashStr, numOrphans);
+   }
+   if (numAdded > 0) {
+      int prev = pg->numHdrFetched;
 
-      s = blockstore_add_header(bs, hdr, &hash, &orphan);
-      if (orphan) {
-         numOrphans++;
-         bitcui_set_status("Block %s orphaned (count = %d)", hashStr, numOrphans);
-      }
-      if (s) {
-         btc->peerGroup->numHdrFetched++;
-         if (btc->peerGroup->numHdrFetched % 100000 == 0) {
-            Warning(LGPFX" fetched %6d headers out of %d\n",
-                    btc->peerGroup->numHdrFetched, btc->peerGroup->numHdrToFetch);
-         }
-         peergroup_add_block_finalize(bs, TRUE /* header ony */);
+      pg->numHdrFetched += numAdded;
+      if (prev / 100000 != pg->numHdrFetched / 100000) {
+         Warning(LGPFX" fetched %6d headers out of %d\n",
+                 pg->numHdrFetched, pg->numHdrToFetch);
       }
+      peergroup_add_block_finalize(bs, TRUE /* header ony */);
    }
 
    peergroup_download_progress();
-   height = blockstore_get_height(bs);
 
-   if (height < peerStartingHeight) {
-      ASSERT(btc->state == BITC_STATE_UPDATE_HEADERS);
-      return peer_send_getheaders(peer);
-   } else if (height >= btc->peerGroup->heightTarget) {
-      return peergroup_download_filtered_blocks(peer);
+   if (btc->state == BITC_STATE_READY) {
+      if (numOrphans > 0) {
+         /*
+          * An announcement building on blocks we don't know about.
+          */
+         res = peer_send_getheaders(peer, NULL, NULL);
+         if (res) {
+            return res;
+         }
+      }
+      return peergroup_request_announced(pg, peer, hashes, n);
    }
-   return 0;
+   if (btc->state == BITC_STATE_UPDATE_TXDB) {
+      if (numAdded > 0 && peergroup_blksync_rewind(pg)) {
+         peergroup_blksync_next(pg);
+      }
+      return 0;
+   }
+   if (btc->state != BITC_STATE_UPDATE_HEADERS) {
+      return 0;
+   }
+
+   seg = peergroup_hdrsync_lookup(pg, peer);
+   if (seg) {
+      peergroup_hdrsync_advance(pg, seg, hashes, n);
+   }
+   return peergroup_hdrsync_next(pg, peer);
 }
 
 
@@ -1264,6 +3289,98 @@ peergroup_new_tx_broadcast(struct peergroup  *pg,
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_assign_filter --
+ *
+ *      Picks which of the wallet's filters to load on 'peer': the one the
+ *      fewest other peers hold, so that we hear about all of our keys.
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+peergroup_assign_filter(struct peergroup  *pg,
+                        const struct peer *peer)
+{
+   int numFilters = wallet_get_num_filters(btc->wallet);
+   struct circlist_item *li;
+   int *count;
+   int best = 0;
+   int i;
+
+   if (pg == NULL || numFilters <= 1) {
+      return 0;
+   }
+
+   count = safe_calloc(numFilters, sizeof *count);
+   CIRCLIST_SCAN(li, pg->peer_list) {
+      struct peer *p = peer_get_ready_li(li);
+
+      if (p && p != peer) {
+         count[peer_get_filter(p)]++;
+      }
+   }
+   for (i = 1; i < numFilters; i++) {
+      if (count[i] < count[best]) {
+         best = i;
+      }
+   }
+   free(count);
+
+   Log(LGPFX" %s: loading filter %d/%d.\n", peer_name(peer), best, numFilters);
+
+   return best;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_refresh_filter --
+ *
+ *      The wallet's filter 'idx' changed: push the new element to the peers
+ *      holding it via a filteradd, or if 'data' is NULL, send all the peers
+ *      their whole filter again. Peers still in the handshake get the
+ *      current filter when it completes.
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+peergroup_refresh_filter(struct peergroup *pg,
+                         int               idx,
+                         const uint8      *data,
+                         size_t            len)
+{
+   struct circlist_item *next;
+   struct circlist_item *li;
+
+   if (pg == NULL) {
+      return;
+   }
+
+   CIRCLIST_SCAN_SAFE(li, next, pg->peer_list) {
+      struct peer *peer = peer_get_ready_li(li);
+      int res;
+
+      if (peer == NULL || (data && peer_get_filter(peer) != idx)) {
+         continue;
+      }
+      if (data) {
+         res = peer_send_filteradd(peer, data, len);
+      } else {
+         res = peer_send_filterload(peer);
+      }
+      if (res) {
+         Warning(LGPFX" %s: failed to send %s: %s (%d)\n", peer_name(peer),
+                 data ? "filteradd" : "filterload", strerror(res), res);
+      }
+   }
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -1302,6 +3419,34 @@ peergroup_handle_addr(struct peer      *peer,
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_handle_notfound --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+peergroup_handle_notfound(struct peer       *peer,
+                          const btc_msg_inv *inv,
+                          int                numInv)
+{
+   struct peergroup *pg = btc->peerGroup;
+   int i;
+
+   for (i = 0; i < numInv; i++) {
+      struct getdata_key key;
+      struct getdata_req *req;
+
+      req = peergroup_getdata_lookup(pg, peer, inv[i].type, &inv[i].hash, &key);
+      if (req && req->peer == peer) {
+         peergroup_getdata_retry(pg, req);
+      }
+   }
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -1314,17 +3459,156 @@ int
 peergroup_handle_merkleblock(struct peer *peer,
                              const btc_msg_merkleblock *blk)
 {
+   struct peergroup *pg = btc->peerGroup;
+   struct blksync_chunk *chunk;
+   struct blksync_blk *b;
+   mtime_t annTS;
+
    ASSERT(btc->state == BITC_STATE_READY ||
           btc->state == BITC_STATE_UPDATE_TXDB);
 
-   peergroup_process_filtered_block(peer, blk);
-   wallet_confirm_tx_in_block(btc->wallet, blk);
+   annTS = peergroup_getdata_done(pg, peer, INV_TYPE_MSG_FILTERED_BLOCK,
+                                  &blk->blkHash);
 
-   if (btc->state == BITC_STATE_READY) {
+   if (btc->state == BITC_STATE_UPDATE_TXDB) {
+      b = peergroup_blksync_find_blk(pg, &blk->blkHash, peer_get_filter(peer),
+                                     &chunk);
+      if (b == NULL) {
+         if (!blockstore_has_header(btc->blockStore, &blk->blkHash) ||
+             peergroup_blksync_is_applied(pg, &blk->blkHash)) {
+            return 0;
+         }
+         goto process;
+      }
+      if (chunk->peer == peer) {
+         struct blksync_peer *bp = peergroup_blksync_get_peer(pg, peer, TRUE);
+
+         bp->lastTS = time_get();
+         bp->numRecv++;
+      }
+      if (b->blk == NULL) {
+         b->blk = btc_msg_merkleblock_dup(blk);
+         chunk->numRecv++;
+      }
       return 0;
    }
 
+process:
+
+   peergroup_process_filtered_block(blk);
+   wallet_confirm_tx_in_block(btc->wallet, blk);
+
+   if (pg->filterHeight && blockstore_has_header(btc->blockStore, &blk->blkHash)) {
+      int *height = pg->filterHeight + peer_get_filter(peer);
+
+      *height = MAX(*height, blockstore_get_block_height(btc->blockStore,
+                                                        &blk->blkHash));
+   }
+
+   if (annTS != 0) {
+      peergroup_add_latency_sample(pg, blk, time_get() - annTS);
+   }
+   return 0;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_handle_tx --
+ *
+ *      'blkHash' is the merkleblock this tx follows, if any. If that block
+ *      is waiting in a chunk, so does the tx.
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+peergroup_handle_tx(struct peer   *peer,
+                    const uint256 *blkHash,
+                    const uint8   *buf,
+                    size_t         len)
+{
+   struct peergroup *pg = btc->peerGroup;
+
+   if (hashtable_getnumentries(pg->hash_getdata) > 0) {
+      uint256 hash;
+
+      hash256_calc(buf, len, &hash);
+      peergroup_getdata_done(pg, peer, INV_TYPE_MSG_TX, &hash);
+   }
+
+   if (btc->state == BITC_STATE_UPDATE_TXDB && !uint256_iszero(blkHash)) {
+      struct blksync_chunk *chunk;
+      struct blksync_blk *b;
+
+      b = peergroup_blksync_find_blk(pg, blkHash, peer_get_filter(peer), &chunk);
+      if (b == NULL && (!blockstore_has_header(btc->blockStore, blkHash) ||
+                        peergroup_blksync_is_applied(pg, blkHash))) {
+         return 0;
+      }
+      if (b && b->blk) {
+         b->txs = safe_realloc(b->txs, (b->numTxs + 1) * sizeof *b->txs);
+         b->txs[b->numTxs] = buff_alloc();
+         buff_copy_to(b->txs[b->numTxs], buf, len);
+         b->numTxs++;
+         return 0;
+      }
+   }
+   return wallet_handle_tx(btc->wallet, blkHash, buf, len);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * peergroup_handle_pong --
+ *
+ *      A pong following a getdata for a chunk: the peer is done with it.
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+peergroup_handle_pong(struct peer *peer,
+                      uint64       nonce)
+{
+   struct peergroup *pg = btc->peerGroup;
+   struct blksync_chunk *chunk;
+   struct blksync_peer *bp;
+   mtime_t now = time_get();
+   mtime_t start;
+   uint64 bytes;
+
+   chunk = peergroup_blksync_lookup(pg, peer, nonce);
+   if (chunk == NULL) {
+      return;
+   }
    ASSERT(btc->state == BITC_STATE_UPDATE_TXDB);
 
-   return peergroup_download_filtered_blocks_continue(peer);
+   /*
+    * The peer started on this chunk when we sent it, or when it was done
+    * with the previous one if that's later.
+    */
+   bp = peergroup_blksync_get_peer(pg, peer, TRUE);
+   start = MAX(chunk->ts, bp->pongTS);
+   bytes = peer_get_bytes_recv(peer);
+   if (now > start && chunk->numAsked > 0) {
+      double rate = (chunk->numRecv - chunk->recvAtAsk) * 1000000.0 / (now - start);
+
+      bp->rate = bp->rate == 0.0 ? rate : (3 * bp->rate + rate) / 4;
+      peer_add_rate_sample(peer, bytes - bp->bytes0, now - start);
+   }
+   bp->pongTS = now;
+   bp->lastTS = now;
+   bp->bytes0 = bytes;
+
+   chunk->peer = NULL;
+   if (chunk->numRecv < chunk->num) {
+      Log(LGPFX" %s: %d blocks missing from #%d..#%d.\n", peer_name(peer),
+          chunk->num - chunk->numRecv, chunk->height,
+          chunk->height + chunk->num - 1);
+      chunk->slowPeer = peer;
+   }
+   peergroup_blksync_next(pg);
 }
@@ -8,16 +8,48 @@ struct peer;
 struct config;
 struct buff;
 
+struct blksync_blk {
+   btc_msg_merkleblock  *blk;
+   struct buff         **txs;     /* matched txs, serialized */
+   int                   numTxs;
+};
+
+
+struct blksync_chunk {
+   uint256             *hashes;
+   struct blksync_blk  *blks;
+   int                  filter;    /* wallet filter it's fetched with */
+   int                  height;    /* height of hashes[0] */
+   int                  num;
+   int                  numRecv;
+   struct peer         *peer;      /* peer fetching the chunk, if any */
+   struct peer         *slowPeer;  /* last peer that failed us on it */
+   uint64               nonce;     /* of the ping following the getdata */
+   mtime_t              ts;        /* of the getdata */
+   int                  numAsked;  /* blocks in the getdata */
+   int                  recvAtAsk; /* 'numRecv' when the getdata went out */
+};
+
+
 struct peergroup {
    struct circlist_item *peer_list;
 
    uint32                peerSequence;
-   uint256               lastFilteredBlockReq;
 
    bool                  configNeedWrite;
    uint256               lastBlk;
 
    struct hashtable     *hash_broadcast;
+   struct hashtable     *hash_getdata;
+
+   struct hdrsync_seg   *hdrSegs;
+   int                   numHdrSegs;
+
+   struct blksync_chunk *blkChunks;
+   int                   numBlkChunks;
+   uint256               blkCursor;
+   struct blksync_peer  *blkPeers;
+   int                   numBlkPeers;
 
    int                   numFetched;
    int                   numToFetch;
@@ -25,6 +57,15 @@ struct peergroup {
    int                   numHdrToFetch;
    int                   heightTarget;
 
+   uint32                numHdrStalls;
+   uint32                numBlkStalls;
+
+   int                  *filterHeight;    /* per wallet filter, once ready */
+
+   uint32                numBlkLatency;   /* announcement to wallet */
+   mtime_t               blkLatencyTotal;
+   mtime_t               blkLatencyMax;
+
    uint32                active;
    uint32                maxActive;
    uint32                minActiveInit;
@@ -46,17 +87,29 @@ void peergroup_refill(bool init);
 void peergroup_notify_destroy(void);
 void peergroup_dequeue_peerlist(const struct circlist_item *li);
 void peergroup_queue_peerlist(struct circlist_item *li);
+void peergroup_release_peer(struct peer *peer);
 
 int peergroup_handle_handshake_ok(struct peer *peer, int peerStartingHeight);
 int peergroup_handle_merkleblock(struct peer *peer, const btc_msg_merkleblock *blk);
+int peergroup_handle_tx(struct peer *peer, const uint256 *blkHash,
+                        const uint8 *buf, size_t len);
+void peergroup_handle_pong(struct peer *peer, uint64 nonce);
+void peergroup_handle_notfound(struct peer *peer, const btc_msg_inv *inv,
+                               int numInv);
+bool peergroup_getdata_add(struct peer *peer, enum btc_inv_type type,
+                           const uint256 *hash);
 void peergroup_handle_addr(struct peer *peer, btc_msg_address **addrs,
                           size_t numAddrs);
 int peergroup_lookup_broadcast_tx(struct peergroup *pg, const uint256 *hash,
                                   struct buff **bufOut);
 void peergroup_stop_broadcast_tx(struct peergroup *pg, const uint256 *hash);
 int peergroup_handle_headers(struct peer *peer, int peerStartingHeight,
-                             const btc_block_header *headers, int n);
+                             const btc_block_header *headers,
+                             const uint256 *hashes, int n);
 int peergroup_new_tx_broadcast(struct peergroup *pg, const struct buff *buf,
                                mtime_t expiry, const uint256 *hash);
+int  peergroup_assign_filter(struct peergroup *pg, const struct peer *peer);
+void peergroup_refresh_filter(struct peergroup *pg, int idx,
+                              const uint8 *data, size_t len);
 
 #endif /* __PEERGROUP_H__ */
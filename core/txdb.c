@@ -82,6 +82,8 @@ struct txdb {
    struct hashtable       *hash_tx;  /* key'd by txHash */
    struct hashtable       *hash_txo;
    uint64                  tx_seq;
+   uint32                  numTxRecv;       /* new txs handed by peers */
+   uint32                  numTxIrrelevant; /* .. that weren't ours */
 
    char                   *path;
    leveldb_t              *db;
@@ -1196,6 +1198,7 @@ txdb_handle_tx(struct txdb   *txdb,
    uint256 txHash;
    mtime_t ts = 0;
    bool txKnown;
+   int res;
 
    *relevant = 0;
    hash256_calc(buf, len, &txHash);
@@ -1216,8 +1219,35 @@ txdb_handle_tx(struct txdb   *txdb,
       ts = blockstore_get_block_timestamp(btc->blockStore, blkHash);
    }
 
-   return txdb_remember_tx(txdb, 0 /* save to disk */, ts, buf, len,
-                           &txHash, blkHash, relevant);
+   res = txdb_remember_tx(txdb, 0 /* save to disk */, ts, buf, len,
+                          &txHash, blkHash, relevant);
+   if (res == 0) {
+      txdb->numTxRecv++;
+      txdb->numTxIrrelevant += *relevant == 0;
+   }
+   return res;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * txdb_get_tx_stats --
+ *
+ *      Number of new txs we were sent, and how many of these turned out
+ *      not to be relevant to the wallet: as peers only send us what
+ *      matches our bloom filter, the latter are its false positives.
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+txdb_get_tx_stats(const struct txdb *txdb,
+                  uint32            *numTxRecv,
+                  uint32            *numTxIrrelevant)
+{
+   *numTxRecv       = txdb->numTxRecv;
+   *numTxIrrelevant = txdb->numTxIrrelevant;
 }
 
 
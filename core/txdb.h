@@ -19,6 +19,8 @@ int  txdb_craft_tx(struct txdb *txdb, const struct btc_tx_desc *tx,
 
 void txdb_export_tx_info(struct txdb *txdb);
 uint64 txdb_get_balance(struct txdb *txdb);
+void txdb_get_tx_stats(const struct txdb *txdb, uint32 *numTxRecv,
+                       uint32 *numTxIrrelevant);
 void txdb_confirm_one_tx(struct txdb *txdb, const uint256 *blkHash,
                          const uint256 *txHash);
 
@@ -23,10 +23,26 @@
 #include "btc-message.h"
 #include "hashtable.h"
 #include "crypt.h"
+#include "peergroup.h"
 #include "bitc.h"
 
 #define LGPFX "WALLET:"
 
+/*
+ * The bloom filters are sized for the keys we have plus some headroom so that
+ * new keys can be pushed to peers via filteradd without degrading the
+ * false-positive rate: past that, the filters are rebuilt and reloaded.
+ */
+#define WALLET_FILTER_HEADROOM   100
+#define WALLET_FILTER_FP_RATE    0.001
+
+
+struct wallet_filter {
+   struct bloom_filter *bloom;
+   uint32               numKeys;
+   uint32               capacity;
+};
+
 
 struct wallet_key {
    struct key  *key;
@@ -50,7 +66,8 @@ struct wallet {
    struct secure_area     *pass;
    struct crypt_key       *ckey;
    struct secure_area     *ckey_store;
-   struct bloom_filter    *filter;
+   struct wallet_filter   *filters;
+   int                     numFilters;
 };
 
 
@@ -636,6 +653,50 @@ exit:
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * wallet_filter_idx --
+ *
+ *      Which of the filters 'pub_key' goes in. Being a hash, its first
+ *      bytes spread the keys evenly.
+ *
+ *------------------------------------------------------------------------
+ */
+
+static int
+wallet_filter_idx(const struct wallet *wallet,
+                  const uint160       *pub_key)
+{
+   uint32 v;
+
+   memcpy(&v, pub_key->data, sizeof v);
+
+   return v % wallet->numFilters;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * wallet_count_filter_cb --
+ *
+ *------------------------------------------------------------------------
+ */
+
+static void
+wallet_count_filter_cb(const void *key,
+                       size_t len,
+                       void *cbData,
+                       void *keyData)
+{
+   struct wallet *wallet = (struct wallet *)cbData;
+   struct wallet_key *wkey = (struct wallet_key *)keyData;
+
+   wallet->filters[wallet_filter_idx(wallet, &wkey->pub_key)].numKeys++;
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
@@ -650,26 +711,36 @@ wallet_update_filter_cb(const void *key,
                         void *cbData,
                         void *keyData)
 {
-   struct bloom_filter *filter = (struct bloom_filter *)cbData;
+   struct wallet *wallet = (struct wallet *)cbData;
    struct wallet_key *wkey = (struct wallet_key *)keyData;
+   struct wallet_filter *f;
 
-   bloom_add(filter, &wkey->pub_key, sizeof wkey->pub_key);
+   f = wallet->filters + wallet_filter_idx(wallet, &wkey->pub_key);
+   bloom_add(f->bloom, &wkey->pub_key, sizeof wkey->pub_key);
 }
 
 
 /*
  *------------------------------------------------------------------------
  *
- * wallet_update_filter --
+ * wallet_filter_free --
  *
  *------------------------------------------------------------------------
  */
 
 static void
-wallet_update_filter(const struct wallet *wallet,
-                     struct bloom_filter *filter)
+wallet_filter_free(struct wallet *wallet)
 {
-   hashtable_for_each(wallet->hash_keys, wallet_update_filter_cb, filter);
+   int i;
+
+   if (wallet->filters == NULL) {
+      return;
+   }
+   for (i = 0; i < wallet->numFilters; i++) {
+      bloom_free(wallet->filters[i].bloom);
+   }
+   free(wallet->filters);
+   wallet->filters = NULL;
 }
 
 
@@ -678,16 +749,115 @@ wallet_update_filter(const struct wallet *wallet,
  *
  * wallet_filter_init --
  *
+ *      Past what a single filter can hold at WALLET_FILTER_FP_RATE, the
+ *      keys are split over several filters, each loaded on different
+ *      peers: see peergroup_assign_filter(). The number of filters is set
+ *      the first time around and kept for the session, as the peers and
+ *      the block download are organized around it.
+ *
  *----------------------------------------------------------------
  */
 
 static void
 wallet_filter_init(struct wallet *wallet)
 {
-   ASSERT(wallet->filter == NULL);
-   wallet->filter = bloom_create(10, 0.001);
+   uint32 numKeys = hashtable_getnumentries(wallet->hash_keys);
+   double fp = 0.0;
+   int64 headroom;
+   int i;
+
+   headroom = config_getint64(btc->config, WALLET_FILTER_HEADROOM,
+                              "wallet.filterHeadroom");
+   headroom = MAX(headroom, 1);
 
-   wallet_update_filter(wallet, wallet->filter);
+   if (wallet->numFilters == 0) {
+      int maxKeys = bloom_get_max_elements(WALLET_FILTER_FP_RATE);
+      int64 n;
+
+      n = config_getint64(btc->config, 1, "wallet.numFilters");
+      n = MAX(n, (numKeys + headroom + maxKeys - 1) / maxKeys);
+      wallet->numFilters = MAX(n, 1);
+   }
+
+   ASSERT(wallet->filters == NULL);
+   wallet->filters = safe_calloc(wallet->numFilters, sizeof *wallet->filters);
+   hashtable_for_each(wallet->hash_keys, wallet_count_filter_cb, wallet);
+
+   for (i = 0; i < wallet->numFilters; i++) {
+      struct wallet_filter *f = wallet->filters + i;
+
+      f->capacity = f->numKeys + MAX(headroom / wallet->numFilters, 1);
+      f->bloom = bloom_create(f->capacity, WALLET_FILTER_FP_RATE);
+   }
+   hashtable_for_each(wallet->hash_keys, wallet_update_filter_cb, wallet);
+
+   for (i = 0; i < wallet->numFilters; i++) {
+      fp = MAX(fp, bloom_get_fp_rate(wallet->filters[i].bloom,
+                                     wallet->filters[i].numKeys));
+   }
+   Log(LGPFX" %d filter%s for %u keys, headroom=%lld: expected fp rate=%.5f\n",
+       wallet->numFilters, wallet->numFilters > 1 ? "s" : "", numKeys,
+       headroom, fp);
+}
+
+
+/*
+ *----------------------------------------------------------------
+ *
+ * wallet_filter_add_key --
+ *
+ *      Adds a new key to its filter and to the copy of the peers holding
+ *      it. Once the filter is past the capacity it was sized for, we build
+ *      bigger ones and have all the peers reload theirs.
+ *
+ *----------------------------------------------------------------
+ */
+
+static void
+wallet_filter_add_key(struct wallet *wallet,
+                      const uint160 *pub_key)
+{
+   int idx = wallet_filter_idx(wallet, pub_key);
+   struct wallet_filter *f = wallet->filters + idx;
+
+   f->numKeys++;
+   if (f->numKeys <= f->capacity) {
+      bloom_add(f->bloom, pub_key, sizeof *pub_key);
+      peergroup_refresh_filter(btc->peerGroup, idx, pub_key->data,
+                               sizeof *pub_key);
+      return;
+   }
+
+   wallet_filter_free(wallet);
+   wallet_filter_init(wallet);
+
+   peergroup_refresh_filter(btc->peerGroup, -1, NULL, 0);
+}
+
+
+/*
+ *----------------------------------------------------------------
+ *
+ * wallet_print_filter_stats --
+ *
+ *----------------------------------------------------------------
+ */
+
+static void
+wallet_print_filter_stats(const struct wallet *wallet)
+{
+   uint32 numTxRecv;
+   uint32 numTxIrrelevant;
+
+   if (wallet->txdb == NULL || wallet->filters == NULL) {
+      return;
+   }
+   txdb_get_tx_stats(wallet->txdb, &numTxRecv, &numTxIrrelevant);
+   if (numTxRecv == 0) {
+      return;
+   }
+   Log(LGPFX" filter: %u txs received, %u false positives (%.1f%%)\n",
+       numTxRecv, numTxIrrelevant, 100.0 * numTxIrrelevant / numTxRecv);
 }
 
 
@@ -943,12 +1113,31 @@ exit:
 
 void
 wallet_get_bloom_filter_info(const struct wallet *wallet,
+                             int                  idx,
                              uint8              **filter,
                              uint32              *filterSize,
                              uint32              *numHashFuncs,
                              uint32              *tweak)
 {
-   bloom_getinfo(wallet->filter, filter, filterSize, numHashFuncs, tweak);
+   ASSERT(idx >= 0 && idx < wallet->numFilters);
+
+   bloom_getinfo(wallet->filters[idx].bloom, filter, filterSize,
+                 numHashFuncs, tweak);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * wallet_get_num_filters --
+ *
+ *------------------------------------------------------------------------
+ */
+
+int
+wallet_get_num_filters(const struct wallet *wallet)
+{
+   return wallet ? wallet->numFilters : 1;
 }
 
 
@@ -1139,6 +1328,7 @@ wallet_add_key(struct wallet *wallet,
                char         **btc_addr)
 {
    struct key *k;
+   uint160 pub_key;
    uint8 *privkey;
    char *privStr;
    size_t len;
@@ -1149,15 +1339,15 @@ wallet_add_key(struct wallet *wallet,
    }
    key_get_privkey(k, &privkey, &len);
    privStr = b58_bytes_to_privkey(privkey, len);
+   key_get_pubkey_hash160(k, &pub_key);
 
    if (btc_addr) {
-      uint160 pub_key;
-      key_get_pubkey_hash160(k, &pub_key);
       *btc_addr = b58_pubkey_from_uint160(&pub_key);
    }
 
    // XXX: fixme
    wallet_alloc_key(wallet, privStr, NULL, desc, time(NULL), TRUE);
+   wallet_filter_add_key(wallet, &pub_key);
 
    free(privStr);
 
@@ -1179,8 +1369,8 @@ wallet_close(struct wallet *wallet)
    if (wallet == NULL) {
       return;
    }
-   bloom_free(wallet->filter);
-   wallet->filter = NULL;
+   wallet_print_filter_stats(wallet);
+   wallet_filter_free(wallet);
    txdb_close(wallet->txdb);
    hashtable_clear_with_callback(wallet->hash_keys, wallet_free_key_cb);
    hashtable_destroy(wallet->hash_keys);
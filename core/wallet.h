@@ -38,8 +38,9 @@ void wallet_confirm_tx_in_block(struct wallet *wallet, const btc_msg_merkleblock
 struct key * wallet_lookup_pubkey(const struct wallet *wallet, const uint160 *pub_key);
 bool wallet_verify(struct secure_area *pass, enum wallet_state *wlt_state);
 int wallet_encrypt(struct wallet *wallet, struct secure_area *pass);
-void wallet_get_bloom_filter_info(const struct wallet *wallet,
+void wallet_get_bloom_filter_info(const struct wallet *wallet, int idx,
                                   uint8 **filter, uint32 *filterSize,
                                   uint32 *numHashFuncs, uint32 *tweak);
+int  wallet_get_num_filters(const struct wallet *wallet);
 
 #endif /* __WALLET_H__ */
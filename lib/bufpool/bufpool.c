@@ -0,0 +1,397 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "atomic.h"
+#include "basic_defs.h"
+#include "util.h"
+#include "bufpool.h"
+
+#define LGPFX "BUFPOOL:"
+
+/*
+ * Buffers are rounded up to a power of two between 64 bytes and 256KB, the
+ * largest P2P payload we accept. Freed buffers go on a per-thread free list
+ * for their size class, so that the alloc/free churn of crafting messages
+ * stays off malloc. Each buffer is preceded by a small header recording its
+ * class; larger buffers bypass the caches.
+ */
+#define BUFPOOL_MIN_SHIFT       6
+#define BUFPOOL_MAX_SHIFT       18
+#define BUFPOOL_NUM_CLASSES     (BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+#define BUFPOOL_LARGE           BUFPOOL_NUM_CLASSES
+#define BUFPOOL_CACHE_BYTES     (1024 * 1024)   /* per class and thread */
+#define BUFPOOL_CACHE_MAX       256
+#define BUFPOOL_MAGIC           0xb0f0b0f0
+
+struct bufpool_hdr {
+   uint32                   magic;
+   uint32                   cls;
+   size_t                   size;
+};
+
+struct bufpool_freebuf {
+   struct bufpool_freebuf  *next;
+};
+
+struct bufpool_cache {
+   struct bufpool_freebuf  *freeList[BUFPOOL_NUM_CLASSES];
+   uint32                   numFree[BUFPOOL_NUM_CLASSES];
+};
+
+static struct {
+   pthread_once_t           once;
+   pthread_key_t            key;
+   atomic_uint64            numHits[BUFPOOL_NUM_CLASSES];
+   atomic_uint64            numMisses[BUFPOOL_NUM_CLASSES];
+   atomic_uint64            numLarge;
+} bufpool = {
+   .once = PTHREAD_ONCE_INIT,
+};
+
+static __thread struct bufpool_cache *bufpool_cache;
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_cache_release --
+ *
+ *      Frees the buffers cached by a thread. Runs at thread exit.
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bufpool_cache_release(void *clientData)
+{
+   struct bufpool_cache *cache = clientData;
+   int i;
+
+   if (cache == NULL) {
+      return;
+   }
+   for (i = 0; i < BUFPOOL_NUM_CLASSES; i++) {
+      while (cache->freeList[i]) {
+         struct bufpool_freebuf *fb = cache->freeList[i];
+
+         cache->freeList[i] = fb->next;
+         free((struct bufpool_hdr *)fb - 1);
+      }
+      cache->numFree[i] = 0;
+   }
+   free(cache);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_key_create --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+bufpool_key_create(void)
+{
+   int res;
+
+   res = pthread_key_create(&bufpool.key, bufpool_cache_release);
+   if (res != 0) {
+      Panic(LGPFX" pthread_key_create failed: %d\n", res);
+   }
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_get_cache --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static struct bufpool_cache *
+bufpool_get_cache(void)
+{
+   if (bufpool_cache == NULL) {
+      pthread_once(&bufpool.once, bufpool_key_create);
+      bufpool_cache = safe_calloc(1, sizeof *bufpool_cache);
+      pthread_setspecific(bufpool.key, bufpool_cache);
+   }
+   return bufpool_cache;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_get_class --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static uint32
+bufpool_get_class(size_t len)
+{
+   uint32 cls = 0;
+
+   if (len > (1 << BUFPOOL_MAX_SHIFT)) {
+      return BUFPOOL_LARGE;
+   }
+   while (((size_t)1 << (cls + BUFPOOL_MIN_SHIFT)) < len) {
+      cls++;
+   }
+   return cls;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_class_max_free --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static uint32
+bufpool_class_max_free(uint32 cls)
+{
+   uint32 n = BUFPOOL_CACHE_BYTES >> (cls + BUFPOOL_MIN_SHIFT);
+
+   return MIN(MAX(n, 4), BUFPOOL_CACHE_MAX);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_get_hdr --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static struct bufpool_hdr *
+bufpool_get_hdr(const void *ptr)
+{
+   struct bufpool_hdr *hdr = (struct bufpool_hdr *)ptr - 1;
+
+   ASSERT(hdr->magic == BUFPOOL_MAGIC);
+   ASSERT(hdr->cls <= BUFPOOL_LARGE);
+
+   return hdr;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_alloc --
+ *
+ *---------------------------------------------------------------------
+ */
+
+void *
+bufpool_alloc(size_t len)
+{
+   struct bufpool_cache *cache;
+   struct bufpool_hdr *hdr;
+   uint32 cls;
+   size_t size;
+
+   cls = bufpool_get_class(len);
+   if (cls == BUFPOOL_LARGE) {
+      atomic64_inc(&bufpool.numLarge);
+      size = len;
+   } else {
+      cache = bufpool_get_cache();
+      if (cache->freeList[cls]) {
+         struct bufpool_freebuf *fb = cache->freeList[cls];
+
+         cache->freeList[cls] = fb->next;
+         cache->numFree[cls]--;
+         atomic64_inc(&bufpool.numHits[cls]);
+         return fb;
+      }
+      atomic64_inc(&bufpool.numMisses[cls]);
+      size = (size_t)1 << (cls + BUFPOOL_MIN_SHIFT);
+   }
+
+   hdr = safe_malloc(sizeof *hdr + size);
+   hdr->magic = BUFPOOL_MAGIC;
+   hdr->cls   = cls;
+   hdr->size  = size;
+
+   return hdr + 1;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_free --
+ *
+ *---------------------------------------------------------------------
+ */
+
+void
+bufpool_free(void *ptr)
+{
+   struct bufpool_cache *cache;
+   struct bufpool_freebuf *fb;
+   struct bufpool_hdr *hdr;
+
+   if (ptr == NULL) {
+      return;
+   }
+
+   hdr = bufpool_get_hdr(ptr);
+   if (hdr->cls == BUFPOOL_LARGE) {
+      free(hdr);
+      return;
+   }
+
+   cache = bufpool_get_cache();
+   if (cache->numFree[hdr->cls] >= bufpool_class_max_free(hdr->cls)) {
+      free(hdr);
+      return;
+   }
+
+   fb = ptr;
+   fb->next = cache->freeList[hdr->cls];
+   cache->freeList[hdr->cls] = fb;
+   cache->numFree[hdr->cls]++;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_get_size --
+ *
+ *      The usable size of the buffer, possibly larger than requested.
+ *
+ *---------------------------------------------------------------------
+ */
+
+size_t
+bufpool_get_size(const void *ptr)
+{
+   return bufpool_get_hdr(ptr)->size;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_realloc --
+ *
+ *---------------------------------------------------------------------
+ */
+
+void *
+bufpool_realloc(void   *ptr,
+                size_t  len)
+{
+   void *ptr2;
+   size_t size;
+
+   if (ptr == NULL) {
+      return bufpool_alloc(len);
+   }
+
+   size = bufpool_get_size(ptr);
+   if (len <= size) {
+      return ptr;
+   }
+
+   ptr2 = bufpool_alloc(len);
+   memcpy(ptr2, ptr, size);
+   bufpool_free(ptr);
+
+   return ptr2;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_get_stats --
+ *
+ *---------------------------------------------------------------------
+ */
+
+void
+bufpool_get_stats(struct bufpool_stats *stats)
+{
+   int i;
+
+   memset(stats, 0, sizeof *stats);
+
+   for (i = 0; i < BUFPOOL_NUM_CLASSES; i++) {
+      stats->numHits   += atomic64_read(&bufpool.numHits[i]);
+      stats->numMisses += atomic64_read(&bufpool.numMisses[i]);
+   }
+   stats->numLarge = atomic64_read(&bufpool.numLarge);
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_printstats --
+ *
+ *---------------------------------------------------------------------
+ */
+
+void
+bufpool_printstats(void)
+{
+   struct bufpool_stats stats;
+   int i;
+
+   bufpool_get_stats(&stats);
+   if (stats.numHits + stats.numMisses + stats.numLarge == 0) {
+      return;
+   }
+
+   Log(LGPFX" %llu allocs: %llu hits, %llu misses, %llu large.\n",
+       stats.numHits + stats.numMisses + stats.numLarge,
+       stats.numHits, stats.numMisses, stats.numLarge);
+
+   for (i = 0; i < BUFPOOL_NUM_CLASSES; i++) {
+      uint64 hits   = atomic64_read(&bufpool.numHits[i]);
+      uint64 misses = atomic64_read(&bufpool.numMisses[i]);
+
+      if (hits + misses == 0) {
+         continue;
+      }
+      Log(LGPFX" %7u bytes: %llu hits, %llu misses (%.1f%%)\n",
+          1 << (i + BUFPOOL_MIN_SHIFT), hits, misses,
+          100.0 * hits / (hits + misses));
+   }
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * bufpool_exit --
+ *
+ *      Releases the cache of the calling thread.
+ *
+ *---------------------------------------------------------------------
+ */
+
+void
+bufpool_exit(void)
+{
+   if (bufpool_cache == NULL) {
+      return;
+   }
+   bufpool_printstats();
+   pthread_setspecific(bufpool.key, NULL);
+   bufpool_cache_release(bufpool_cache);
+   bufpool_cache = NULL;
+}
@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 
 #include "basic_defs.h"
 #include "util.h"
@@ -436,6 +437,66 @@ file_pwrite(const struct file_descriptor *desc,
 }
 
 
+/*
+ *---------------------------------------------------------------------------
+ *
+ * file_mmap --
+ *
+ *      Maps 'len' bytes of the file read-only, starting at 'offset' which
+ *      needs to be page aligned. The mapping is shared: it remains valid
+ *      while the file is appended to.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+int
+file_mmap(const struct file_descriptor *desc,
+          uint64 offset,
+          size_t len,
+          void **addr)
+{
+   void *p;
+
+   *addr = NULL;
+
+   p = mmap(NULL, len, PROT_READ, MAP_SHARED, desc->fd, offset);
+   if (p == MAP_FAILED) {
+      int err = errno;
+      Log(LGPFX" failed to mmap %zu bytes of '%s' at off=%llu: %s (%d)\n",
+          len, desc->name, offset, strerror(err), err);
+      return err;
+   }
+   *addr = p;
+   return 0;
+}
+
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * file_munmap --
+ *
+ *---------------------------------------------------------------------------
+ */
+
+void
+file_munmap(void *addr,
+            size_t len)
+{
+   int res;
+
+   if (addr == NULL) {
+      return;
+   }
+   res = munmap(addr, len);
+   if (res != 0) {
+      int err = errno;
+      Warning(LGPFX" failed to munmap %zu bytes at %p: %s (%d)\n",
+              len, addr, strerror(err), err);
+   }
+}
+
+
 /*
  *---------------------------------------------------------------------------
  *
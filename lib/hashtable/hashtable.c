@@ -4,6 +4,7 @@
 #include "basic_defs.h"
 #include "util.h"
 #include "hashtable.h"
+#include "slab.h"
 #include "MurmurHash3.h"
 
 #define LGPFX "HASH:"
@@ -27,11 +28,17 @@ struct hashtable_entry {
 };
 
 
+/*
+ * Tables created with hashtable_create_fixed() only hold keys of 'keyLen'
+ * bytes and get their entries from 'slab'.
+ */
 struct hashtable {
    uint32                   numBuckets;
    uint32                   count;
    uint8                    numBits;
    struct hashtable_entry **buckets;
+   struct slab             *slab;
+   size_t                   keyLen;
 };
 
 
@@ -57,6 +64,9 @@ hashtable_printstats(const struct hashtable *ht,
 
    Log("HASH %s: count=%u maxdepth=%u empty=%u\n",
        pfx, count, depth, empty);
+   if (ht->slab) {
+      slab_printstats(ht->slab);
+   }
 }
 
 
@@ -307,6 +317,26 @@ hashtable_check_resize(struct hashtable *ht)
 }
 
 
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_free_entry --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+hashtable_free_entry(struct hashtable       *ht,
+                     struct hashtable_entry *e)
+{
+   if (ht->slab) {
+      slab_free(ht->slab, e);
+   } else {
+      free(e);
+   }
+}
+
+
 /*
  *---------------------------------------------------------------------
  *
@@ -333,7 +363,12 @@ hashtable_insert(struct hashtable *ht,
       return 0;
    }
 
-   e = safe_malloc(sizeof *e + keyLen);
+   if (ht->slab) {
+      ASSERT(keyLen == ht->keyLen);
+      e = slab_alloc(ht->slab);
+   } else {
+      e = safe_malloc(sizeof *e + keyLen);
+   }
    e->keyLen     = keyLen;
    e->clientData = clientData;
    e->next       = ht->buckets[hash];
@@ -370,6 +405,31 @@ hashtable_create(void)
 }
 
 
+/*
+ *---------------------------------------------------------------------
+ *
+ * hashtable_create_fixed --
+ *
+ *      For large tables with keys of a fixed size: the entries come from a
+ *      slab, and clearing the table without a callback just drops the slab.
+ *
+ *---------------------------------------------------------------------
+ */
+
+struct hashtable *
+hashtable_create_fixed(const char *name,
+                       size_t      keyLen)
+{
+   struct hashtable *ht;
+
+   ht = hashtable_create();
+   ht->keyLen = keyLen;
+   ht->slab = slab_create(name, sizeof(struct hashtable_entry) + keyLen);
+
+   return ht;
+}
+
+
 /*
  *---------------------------------------------------------------------
  *
@@ -413,6 +473,13 @@ hashtable_clear_with_callback(struct hashtable *ht,
 {
    uint32 i;
 
+   if (ht->slab && callback == NULL) {
+      memset(ht->buckets, 0, ht->numBuckets * sizeof *ht->buckets);
+      slab_reset(ht->slab);
+      ht->count = 0;
+      return;
+   }
+
    for (i = 0; i < ht->numBuckets; i++) {
       struct hashtable_entry *e = ht->buckets[i];
       ht->buckets[i] = NULL;
@@ -421,7 +488,7 @@ hashtable_clear_with_callback(struct hashtable *ht,
          if (callback) {
             callback(e->key, e->keyLen, e->clientData);
          }
-         free(e);
+         hashtable_free_entry(ht, e);
          e = next;
          ht->count--;
       }
@@ -489,6 +556,7 @@ hashtable_destroy(struct hashtable *ht)
 {
    ASSERT(ht->count == 0);
    hashtable_clear(ht);
+   slab_destroy(ht->slab);
    free(ht->buckets);
    free(ht);
 }
@@ -530,7 +598,7 @@ hashtable_remove(struct hashtable *ht,
          } else {
             ht->buckets[hash] = e->next;
          }
-         free(e);
+         hashtable_free_entry(ht, e);
          ht->count--;
          return 1;
       }
@@ -4,6 +4,7 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
@@ -11,6 +12,7 @@
 
 #include "basic_defs.h"
 #include "util.h"
+#include "bufpool.h"
 #include "netasync.h"
 #include "poll.h"
 
@@ -19,11 +21,15 @@
 static bool verbose = 0;
 
 static void netasync_receive_cb(void *clientData);
+static void netasync_receive_frames_cb(void *clientData);
 static void netasync_send_ready_cb(void *clientData);
 
 #define CTX_MAGIC       0xcafebabe
 #define SOCK_MAGIC      0xdeadbeef
 
+#define NETASYNC_FRAME_BUF_SIZE   (64 * 1024)
+#define NETASYNC_SEND_IOV         64
+
 struct netasync_send_ctx {
    uint64                    magic;
    const void               *buf_orig;
@@ -77,8 +83,22 @@ struct netasync_socket {
    void                      *recvCbData;
    bool                       recvPartial;
 
+   /*
+    * Framed receive: bytes read ahead of the consumer, handed out one
+    * complete frame at a time straight from this buffer.
+    */
+   bool                       recvFrames;
+   uint8                     *frameBuf;
+   size_t                     frameBufSize;
+   size_t                     frameBufLen;
+   size_t                     frameHdrLen;
+   netasync_frame_fun        *frameLenCb;
+   bool                       dispatching;
+   bool                       closed;
+
    struct netasync_send_ctx  *sendCtxList;
    struct netasync_send_ctx **sendCtxTail;
+   size_t                     sendQueued;   /* bytes not yet written */
 };
 
 
@@ -87,6 +107,10 @@ static struct {
    uint64            received;
    uint64            sent;
    uint32            sockets;
+   uint64            numFrameReads;
+   uint64            numFrames;
+   uint64            numSends;
+   uint64            numWrites;
 } netasync;
 
 
@@ -166,6 +190,14 @@ netasync_exit(void)
       Log(LGPFX" %u socks -- %llu / %s received -- %llu / %s sent.\n",
           netasync.sockets, netasync.received, s0, netasync.sent, s1);
    }
+   if (netasync.numFrames > 0) {
+      Log(LGPFX" %llu frames received in %llu reads.\n",
+          netasync.numFrames, netasync.numFrameReads);
+   }
+   if (netasync.numSends > 0) {
+      Log(LGPFX" %llu buffers sent in %llu writes.\n",
+          netasync.numSends, netasync.numWrites);
+   }
    free(s0);
    free(s1);
 }
@@ -288,7 +320,9 @@ netasync_receive_stop(struct netasync_socket *sock)
                                1 /* read */,
                                0 /* write */,
                                1 /* permanent */,
-                               netasync_receive_cb, sock);
+                               sock->recvFrames ? netasync_receive_frames_cb
+                                                : netasync_receive_cb,
+                               sock);
 }
 
 
@@ -309,6 +343,10 @@ netasync_receive_reset(struct netasync_socket *sock)
    sock->recvCb      = NULL;
    sock->recvCbData  = 0;
    sock->recvPartial = 0; // XXX
+   sock->recvFrames  = 0;
+   sock->frameLenCb  = NULL;
+   sock->frameHdrLen = 0;
+   sock->frameBufLen = 0;
 }
 
 
@@ -604,7 +642,7 @@ netasync_socks_handler(struct netasync_socket *sock)
 
    switch (sock->socks_state) {
    case SOCKS_CONNECTING_PROXY:
-      buf = safe_malloc(3);
+      buf = bufpool_alloc(3);
       buf[0] = 5; // version 5
       buf[1] = 1; // just one authentication method
       buf[2] = 0; // no-auth
@@ -626,7 +664,7 @@ netasync_socks_handler(struct netasync_socket *sock)
       }
 
       slen = sizeof sock->socksAddr.sin_addr;
-      buf = safe_malloc(6 + slen);
+      buf = bufpool_alloc(6 + slen);
 
       buf[0] = 5; // socks v5
       buf[1] = 1; // establish tcp/ip connection
@@ -1062,70 +1100,303 @@ netasync_receive(struct netasync_socket *sock,
 /*
  *-------------------------------------------------------------------------
  *
- * netasync_send_ctx --
+ * netasync_free --
  *
  *-------------------------------------------------------------------------
  */
 
 static void
-netasync_send_ctx(struct netasync_socket   *sock,
-                  struct netasync_send_ctx *ctx)
+netasync_free(struct netasync_socket *sock)
 {
-   ssize_t res;
+   free(sock->frameBuf);
+   memset(sock, 0xff, sizeof *sock);
+   free(sock);
+}
 
-   ASSERT(sock->magic == SOCK_MAGIC);
-   ASSERT(ctx);
-   ASSERT(sock->err == 0);
 
-   static int count;
-   count++;
-   if ((count % 37) == 0) {
-      NOT_TESTED_ONCE();
-      res = 0;
-      goto next;
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_dispatch_frames --
+ *
+ *      Hands every complete frame in the buffer to the receive callback,
+ *      then moves the leftover partial frame to the front. Returns TRUE if
+ *      a callback closed the socket, which is then gone.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static bool
+netasync_dispatch_frames(struct netasync_socket *sock)
+{
+   size_t off = 0;
+
+   sock->dispatching = 1;
+
+   while (sock->recvFrames &&
+          sock->frameBufLen - off >= sock->frameHdrLen) {
+      uint8 *frame = sock->frameBuf + off;
+      size_t frameLen;
+
+      frameLen = sock->frameLenCb(frame, sock->recvCbData);
+      ASSERT(frameLen >= sock->frameHdrLen);
+
+      if (frameLen > sock->frameBufLen - off) {
+         if (frameLen > sock->frameBufSize) {
+            LOG(1, (LGPFX" %s: growing frame buffer to %zu.\n",
+                    sock->hostname, frameLen));
+            memmove(sock->frameBuf, frame, sock->frameBufLen - off);
+            sock->frameBufLen -= off;
+            off = 0;
+            sock->frameBufSize = frameLen;
+            sock->frameBuf = safe_realloc(sock->frameBuf, frameLen);
+         }
+         break;
+      }
+
+      off += frameLen;
+      netasync.numFrames++;
+      sock->recvCb(sock, frame, frameLen, sock->recvCbData);
+      if (sock->closed) {
+         break;
+      }
    }
 
-   res = write(sock->fd, ctx->buf, ctx->len);
-   if (res == -1 && errno == EAGAIN) {
-      NOT_TESTED_ONCE();
-      res = 0;
+   sock->dispatching = 0;
+
+   if (sock->closed) {
+      netasync_free(sock);
+      return TRUE;
    }
-next:
-   if (res < 0) {
-      sock->err = errno;
-      Warning(LGPFX" %s: write(2) failed: %s (%d).\n",
-              sock->hostname, strerror(sock->err), sock->err);
-      print_backtrace();
-      ASSERT(sock->err != EBADF);
-      netasync_fire_errorhandler(sock);
-      return;
-   } else {
-      ctx->buf = (uint8*)ctx->buf + res;
-      ctx->len -= res;
-      netasync.sent += res;
+   if (off > 0) {
+      memmove(sock->frameBuf, sock->frameBuf + off, sock->frameBufLen - off);
+      sock->frameBufLen -= off;
    }
+   return FALSE;
+}
+
 
-   if (ctx->len == 0 || sock->err != 0) {
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_receive_frames_cb --
+ *
+ *      Reads as much as the buffer holds, and keeps going as long as the
+ *      socket fills it.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+netasync_receive_frames_cb(void *clientData)
+{
+   struct netasync_socket *sock = clientData;
+
+   ASSERT(sock->magic == SOCK_MAGIC);
+   ASSERT(sock->recvFrames);
+
+   while (sock->recvFrames) {
+      size_t avail = sock->frameBufSize - sock->frameBufLen;
+      ssize_t len;
+
+      ASSERT(avail > 0);
+
+      len = read(sock->fd, sock->frameBuf + sock->frameBufLen, avail);
+      if (len < 0) {
+         int res = errno;
+         if (res == EAGAIN) {
+            return;
+         }
+         sock->err = res;
+         Log(LGPFX" %s: failed to read: %s (%d)\n",
+             sock->hostname, strerror(res), res);
+         netasync_fire_errorhandler(sock);
+         return;
+      }
+      if (len == 0) {
+         int err = netasync_getsocket_errno(sock);
+         Log(LGPFX" %s: socket closed by peer: %s (%d)\n",
+             sock->hostname, strerror(err), err);
+         netasync_fire_errorhandler(sock);
+         return;
+      }
+      sock->frameBufLen += len;
+      netasync.received += len;
+      netasync.numFrameReads++;
+
+      if (netasync_dispatch_frames(sock)) {
+         return;
+      }
+      if (len < avail) {
+         return;
+      }
+   }
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_receive_frames --
+ *
+ *      Receives a stream of frames made of a 'hdrLen' header that tells
+ *      'frameLen' how long the whole frame is. Each complete frame is passed
+ *      to 'cb' in place: it is only valid for the duration of the call. This
+ *      stays armed until the socket is closed.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+int
+netasync_receive_frames(struct netasync_socket *sock,
+                        size_t                  hdrLen,
+                        netasync_frame_fun     *frameLen,
+                        netasync_recv_callback *cb,
+                        void                   *clientData)
+{
+   ASSERT(sock->magic == SOCK_MAGIC);
+   ASSERT(sock->err == 0);
+   ASSERT(sock->recvCb == NULL);
+   ASSERT(hdrLen > 0 && hdrLen <= NETASYNC_FRAME_BUF_SIZE);
+
+   LOG(1, (LGPFX" Receiving frames on s=%p fd=%d\n", sock, sock->fd));
+
+   if (sock->frameBuf == NULL) {
+      sock->frameBufSize = NETASYNC_FRAME_BUF_SIZE;
+      sock->frameBuf     = safe_malloc(sock->frameBufSize);
+   }
+   sock->frameBufLen = 0;
+   sock->frameHdrLen = hdrLen;
+   sock->frameLenCb  = frameLen;
+   sock->recvCb      = cb;
+   sock->recvCbData  = clientData;
+   sock->recvFrames  = 1;
+
+   poll_callback_device(netasync.poll, sock->fd,
+                        1,  /* read */
+                        0,  /* !write */
+                        1,  /* permanent */
+                        netasync_receive_frames_cb, sock);
+   return 0;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_send_complete --
+ *
+ *      Fires, in order, the callbacks of the buffers at the head of the
+ *      queue that have been fully written. Returns TRUE if a callback
+ *      closed the socket, which is then gone.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static bool
+netasync_send_complete(struct netasync_socket *sock)
+{
+   struct netasync_send_ctx *ctx;
+
+   sock->dispatching = 1;
+
+   while ((ctx = sock->sendCtxList) != NULL && ctx->len == 0) {
       netasync_callback *callback   = ctx->callback;
       void              *clientData = ctx->clientData;
 
-      ASSERT(ctx->callback);
+      ASSERT(ctx->magic == CTX_MAGIC);
+      ASSERT(callback);
 
       sock->sendCtxList = ctx->next;
-      ctx->magic = -1;
-      free((void*)ctx->buf_orig);
-      free(ctx);
       if (sock->sendCtxList == NULL) {
          sock->sendCtxTail = &sock->sendCtxList;
       }
+      ctx->magic = -1;
+      bufpool_free((void*)ctx->buf_orig);
+      free(ctx);
 
-      ctx = sock->sendCtxList;
-      callback(sock, clientData, sock->err);
+      callback(sock, clientData, 0);
+      if (sock->closed) {
+         break;
+      }
+   }
+
+   sock->dispatching = 0;
+
+   if (sock->closed) {
+      netasync_free(sock);
+      return TRUE;
    }
+   return FALSE;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * netasync_send_flush --
+ *
+ *      Writes as much of the queue as the socket takes with a single
+ *      writev(2).
+ *
+ *-------------------------------------------------------------------------
+ */
 
+static void
+netasync_send_flush(struct netasync_socket *sock)
+{
+   struct iovec iov[NETASYNC_SEND_IOV];
+   struct netasync_send_ctx *ctx;
+   ssize_t res;
+   int n = 0;
+
+   ASSERT(sock->magic == SOCK_MAGIC);
    ASSERT(sock->err == 0);
-   if (ctx) {
+
+   for (ctx = sock->sendCtxList; ctx && n < ARRAYSIZE(iov); ctx = ctx->next) {
       ASSERT(ctx->magic == CTX_MAGIC);
+      if (ctx->len == 0) {
+         continue;
+      }
+      iov[n].iov_base = (void *)ctx->buf;
+      iov[n].iov_len  = ctx->len;
+      n++;
+   }
+
+   if (n > 0) {
+      res = writev(sock->fd, iov, n);
+      if (res == -1 && errno == EAGAIN) {
+         NOT_TESTED_ONCE();
+         res = 0;
+      }
+      if (res < 0) {
+         sock->err = errno;
+         Warning(LGPFX" %s: writev(2) failed: %s (%d).\n",
+                 sock->hostname, strerror(sock->err), sock->err);
+         print_backtrace();
+         ASSERT(sock->err != EBADF);
+         netasync_fire_errorhandler(sock);
+         return;
+      }
+      netasync.sent += res;
+      netasync.numWrites++;
+      sock->sendQueued -= res;
+
+      for (ctx = sock->sendCtxList; ctx && res > 0; ctx = ctx->next) {
+         size_t len = MIN(ctx->len, (size_t)res);
+
+         ctx->buf = (uint8*)ctx->buf + len;
+         ctx->len -= len;
+         res -= len;
+      }
+   }
+
+   if (netasync_send_complete(sock)) {
+      return;
+   }
+
+   ASSERT(sock->err == 0);
+   if (sock->sendCtxList) {
       poll_callback_device(netasync.poll, sock->fd,
                            0,  /* read */
                            1,  /* write */
@@ -1151,7 +1422,7 @@ netasync_send_ready_cb(void *clientData)
    ASSERT(sock->sendCtxList->magic == CTX_MAGIC);
    ASSERT(sock->magic == SOCK_MAGIC);
 
-   netasync_send_ctx(sock, sock->sendCtxList);
+   netasync_send_flush(sock);
 }
 
 
@@ -1196,13 +1467,26 @@ netasync_send(struct netasync_socket *sock,
 
    *sock->sendCtxTail = ctx;
    sock->sendCtxTail = &ctx->next;
+   netasync.numSends++;
 
-   if (newSend) {
+   if (sock->sendQueued == 0) {
       /*
-       * Yeah, not exactly ideal, but this avoids having to implement some sort
-       * of ref-counting scheme so that'll have to do for now.
+       * Nothing unsent ahead of us: try the write right away. Errors are
+       * left for the write callback to hit again, and completion callbacks
+       * always fire from the loop, so the caller is never re-entered.
        */
-      //netasync_send_ctx(sock, ctx);
+      ssize_t res = write(sock->fd, buf, len);
+
+      if (res > 0) {
+         ctx->buf = (uint8*)ctx->buf + res;
+         ctx->len -= res;
+         netasync.sent += res;
+      }
+      netasync.numWrites++;
+   }
+   sock->sendQueued += ctx->len;
+
+   if (newSend) {
       poll_callback_device(netasync.poll, sock->fd,
                            0,  /* read */
                            1,  /* write */
@@ -1230,7 +1514,7 @@ netasync_free_send_buf(struct netasync_socket *sock)
    while (ctx) {
       struct netasync_send_ctx *next = ctx->next;
 
-      free((void*)ctx->buf_orig);
+      bufpool_free((void*)ctx->buf_orig);
       memset(ctx, 0xff, sizeof *ctx);
       free(ctx);
       ctx = next;
@@ -1306,6 +1590,15 @@ netasync_close(struct netasync_socket *sock)
    }
    free(sock->hostname);
    free(sock->socksHostname);
-   memset(sock, 0xff, sizeof *sock);
-   free(sock);
+   sock->hostname = NULL;
+   sock->socksHostname = NULL;
+
+   if (sock->dispatching) {
+      /*
+       * Closed from a receive or send callback: the dispatch loop frees it.
+       */
+      sock->closed = 1;
+      return;
+   }
+   netasync_free(sock);
 }
@@ -7,6 +7,9 @@
 #include <sys/poll.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#ifdef linux
+#include <sys/epoll.h>
+#endif
 
 #include "basic_defs.h"
 #include "util.h"
@@ -16,6 +19,10 @@
 
 #define LGPFX   "POLL:"
 
+#define POLL_EV_RD              0x1
+#define POLL_EV_WR              0x2
+#define POLL_EPOLL_MAX_EVENTS   256
+
 static int verbose = 0;
 
 struct poll_entry {
@@ -34,8 +41,11 @@ struct poll_entry {
          bool           writeable;
       } d;
       struct {
-         mtime_t        expiry;
-         mtime_t        delay;
+         mtime_t            expiry;
+         mtime_t            delay;
+         uint64             seq;
+         int                heapIdx;
+         struct poll_entry *next;   /* same callback, data & permanence */
       } t;
    } u;
 };
@@ -43,8 +53,37 @@ struct poll_entry {
 #define GET_ENTRY(_li) \
       CIRCLIST_CONTAINER((_li), struct poll_entry, item);
 
+/*
+ * epoll keeps the interest set in the kernel: we track per fd how many
+ * entries want to read or write, and only tell the kernel when the
+ * combined interest of the fd changes.
+ */
+struct poll_fd_state {
+   uint16                  numRd;
+   uint16                  numWr;
+   uint8                   registered;  /* POLL_EV_* known to the kernel */
+   uint8                   ready;       /* POLL_EV_* from last epoll_wait */
+   bool                    dirty;
+};
+
+/*
+ * Time entries are kept in a binary min-heap ordered by expiry, ties broken
+ * by insertion order, and hashed by callback so that they can be removed
+ * without a scan.
+ */
+struct poll_time_key {
+   pollcallback_fun       *callback;
+   void                   *callbackData;
+   uint64                  permanent;
+};
+
 struct poll_loop {
-   struct circlist_item   *list_time;
+   struct poll_entry     **heap_time;
+   int                     heap_len;
+   int                     heap_size;
+   uint64                  time_seq;
+   struct hashtable       *hash_time;
+
    struct circlist_item   *list_device;
    struct circlist_item   *list_free;
 
@@ -56,35 +95,16 @@ struct poll_loop {
    size_t                  poll_max_fds;
    struct pollfd          *poll_fds;
 
-   bool                    use_poll;
-};
-
-
-/*
- *-------------------------------------------------------------------------
- *
- * poll_check_time_queue_order --
- *
- *      This assumes that only a single function will register for
- *      notifications on an fd.
- *
- *-------------------------------------------------------------------------
- */
-
-static void
-poll_check_time_queue_order(const struct poll_loop *poll)
-{
-   struct circlist_item *li;
-   mtime_t last = 0;
-
-   ASSERT(poll);
+   enum poll_backend       backend;
 
-   CIRCLIST_SCAN(li, poll->list_time) {
-      struct poll_entry *e = GET_ENTRY(li);
-      ASSERT(last <= e->u.t.expiry);
-      last = e->u.t.expiry;
-   }
-}
+   int                     epfd;
+   struct poll_fd_state   *fd_state;
+   int                    *fd_dirty;
+   int                     num_dirty;
+   int                    *fd_ready;
+   int                     num_ready;
+   uint64                  num_ctl;
+};
 
 
 /*
@@ -228,6 +248,125 @@ poll_entry_unref(struct poll_loop *poll,
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_epoll_sync_fd --
+ *
+ *      Pushes the combined read/write interest of 'fd' to the kernel if it
+ *      differs from what was last registered.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_epoll_sync_fd(struct poll_loop *poll,
+                   int fd)
+{
+#ifdef linux
+   struct poll_fd_state *st = poll->fd_state + fd;
+   struct epoll_event ev;
+   uint8 wanted = 0;
+   int op;
+   int res;
+
+   if (st->numRd > 0) {
+      wanted |= POLL_EV_RD;
+   }
+   if (st->numWr > 0) {
+      wanted |= POLL_EV_WR;
+   }
+   if (wanted == st->registered) {
+      return;
+   }
+
+   memset(&ev, 0, sizeof ev);
+   ev.data.fd = fd;
+   ev.events  = ((wanted & POLL_EV_RD) ? EPOLLIN  : 0) |
+                ((wanted & POLL_EV_WR) ? EPOLLOUT : 0);
+
+   if (st->registered == 0) {
+      op = EPOLL_CTL_ADD;
+   } else if (wanted == 0) {
+      op = EPOLL_CTL_DEL;
+   } else {
+      op = EPOLL_CTL_MOD;
+   }
+
+   res = epoll_ctl(poll->epfd, op, fd, &ev);
+   if (res != 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+      /*
+       * The fd was closed and its number reused without its callbacks
+       * being removed first: the kernel already forgot about it.
+       */
+      op = EPOLL_CTL_ADD;
+      res = epoll_ctl(poll->epfd, op, fd, &ev);
+   }
+   if (res != 0 && op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF)) {
+      res = 0;
+   }
+   if (res != 0) {
+      res = errno;
+      Warning(LGPFX" epoll_ctl(%d) failed on fd=%d: %s (%d)\n",
+              op, fd, strerror(res), res);
+      return;
+   }
+   st->registered = wanted;
+   poll->num_ctl++;
+#else
+   NOT_REACHED();
+#endif
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_epoll_account --
+ *
+ *      Adjusts the interest counts of the fd of 'e'. Changes are applied
+ *      lazily before the next epoll_wait so that a callback dropped and
+ *      re-armed from within the loop costs no system call. An fd losing
+ *      all its callbacks is unregistered right away, as it may be closed
+ *      and reused before then.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_epoll_account(struct poll_loop *poll,
+                   const struct poll_entry *e,
+                   int delta)
+{
+   struct poll_fd_state *st;
+   int fd = e->u.d.fd;
+
+   if (poll->backend != POLL_BACKEND_EPOLL) {
+      return;
+   }
+
+   ASSERT(fd >= 0);
+   ASSERT(fd < poll->poll_max_fds);
+
+   st = poll->fd_state + fd;
+   if (e->u.d.readable) {
+      st->numRd += delta;
+   }
+   if (e->u.d.writeable) {
+      st->numWr += delta;
+   }
+
+   if (st->numRd == 0 && st->numWr == 0) {
+      poll_epoll_sync_fd(poll, fd);
+      return;
+   }
+   if (st->dirty == 0) {
+      st->dirty = 1;
+      poll->fd_dirty[poll->num_dirty++] = fd;
+   }
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -248,6 +387,8 @@ poll_entry_remove_from_hashtable(struct poll_loop *poll,
 
    s = hashtable_remove(poll->hash, &key, sizeof key);
    ASSERT(s);
+
+   poll_epoll_account(poll, e, -1);
 }
 
 
@@ -298,6 +439,104 @@ poll_free_entries_on_list(struct poll_loop *poll,
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_time_before --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static bool
+poll_time_before(const struct poll_entry *a,
+                 const struct poll_entry *b)
+{
+   if (a->u.t.expiry != b->u.t.expiry) {
+      return a->u.t.expiry < b->u.t.expiry;
+   }
+   return a->u.t.seq < b->u.t.seq;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_heap_set --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_heap_set(struct poll_loop *poll,
+              int idx,
+              struct poll_entry *e)
+{
+   poll->heap_time[idx] = e;
+   e->u.t.heapIdx = idx;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_heap_sift_up --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_heap_sift_up(struct poll_loop *poll,
+                  int idx)
+{
+   struct poll_entry *e = poll->heap_time[idx];
+
+   while (idx > 0) {
+      int parent = (idx - 1) / 2;
+
+      if (!poll_time_before(e, poll->heap_time[parent])) {
+         break;
+      }
+      poll_heap_set(poll, idx, poll->heap_time[parent]);
+      idx = parent;
+   }
+   poll_heap_set(poll, idx, e);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_heap_sift_down --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_heap_sift_down(struct poll_loop *poll,
+                    int idx)
+{
+   struct poll_entry *e = poll->heap_time[idx];
+
+   while (1) {
+      int child = 2 * idx + 1;
+
+      if (child >= poll->heap_len) {
+         break;
+      }
+      if (child + 1 < poll->heap_len &&
+          poll_time_before(poll->heap_time[child + 1], poll->heap_time[child])) {
+         child++;
+      }
+      if (!poll_time_before(poll->heap_time[child], e)) {
+         break;
+      }
+      poll_heap_set(poll, idx, poll->heap_time[child]);
+      idx = child;
+   }
+   poll_heap_set(poll, idx, e);
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -310,45 +549,148 @@ static void
 poll_insert_time(struct poll_loop *poll,
 		 struct poll_entry *entry)
 {
-   static int count;
    ASSERT(poll && entry);
    ASSERT(entry->type == POLL_CB_TIME);
    ASSERT(entry->refCount > 0);
+   ASSERT(entry->u.t.heapIdx == -1);
 
    entry->queued = 1;
+   entry->u.t.seq = poll->time_seq++;
+
+   if (poll->heap_len == poll->heap_size) {
+      poll->heap_size = MAX(16, poll->heap_size * 2);
+      poll->heap_time = safe_realloc(poll->heap_time,
+                                     poll->heap_size * sizeof *poll->heap_time);
+   }
+   poll_heap_set(poll, poll->heap_len++, entry);
+   poll_heap_sift_up(poll, entry->u.t.heapIdx);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_dequeue_time --
+ *
+ *-------------------------------------------------------------------------
+ */
 
-   if (circlist_empty(poll->list_time)) {
-      circlist_queue_item(&poll->list_time, &entry->item);
+static void
+poll_dequeue_time(struct poll_loop *poll,
+                  struct poll_entry *e)
+{
+   int idx = e->u.t.heapIdx;
+   struct poll_entry *last;
+
+   ASSERT(e->type == POLL_CB_TIME);
+   ASSERT(idx >= 0 && idx < poll->heap_len);
+   ASSERT(poll->heap_time[idx] == e);
+
+   e->u.t.heapIdx = -1;
+   last = poll->heap_time[--poll->heap_len];
+   if (last == e) {
+      return;
+   }
+   poll_heap_set(poll, idx, last);
+   if (idx > 0 && poll_time_before(last, poll->heap_time[(idx - 1) / 2])) {
+      poll_heap_sift_up(poll, idx);
    } else {
-      struct circlist_item *li;
-      struct poll_entry *e;
-      bool done = 0;
+      poll_heap_sift_down(poll, idx);
+   }
+}
 
-      e = GET_ENTRY(poll->list_time);
-      if (entry->u.t.expiry < e->u.t.expiry) {
-         circlist_push_item(&poll->list_time, &entry->item);
-      } else {
-         CIRCLIST_SCAN(li, poll->list_time) {
-            e = GET_ENTRY(li);
 
-            if (entry->u.t.expiry < e->u.t.expiry) {
-               circlist_queue_item(&li, &entry->item);
-               done = 1;
-               break;
-            }
-         }
-         if (done == 0) {
-            circlist_queue_item(&poll->list_time, &entry->item);
-         }
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_get_time_key --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_get_time_key(pollcallback_fun *callback,
+                  void *callbackData,
+                  bool permanent,
+                  struct poll_time_key *key)
+{
+   memset(key, 0, sizeof *key);
+   key->callback     = callback;
+   key->callbackData = callbackData;
+   key->permanent    = permanent != 0;
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_time_hash_insert --
+ *
+ *      Registering the same callback twice is allowed: entries sharing a
+ *      key are chained behind the one in the hashtable.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_time_hash_insert(struct poll_loop *poll,
+                      struct poll_entry *e)
+{
+   struct poll_time_key key;
+   struct poll_entry *head = NULL;
+   bool s;
+
+   poll_get_time_key(e->callback, e->callbackData, e->permanent, &key);
+   e->u.t.next = NULL;
+
+   if (hashtable_lookup(poll->hash_time, &key, sizeof key, (void *)&head)) {
+      while (head->u.t.next) {
+         head = head->u.t.next;
       }
+      head->u.t.next = e;
+      return;
    }
-   /*
-    * Check the order of the time queue once in a while.
-    */
-   count++;
-   if ((count % 32) == 0) {
-      poll_check_time_queue_order(poll);
+   s = hashtable_insert(poll->hash_time, &key, sizeof key, e);
+   ASSERT(s);
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_time_hash_remove --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_time_hash_remove(struct poll_loop *poll,
+                      struct poll_entry *e)
+{
+   struct poll_time_key key;
+   struct poll_entry *head = NULL;
+   bool s;
+
+   poll_get_time_key(e->callback, e->callbackData, e->permanent, &key);
+
+   s = hashtable_lookup(poll->hash_time, &key, sizeof key, (void *)&head);
+   ASSERT(s);
+
+   if (head == e) {
+      s = hashtable_remove(poll->hash_time, &key, sizeof key);
+      ASSERT(s);
+      if (e->u.t.next) {
+         s = hashtable_insert(poll->hash_time, &key, sizeof key, e->u.t.next);
+         ASSERT(s);
+      }
+   } else {
+      while (head->u.t.next != e) {
+         head = head->u.t.next;
+         ASSERT(head);
+      }
+      head->u.t.next = e->u.t.next;
    }
+   e->u.t.next = NULL;
 }
 
 
@@ -378,43 +720,110 @@ poll_get_max_fds(void)
 /*
  *-------------------------------------------------------------------------
  *
- * poll_create --
+ * poll_backend_name --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static const char *
+poll_backend_name(enum poll_backend backend)
+{
+   switch (backend) {
+   case POLL_BACKEND_SELECT: return "select";
+   case POLL_BACKEND_POLL:   return "poll";
+   case POLL_BACKEND_EPOLL:  return "epoll";
+   default:                  return "default";
+   }
+}
+
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_create_backend --
+ *
+ *      Creates a loop waiting on its devices with 'backend'. The default is
+ *      epoll where available, poll(2) otherwise.
  *
  *-------------------------------------------------------------------------
  */
 
 struct poll_loop *
-poll_create(void)
+poll_create_backend(enum poll_backend backend)
 {
    struct poll_loop *poll;
 
-   poll = safe_malloc(sizeof *poll);
+   poll = safe_calloc(1, sizeof *poll);
 
    FD_ZERO(&poll->fds_rd);
    FD_ZERO(&poll->fds_wr);
 
    poll->list_free       = NULL;
    poll->list_device     = NULL;
-   poll->list_time       = NULL;
-   poll->use_poll        = 1;
+   poll->heap_time       = NULL;
+   poll->epfd            = -1;
+
+   if (backend == POLL_BACKEND_DEFAULT) {
+#ifdef linux
+      backend = POLL_BACKEND_EPOLL;
+#else
+      backend = POLL_BACKEND_POLL;
+#endif
+   }
 
-#ifdef __APPLE__
-   poll->use_poll     = 1; // XXX
+#ifdef linux
+   if (backend == POLL_BACKEND_EPOLL) {
+      poll->epfd = epoll_create1(EPOLL_CLOEXEC);
+      if (poll->epfd < 0) {
+         int err = errno;
+         Warning(LGPFX" epoll_create1 failed: %s (%d)\n", strerror(err), err);
+         backend = POLL_BACKEND_POLL;
+      }
+   }
+#else
+   if (backend == POLL_BACKEND_EPOLL) {
+      Warning(LGPFX" epoll not supported on this platform.\n");
+      backend = POLL_BACKEND_POLL;
+   }
 #endif
+
+   poll->backend      = backend;
    poll->poll_fds     = NULL;
    poll->poll_max_fds = poll_get_max_fds();
-   Log(LGPFX" using poll_max_fds=%zu\n", poll->poll_max_fds);
+   Log(LGPFX" using %s backend, poll_max_fds=%zu\n",
+       poll_backend_name(poll->backend), poll->poll_max_fds);
 
    poll->hash = hashtable_create();
+   poll->hash_time = hashtable_create_fixed("poll_time",
+                                            sizeof(struct poll_time_key));
 
-   if (poll->use_poll) {
+   if (poll->backend == POLL_BACKEND_POLL) {
       poll->poll_fds = safe_malloc(poll->poll_max_fds * sizeof(struct pollfd));
+   } else if (poll->backend == POLL_BACKEND_EPOLL) {
+      poll->fd_state = safe_calloc(poll->poll_max_fds, sizeof *poll->fd_state);
+      poll->fd_dirty = safe_malloc(poll->poll_max_fds * sizeof(int));
+      poll->fd_ready = safe_malloc(POLL_EPOLL_MAX_EVENTS * sizeof(int));
    }
 
    return poll;
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_create --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+struct poll_loop *
+poll_create(void)
+{
+   return poll_create_backend(POLL_BACKEND_DEFAULT);
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -427,17 +836,27 @@ void
 poll_destroy(struct poll_loop *poll)
 {
    ASSERT(poll->list_device == NULL);
-   ASSERT(poll->list_time == NULL);
+   ASSERT(poll->heap_len == 0);
 
    poll_free_entries_on_list(poll, &poll->list_free);
    poll_free_entries_on_list(poll, &poll->list_device);
-   poll_free_entries_on_list(poll, &poll->list_time);
 
    hashtable_destroy(poll->hash);
    poll->hash = NULL;
+   hashtable_destroy(poll->hash_time);
+   poll->hash_time = NULL;
+   free(poll->heap_time);
 
    free(poll->poll_fds);
 
+   if (poll->backend == POLL_BACKEND_EPOLL) {
+      Log(LGPFX" epoll: %llu interest changes.\n", poll->num_ctl);
+      close(poll->epfd);
+      free(poll->fd_state);
+      free(poll->fd_dirty);
+      free(poll->fd_ready);
+   }
+
    FD_ZERO(&poll->fds_rd);
    FD_ZERO(&poll->fds_wr);
 
@@ -445,6 +864,29 @@ poll_destroy(struct poll_loop *poll)
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_get_timeout_msec --
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+poll_get_timeout_msec(mtime_t deadline)
+{
+   mtime_t now = time_get();
+
+   if (deadline == 0) {
+      return 1000; // Wake up once per sec
+   } else if (deadline <= now) {
+      return 0;
+   } else {
+      return (deadline - now) / 1000;
+   }
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -488,16 +930,7 @@ poll_device_poll(struct poll_loop *spoll,
    }
 
    do {
-      mtime_t now = time_get();
-      int timeoutMsec;
-
-      if (deadline == 0) {
-         timeoutMsec = 1000; // Wake up once per sec
-      } else if (deadline <= now) {
-         timeoutMsec = 0;
-      } else {
-         timeoutMsec = (deadline - now) / 1000;
-      }
+      int timeoutMsec = poll_get_timeout_msec(deadline);
 
       LOG(1, (LGPFX" sleeping for %u msec n=%u\n", timeoutMsec, n));
       s = poll(poll_fds, n, timeoutMsec);
@@ -594,6 +1027,73 @@ poll_device_select(struct poll_loop *poll,
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_device_epoll --
+ *
+ *      Flushes the pending interest changes, then waits. Only the fds that
+ *      had activity are recorded: nothing here depends on the number of
+ *      registered devices.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+poll_device_epoll(struct poll_loop *poll,
+                  mtime_t deadline)
+{
+#ifdef linux
+   struct epoll_event events[POLL_EPOLL_MAX_EVENTS];
+   int i;
+   int s;
+
+   for (i = 0; i < poll->num_dirty; i++) {
+      int fd = poll->fd_dirty[i];
+
+      poll->fd_state[fd].dirty = 0;
+      poll_epoll_sync_fd(poll, fd);
+   }
+   poll->num_dirty = 0;
+
+   do {
+      int timeoutMsec = poll_get_timeout_msec(deadline);
+
+      LOG(1, (LGPFX" sleeping for %u msec\n", timeoutMsec));
+      s = epoll_wait(poll->epfd, events, ARRAYSIZE(events), timeoutMsec);
+   } while (s == -1 && errno == EINTR);
+
+   if (s == -1) {
+      s = errno;
+      Warning(LGPFX" Failed to epoll_wait(2): %s (%d)\n", strerror(s), s);
+      NOT_REACHED();
+   }
+
+   poll->num_ready = 0;
+
+   for (i = 0; i < s; i++) {
+      int fd = events[i].data.fd;
+      uint8 ready = 0;
+
+      /*
+       * Errors and hang-ups are reported regardless of interest: let the
+       * callbacks find out through read/write, as with poll(2).
+       */
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+         ready |= POLL_EV_RD;
+      }
+      if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+         ready |= POLL_EV_WR;
+      }
+      poll->fd_state[fd].ready = ready;
+      poll->fd_ready[poll->num_ready++] = fd;
+   }
+#else
+   NOT_REACHED();
+#endif
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -609,10 +1109,10 @@ poll_get_next_expiry(const struct poll_loop *poll)
 
    ASSERT(poll);
 
-   if (circlist_empty(poll->list_time)) {
+   if (poll->heap_len == 0) {
       return 0;
    }
-   e = GET_ENTRY(poll->list_time);
+   e = poll->heap_time[0];
    return e->u.t.expiry;
 }
 
@@ -658,7 +1158,7 @@ static bool
 poll_entry_active(const struct poll_loop *poll,
                   const struct poll_entry *e)
 {
-   if (poll->use_poll) {
+   if (poll->backend == POLL_BACKEND_POLL) {
       int idx = e->u.d.idx;
 
       ASSERT(idx < poll->poll_max_fds);
@@ -673,6 +1173,60 @@ poll_entry_active(const struct poll_loop *poll,
 }
 
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * poll_epoll_collect --
+ *
+ *      Looks up the entries registered on each fd epoll reported, rather
+ *      than scanning the whole device list.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+poll_epoll_collect(struct poll_loop *poll,
+                   struct poll_entry **queue)
+{
+   static const uint8 interest[] = {
+      POLL_EV_RD, POLL_EV_WR, POLL_EV_RD | POLL_EV_WR
+   };
+   int n = 0;
+   int i;
+
+   for (i = 0; i < poll->num_ready; i++) {
+      int fd = poll->fd_ready[i];
+      struct poll_fd_state *st = poll->fd_state + fd;
+      int j;
+
+      for (j = 0; j < ARRAYSIZE(interest); j++) {
+         bool read  = (interest[j] & POLL_EV_RD) != 0;
+         bool write = (interest[j] & POLL_EV_WR) != 0;
+         int permanent;
+
+         if ((st->ready & interest[j]) == 0) {
+            continue;
+         }
+         for (permanent = 0; permanent <= 1; permanent++) {
+            struct poll_entry *e = NULL;
+            uint64 key;
+
+            key = poll_get_device_key(fd, read, write, permanent);
+            if (hashtable_lookup(poll->hash, &key, sizeof key, (void *)&e)) {
+               ASSERT(e->type == POLL_CB_DEVICE);
+               queue[n++] = e;
+               poll_entry_ref(e);
+            }
+         }
+      }
+      st->ready = 0;
+   }
+   poll->num_ready = 0;
+
+   return n;
+}
+
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -695,14 +1249,18 @@ poll_run_device_queue(struct poll_loop *poll)
     * each entry and take a reference on each entry.
     */
 
-   CIRCLIST_SCAN(li, poll->list_device) {
-      struct poll_entry *e = GET_ENTRY(li);
+   if (poll->backend == POLL_BACKEND_EPOLL) {
+      n = poll_epoll_collect(poll, queue);
+   } else {
+      CIRCLIST_SCAN(li, poll->list_device) {
+         struct poll_entry *e = GET_ENTRY(li);
 
-      ASSERT(e->type == POLL_CB_DEVICE);
+         ASSERT(e->type == POLL_CB_DEVICE);
 
-      if (poll_entry_active(poll, e)) {
-         queue[n++] = e;
-         poll_entry_ref(e);
+         if (poll_entry_active(poll, e)) {
+            queue[n++] = e;
+            poll_entry_ref(e);
+         }
       }
    }
 
@@ -744,11 +1302,11 @@ poll_get_next_expired(struct poll_loop *poll,
 {
    struct poll_entry *e;
 
-   if (circlist_empty(poll->list_time)) {
+   if (poll->heap_len == 0) {
       return NULL;
    }
 
-   e = GET_ENTRY(poll->list_time);
+   e = poll->heap_time[0];
 
    if (e->u.t.expiry <= now) {
       return e;
@@ -796,19 +1354,26 @@ poll_run_time_queue(struct poll_loop *poll)
 	 break;
       }
 
+      /*
+       * A one-shot entry can no longer be removed once it fires, while a
+       * permanent one may be removed from its own callback.
+       */
       poll_entry_ref(e);
-      poll_entry_dequeue(&poll->list_time, e);
+      poll_dequeue_time(poll, e);
+      if (e->permanent == 0) {
+         poll_time_hash_remove(poll, e);
+      }
       poll_entry_fire(e);
-      poll_entry_unref(poll, &e);
-      ASSERT(e->refCount > 0);
 
       if (e->permanent == 0) {
+         e->queued = 0;
          poll_entry_unref(poll, &e);
-         ASSERT(e == NULL);
-      } else {
+         ASSERT(e);
+      } else if (e->queued) {
          poll_recalc_expiry(e);
          poll_insert_time(poll, e);
       }
+      poll_entry_unref(poll, &e);
    }
 }
 
@@ -825,10 +1390,16 @@ static void
 poll_dopoll_device(struct poll_loop *poll,
                    mtime_t deadline)
 {
-   if (poll->use_poll) {
+   switch (poll->backend) {
+   case POLL_BACKEND_EPOLL:
+      poll_device_epoll(poll, deadline);
+      break;
+   case POLL_BACKEND_POLL:
       poll_device_poll(poll, deadline);
-   } else {
+      break;
+   default:
       poll_device_select(poll, deadline);
+      break;
    }
 }
 
@@ -888,6 +1459,8 @@ poll_insert_device(struct poll_loop *poll,
    s = hashtable_insert(poll->hash, &key, sizeof key, e);
    ASSERT(s);
 
+   poll_epoll_account(poll, e, 1);
+
    circlist_queue_item(&poll->list_device, &e->item);
    e->queued = 1;
 }
@@ -923,11 +1496,13 @@ poll_callback_time(struct poll_loop *poll,
    e->permanent    = permanent;
    e->refCount     = 0;
    e->u.t.delay      = delayUsec;
+   e->u.t.heapIdx    = -1;
 
    circlist_init_item(&e->item);
 
    poll_entry_ref(e);
    poll_recalc_expiry(e);
+   poll_time_hash_insert(poll, e);
    poll_insert_time(poll, e);
 }
 
@@ -989,28 +1564,28 @@ poll_callback_time_remove(struct poll_loop *poll,
                           pollcallback_fun callback,
                           void *callbackData)
 {
-   struct circlist_item **list;
-   struct circlist_item *li;
+   struct poll_time_key key;
+   struct poll_entry *e = NULL;
 
    LOG(1, (LGPFX" %s: unregistering TIME CB fun=%p data=%p.\n",
        __FUNCTION__, callback, callbackData));
 
-   list = &poll->list_time;
+   poll_get_time_key(callback, callbackData, permanent, &key);
+   if (!hashtable_lookup(poll->hash_time, &key, sizeof key, (void *)&e)) {
+      return 0;
+   }
 
-   CIRCLIST_SCAN(li, *list) {
-      struct poll_entry *e = GET_ENTRY(li);
+   ASSERT(e->type == POLL_CB_TIME);
+   ASSERT(e->queued == 1);
 
-      if (e->callback     == callback &&
-          e->callbackData == callbackData &&
-          e->permanent    == permanent) {
-         e->queued = 0;
-         poll_entry_dequeue(&poll->list_time, e);
-         poll_entry_unref(poll, &e);
-         return 1;
-      }
+   e->queued = 0;
+   poll_time_hash_remove(poll, e);
+   if (e->u.t.heapIdx >= 0) {
+      poll_dequeue_time(poll, e);
    }
+   poll_entry_unref(poll, &e);
 
-   return 0;
+   return 1;
 }
 
 
@@ -0,0 +1,21 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include "basic_defs.h"
+
+struct bufpool_stats {
+   uint64 numHits;     /* served from a thread cache */
+   uint64 numMisses;   /* size class cache empty: malloc'd */
+   uint64 numLarge;    /* above the largest size class */
+};
+
+void *bufpool_alloc(size_t len);
+void *bufpool_realloc(void *ptr, size_t len);
+void bufpool_free(void *ptr);
+size_t bufpool_get_size(const void *ptr);
+
+void bufpool_get_stats(struct bufpool_stats *stats);
+void bufpool_printstats(void);
+void bufpool_exit(void);
+
+#endif /* __BUFPOOL_H__ */
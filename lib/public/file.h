@@ -29,6 +29,9 @@ int file_pread(const struct file_descriptor *desc,
                uint64 offset, void *buf, size_t len, size_t *num);
 int file_pwrite(const struct file_descriptor *desc,
                 uint64 offset, const void *buf, size_t len, size_t *num);
+int file_mmap(const struct file_descriptor *desc,
+              uint64 offset, size_t len, void **addr);
+void file_munmap(void *addr, size_t len);
 int file_open(const char *name,
               bool readOnly,
               bool unbuf,
@@ -12,6 +12,7 @@ typedef void (hashtable_for_each_callback)(const void *key, size_t keyLen,
                                            void *cbData, void *keyData);
 
 struct hashtable *hashtable_create(void);
+struct hashtable *hashtable_create_fixed(const char *name, size_t keyLen);
 
 void hashtable_clear(struct hashtable *ht);
 void hashtable_clear_with_free(struct hashtable *ht);
@@ -17,6 +17,8 @@ typedef void (netasync_recv_callback)(struct netasync_socket *socket,
                                       size_t len,
                                       void *clientdata);
 
+typedef size_t (netasync_frame_fun)(const void *hdr, void *clientdata);
+
 time_t netasync_get_connect_ts(const struct netasync_socket *sock);
 struct netasync_socket* netasync_create(void);
 void netasync_close(struct netasync_socket *socket);
@@ -33,7 +35,15 @@ int netasync_receive(struct netasync_socket *sock,
                      void *buf, size_t bufLen, bool partial,
                      netasync_recv_callback *callback,
                      void *clientData);
+int netasync_receive_frames(struct netasync_socket *sock,
+                            size_t hdrLen,
+                            netasync_frame_fun *frameLen,
+                            netasync_recv_callback *callback,
+                            void *clientData);
 
+/*
+ * 'buf' must come from bufpool_alloc: it is released once written.
+ */
 int netasync_send(struct netasync_socket *sock,
                   const void *buf,
                   size_t len,
@@ -9,10 +9,18 @@ enum poll_type {
    POLL_CB_TIME,
 };
 
+enum poll_backend {
+   POLL_BACKEND_DEFAULT,
+   POLL_BACKEND_SELECT,
+   POLL_BACKEND_POLL,
+   POLL_BACKEND_EPOLL,
+};
+
 struct poll_loop;
 typedef void (pollcallback_fun)(void *clientdata);
 
 struct poll_loop *poll_create(void);
+struct poll_loop *poll_create_backend(enum poll_backend backend);
 void poll_destroy(struct poll_loop *poll);
 void poll_runloop(struct poll_loop *poll, volatile int *exit);
 
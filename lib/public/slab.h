@@ -0,0 +1,16 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "basic_defs.h"
+
+struct slab;
+
+struct slab *slab_create(const char *name, size_t objSize);
+void slab_destroy(struct slab *slab);
+void slab_reset(struct slab *slab);
+void slab_printstats(const struct slab *slab);
+
+void *slab_alloc(struct slab *slab);
+void slab_free(struct slab *slab, void *obj);
+
+#endif /* __SLAB_H__ */
@@ -70,6 +70,14 @@ void condvar_wait(struct condvar *cv, struct mutex *lock);
 void condvar_signal(struct condvar *cv);
 void condvar_free(struct condvar *cv);
 
+struct rwlock;
+
+struct rwlock *rwlock_alloc(void);
+void rwlock_free(struct rwlock *lock);
+void rwlock_rdlock(struct rwlock *lock);
+void rwlock_wrlock(struct rwlock *lock);
+void rwlock_unlock(struct rwlock *lock);
+
 /*
  * Log, ASSERTs and NOT_TESTED.
  */
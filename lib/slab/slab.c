@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "basic_defs.h"
+#include "util.h"
+#include "slab.h"
+
+#define LGPFX "SLAB:"
+
+/*
+ * A slab hands out objects of a single size, carved out of large anonymous
+ * mappings: allocating is a pointer bump and freeing pushes the object on a
+ * free list. Tearing down the slab unmaps the chunks without walking the
+ * objects.
+ */
+#define SLAB_CHUNK_SIZE (4 * 1024 * 1024)
+
+struct slab_chunk {
+   struct slab_chunk  *next;
+};
+
+struct slab_freeobj {
+   struct slab_freeobj *next;
+};
+
+struct slab {
+   char                *name;
+   size_t               objSize;
+   struct slab_chunk   *chunks;
+   uint8               *cur;
+   uint8               *end;
+   struct slab_freeobj *freeList;
+   uint32               numChunks;
+   uint64               numObjs;
+   uint64               numAllocs;
+};
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * slab_create --
+ *
+ *---------------------------------------------------------------------
+ */
+
+struct slab *
+slab_create(const char *name,
+            size_t objSize)
+{
+   struct slab *slab;
+
+   ASSERT(objSize > 0);
+   ASSERT(objSize <= SLAB_CHUNK_SIZE - sizeof(struct slab_chunk));
+
+   slab = safe_calloc(1, sizeof *slab);
+   slab->name = safe_strdup(name);
+   slab->objSize = ROUNDUP(MAX(objSize, sizeof(struct slab_freeobj)),
+                           sizeof(void *));
+   return slab;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * slab_add_chunk --
+ *
+ *---------------------------------------------------------------------
+ */
+
+static void
+slab_add_chunk(struct slab *slab)
+{
+   struct slab_chunk *chunk;
+   void *p;
+
+   p = mmap(NULL, SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANON, -1, 0);
+   if (p == MAP_FAILED) {
+      Panic(LGPFX" %s: failed to map %u bytes: %s\n",
+            slab->name, SLAB_CHUNK_SIZE, strerror(errno));
+   }
+
+   chunk = p;
+   chunk->next = slab->chunks;
+   slab->chunks = chunk;
+   slab->numChunks++;
+
+   slab->cur = (uint8 *)p + ROUNDUP(sizeof *chunk, sizeof(void *));
+   slab->end = (uint8 *)p + SLAB_CHUNK_SIZE;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * slab_alloc --
+ *
+ *---------------------------------------------------------------------
+ */
+
+void *
+slab_alloc(struct slab *slab)
+{
+   void *obj;
+
+   slab->numObjs++;
+   slab->numAllocs++;
+
+   if (slab->freeList) {
+      obj = slab->freeList;
+      slab->freeList = slab->freeList->next;
+      return obj;
+   }
+
+   if (slab->cur + slab->objSize > slab->end) {
+      slab_add_chunk(slab);
+   }
+   obj = slab->cur;
+   slab->cur += slab->objSize;
+
+   return obj;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * slab_free --
+ *
+ *---------------------------------------------------------------------
+ */
+
+void
+slab_free(struct slab *slab,
+          void        *obj)
+{
+   struct slab_freeobj *fo = obj;
+
+   ASSERT(slab->numObjs > 0);
+
+   fo->next = slab->freeList;
+   slab->freeList = fo;
+   slab->numObjs--;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * slab_reset --
+ *
+ *      Releases all the objects at once.
+ *
+ *---------------------------------------------------------------------
+ */
+
+void
+slab_reset(struct slab *slab)
+{
+   while (slab->chunks) {
+      struct slab_chunk *next = slab->chunks->next;
+
+      munmap(slab->chunks, SLAB_CHUNK_SIZE);
+      slab->chunks = next;
+   }
+   slab->cur       = NULL;
+   slab->end       = NULL;
+   slab->freeList  = NULL;
+   slab->numChunks = 0;
+   slab->numObjs   = 0;
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * slab_printstats --
+ *
+ *---------------------------------------------------------------------
+ */
+
+void
+slab_printstats(const struct slab *slab)
+{
+   if (slab->numAllocs == 0) {
+      return;
+   }
+
+   Log(LGPFX" %s: objSize=%zu numObjs=%llu numAllocs=%llu numChunks=%u (%u MB)\n",
+       slab->name, slab->objSize, slab->numObjs, slab->numAllocs,
+       slab->numChunks, slab->numChunks * (SLAB_CHUNK_SIZE / 1024 / 1024));
+}
+
+
+/*
+ *---------------------------------------------------------------------
+ *
+ * slab_destroy --
+ *
+ *---------------------------------------------------------------------
+ */
+
+void
+slab_destroy(struct slab *slab)
+{
+   if (slab == NULL) {
+      return;
+   }
+   slab_reset(slab);
+   free(slab->name);
+   free(slab);
+}
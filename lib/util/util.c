@@ -38,6 +38,10 @@ struct condvar {
    pthread_cond_t   condvar;
 };
 
+struct rwlock {
+   pthread_rwlock_t lck;
+};
+
 static struct {
    struct mutex *lock;
    int           verboseLog;
@@ -201,6 +205,122 @@ condvar_signal(struct condvar *cv)
 }
 
 
+/*
+ *------------------------------------------------------------------------
+ *
+ * rwlock_alloc --
+ *
+ *      Unlike the mutexes, reader/writer locks are not recursive. Writers
+ *      get the preference when possible so that a steady flow of readers
+ *      cannot starve them: a reader must not take the lock twice either.
+ *
+ *------------------------------------------------------------------------
+ */
+
+struct rwlock *
+rwlock_alloc(void)
+{
+   pthread_rwlockattr_t attr;
+   struct rwlock *lock;
+   int res;
+
+   pthread_rwlockattr_init(&attr);
+#ifdef linux
+   pthread_rwlockattr_setkind_np(&attr,
+                                 PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+   lock = safe_malloc(sizeof *lock);
+   res = pthread_rwlock_init(&lock->lck, &attr);
+   ASSERT(res == 0);
+   pthread_rwlockattr_destroy(&attr);
+
+   return lock;
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * rwlock_free --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+rwlock_free(struct rwlock *lock)
+{
+   if (lock == NULL) {
+      return;
+   }
+   pthread_rwlock_destroy(&lock->lck);
+   free(lock);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * rwlock_rdlock --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+rwlock_rdlock(struct rwlock *lock)
+{
+   int res;
+
+   if (lock == NULL) {
+      return;
+   }
+   res = pthread_rwlock_rdlock(&lock->lck);
+   ASSERT(res == 0);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * rwlock_wrlock --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+rwlock_wrlock(struct rwlock *lock)
+{
+   int res;
+
+   if (lock == NULL) {
+      return;
+   }
+   res = pthread_rwlock_wrlock(&lock->lck);
+   ASSERT(res == 0);
+}
+
+
+/*
+ *------------------------------------------------------------------------
+ *
+ * rwlock_unlock --
+ *
+ *------------------------------------------------------------------------
+ */
+
+void
+rwlock_unlock(struct rwlock *lock)
+{
+   int res;
+
+   if (lock == NULL) {
+      return;
+   }
+   res = pthread_rwlock_unlock(&lock->lck);
+   ASSERT(res == 0);
+}
+
+
 /*
  *------------------------------------------------------------------------
  *
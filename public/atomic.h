@@ -253,4 +253,21 @@ atomic64_cmpxchg(atomic_uint64 *var,
    return __sync_val_compare_and_swap(&var->value, old, new);
 }
 
+
+/*
+ *---------------------------------------------------------------------------
+ *
+ * atomic_mb --
+ *
+ *      Full memory barrier.
+ *
+ *---------------------------------------------------------------------------
+ */
+
+static inline void
+atomic_mb(void)
+{
+   __sync_synchronize();
+}
+
 #endif /* __ATOMIC_H__ */
@@ -47,6 +47,7 @@ enum btc_msg_type {
    BTC_MSG_FILTERCLEAR,
    BTC_MSG_MERKLEBLOCK,
    BTC_MSG_NOTFOUND,
+   BTC_MSG_SENDHEADERS,
    BTC_MSG_MAX,
 };
 
@@ -72,6 +73,7 @@ enum btc_proto_version {
    BTC_PROTO_PING        = 60000,
    BTC_PROTO_FILTERING   = 70002,
    BTC_PROTO_ADDR_W_TIME = 31402,
+   BTC_PROTO_SENDHEADERS = 70012,
 };
 
 
@@ -133,6 +135,7 @@ typedef struct btc_msg_alert {
 
 #define MAX_BLOOM_FILTER_SIZE   36000
 #define MAX_HASH_FUNCS          50
+#define MAX_FILTERADD_DATA_SIZE 520
 
 enum btc_msg_filter_flags {
    BLOOM_UPDATE_NONE            = 0,